@@ -0,0 +1,574 @@
+/******************************************************************************
+*                 SOFA, Simulation Open-Framework Architecture                *
+*                    (c) 2006 INRIA, USTL, UJF, CNRS, MGH                     *
+*                                                                             *
+* This program is free software; you can redistribute it and/or modify it     *
+* under the terms of the GNU General Public License as published by the Free  *
+* Software Foundation; either version 2 of the License, or (at your option)   *
+* any later version.                                                          *
+*                                                                             *
+* This program is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or       *
+* FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for    *
+* more details.                                                               *
+*                                                                             *
+* You should have received a copy of the GNU General Public License along     *
+* with this program. If not, see <http://www.gnu.org/licenses/>.              *
+*******************************************************************************
+* Authors: The SOFA Team and external contributors (see Authors.txt)          *
+*                                                                             *
+* Contact information: contact@sofa-framework.org                             *
+******************************************************************************/
+/// Headless benchmarks of the SofaPhysicsAPI extensions, run on the scenes shipped in Content/SofaScenes without UE.
+/// Each mode prints its measures on stdout. Modes with a target return a non zero code when it is missed, so they can run as a check.
+///
+/// Usage: SofaPhysicsBenchmark <pluginDir> <mode> <scene> [mode arguments]
+///  - pluginDir: folder holding sofa.ini, plugin_list.conf and the plugin libraries, as used by the application
+///  - haptic <scene> <meshName> [seconds] [rateHz] [toolRadius]: steps the scene as fast as possible while a device thread moves
+///    the tool through the mesh at the haptic rate, then reports the haptic loop jitter. Fails if a deadline was missed
+///  - renumber <scene> [steps]: loads the scene in file order, then with each DOF renumbering, and reports the mean step time of each
+///  - normals <scene> [steps] [meshName...]: steps the scene with the normals recomputed by SOFA in updateVisual, then with them disabled
+///    and recomputed by SofaPhysicsVertexNormals as in the plugin, and reports the cost of each path and the largest angle between them
+///  - budget <scene> <budgetMs> [steps] [minSolverIterations] [minConstraintIterations]: steps the scene with its own solver iterations, then
+///    within the step budget, and reports the step time distribution and the quality of each. Fails if the budgeted 95th percentile is over the budget
+///  - broadphase <scene> [steps]: loads the scene with its BruteForceBroadPhase, then with the sweep and prune, and reports the mean step time of each
+#include "SofaPhysicsAPI.h"
+#include "SofaPhysicsVertexNormals.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef WIN32
+#include <direct.h>
+#define SOFA_BENCHMARK_PLUGIN_EXTENSION ".dll"
+#else
+#include <unistd.h>
+#define SOFA_BENCHMARK_PLUGIN_EXTENSION ".so"
+#endif
+
+namespace
+{
+/// Same sequence as ASofaContext::loadDefaultPlugin: sofa.ini, then each plugin of plugin_list.conf by full path
+void loadPlugins(SofaPhysicsAPI& api, const std::string& pluginDir)
+{
+    api.loadSofaIni((pluginDir + "/sofa.ini").c_str());
+
+    std::ifstream pluginList(pluginDir + "/plugin_list.conf");
+    std::string line;
+    while (std::getline(pluginList, line))
+    {
+        std::istringstream in(line);
+        std::string pluginName;
+        if (!(in >> pluginName) || pluginName[0] == '#')
+            continue;
+        api.loadPlugin((pluginDir + "/" + pluginName + SOFA_BENCHMARK_PLUGIN_EXTENSION).c_str());
+    }
+}
+
+/// Load @param path from its own folder so relative mesh paths resolve, and start it. Return false on failure
+bool loadScene(SofaPhysicsAPI& api, const std::string& path)
+{
+    const std::size_t separator = path.find_last_of("/\\");
+    if (separator != std::string::npos)
+    {
+#ifdef WIN32
+        _chdir(path.substr(0, separator).c_str());
+#else
+        if (chdir(path.substr(0, separator).c_str()) != 0)
+            std::cerr << "[SofaPhysicsBenchmark] Could not change directory to the scene folder" << std::endl;
+#endif
+    }
+    if (api.load(path.c_str()) != API_SUCCESS)
+    {
+        std::cerr << "[SofaPhysicsBenchmark] Failed to load scene " << path << std::endl;
+        return false;
+    }
+    api.start();
+    return true;
+}
+
+double elapsedSeconds(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int runHaptic(SofaPhysicsAPI& api, int argc, char** argv)
+{
+    if (argc < 5)
+    {
+        std::cerr << "Usage: SofaPhysicsBenchmark <pluginDir> haptic <scene> <meshName> [seconds] [rateHz] [toolRadius]" << std::endl;
+        return 1;
+    }
+    if (!loadScene(api, argv[3]))
+        return 2;
+
+    SofaPhysicsOutputMesh* mesh = api.getOutputMeshPtr(argv[4]);
+    Real boxMin[3], boxMax[3];
+    if (mesh == nullptr || mesh->getBoundingBox(boxMin, boxMax) != API_SUCCESS)
+    {
+        std::cerr << "[SofaPhysicsBenchmark] No output mesh named " << argv[4] << std::endl;
+        return 2;
+    }
+
+    const double seconds = argc > 5 ? std::atof(argv[5]) : 10.0;
+    const double rateHz = argc > 6 ? std::atof(argv[6]) : 1000.0;
+    double extent = 0.0;
+    for (int c = 0; c < 3; ++c)
+        extent = std::max(extent, double(boxMax[c] - boxMin[c]));
+    const double toolRadius = argc > 7 ? std::atof(argv[7]) : 0.05 * extent;
+
+    if (api.startHapticLoop(argv[4], rateHz, 100.0, toolRadius) != API_SUCCESS)
+    {
+        std::cerr << "[SofaPhysicsBenchmark] Could not start the haptic loop" << std::endl;
+        return 2;
+    }
+
+    // the device: sweeps the tool back and forth through the box center along its largest axis, so it enters and leaves the surface
+    int axis = 0;
+    for (int c = 1; c < 3; ++c)
+    {
+        if (boxMax[c] - boxMin[c] > boxMax[axis] - boxMin[axis])
+            axis = c;
+    }
+    std::atomic<bool> running{ true };
+    unsigned long long nbContacts = 0;
+    std::thread device([&]()
+    {
+        const auto start = std::chrono::steady_clock::now();
+        const std::chrono::duration<double> period(1.0 / rateHz);
+        auto next = start;
+        while (running.load(std::memory_order_acquire))
+        {
+            double position[3];
+            for (int c = 0; c < 3; ++c)
+                position[c] = 0.5 * (boxMin[c] + boxMax[c]);
+            position[axis] += 0.6 * (boxMax[axis] - boxMin[axis]) * std::sin(elapsedSeconds(start));
+            api.setHapticToolPosition(position);
+
+            double force[3];
+            api.getHapticForce(force);
+            if (force[0] != 0.0 || force[1] != 0.0 || force[2] != 0.0)
+                ++nbContacts;
+
+            next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(period);
+            std::this_thread::sleep_until(next);
+        }
+    });
+
+    // the step load the loop must not be disturbed by
+    const auto start = std::chrono::steady_clock::now();
+    unsigned int nbSteps = 0;
+    while (elapsedSeconds(start) < seconds)
+    {
+        api.step();
+        ++nbSteps;
+    }
+
+    running.store(false, std::memory_order_release);
+    device.join();
+    SofaPhysicsHapticStats stats;
+    api.getHapticStats(&stats);
+    api.stopHapticLoop();
+
+    std::cout << "haptic " << argv[3] << " mesh=" << argv[4] << " rate=" << rateHz << "Hz toolRadius=" << toolRadius << std::endl;
+    std::cout << "  steps=" << nbSteps << " (" << 1000.0 * seconds / std::max(1u, nbSteps) << " ms/step)"
+        << " iterations=" << stats.nbIterations << " deviceSamplesInContact=" << nbContacts << std::endl;
+    std::cout << "  jitter mean=" << stats.meanJitterMs << "ms max=" << stats.maxJitterMs << "ms"
+        << " maxCompute=" << stats.maxComputeMs << "ms missedDeadlines=" << stats.nbMissedDeadlines << std::endl;
+    return stats.nbMissedDeadlines == 0 && stats.nbIterations > 0 ? 0 : 3;
+}
+
+/// Mean step time in ms of @param nbSteps steps of the loaded scene, after @param nbWarmup steps not measured
+double measureSteps(SofaPhysicsAPI& api, int nbSteps, int nbWarmup)
+{
+    for (int i = 0; i < nbWarmup; ++i)
+        api.step();
+
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < nbSteps; ++i)
+        api.step();
+    return 1000.0 * elapsedSeconds(start) / std::max(1, nbSteps);
+}
+
+int runRenumber(SofaPhysicsAPI& api, int argc, char** argv)
+{
+    const int nbSteps = argc > 4 ? std::atoi(argv[4]) : 500;
+    const std::pair<int, const char*> methods[] = { { API_RENUMBER_NONE, "file order" }, { API_RENUMBER_RCM, "RCM" }, { API_RENUMBER_MORTON, "Morton" } };
+
+    std::cout << "renumber " << argv[3] << " steps=" << nbSteps << std::endl;
+    double reference = 0.0;
+    for (const auto& method : methods)
+    {
+        api.setDofRenumbering(method.first);
+        if (!loadScene(api, argv[3]))
+            return 2;
+
+        // same trajectory for each order: the scene restarts from its rest state
+        const double stepMs = measureSteps(api, nbSteps, 20);
+        if (method.first == API_RENUMBER_NONE)
+            reference = stepMs;
+        std::cout << "  " << method.second << ": " << stepMs << " ms/step (" << 100.0 * (reference - stepMs) / reference << "% faster)" << std::endl;
+        api.unload();
+    }
+    return 0;
+}
+
+/// Persistent workers running body(i) over [0, count) in contiguous chunks, the calling thread taking the first one.
+/// Stands for UE ParallelFor in the normals benchmark, without paying a thread creation per call
+class ParallelForPool
+{
+public:
+    explicit ParallelForPool(unsigned int nbThreads)
+    {
+        for (unsigned int i = 1; i < nbThreads; ++i)
+            m_workers.emplace_back([this, i]() { work(i); });
+    }
+
+    ~ParallelForPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        for (std::thread& worker : m_workers)
+            worker.join();
+    }
+
+    void operator()(int count, const std::function<void(int)>& body)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_body = &body;
+            m_count = count;
+            m_pending = int(m_workers.size());
+            ++m_generation;
+        }
+        m_wake.notify_all();
+        runChunk(0);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait(lock, [this]() { return m_pending == 0; });
+    }
+
+private:
+    void runChunk(unsigned int chunk)
+    {
+        const int nbChunks = int(m_workers.size()) + 1;
+        const int begin = int((long long)m_count * chunk / nbChunks);
+        const int end = int((long long)m_count * (chunk + 1) / nbChunks);
+        for (int i = begin; i < end; ++i)
+            (*m_body)(i);
+    }
+
+    void work(unsigned int chunk)
+    {
+        unsigned long long generation = 0;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [&]() { return m_stop || m_generation != generation; });
+                if (m_stop)
+                    return;
+                generation = m_generation;
+            }
+            runChunk(chunk);
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (--m_pending == 0)
+                m_done.notify_one();
+        }
+    }
+
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    const std::function<void(int)>* m_body = nullptr;
+    int m_count = 0;
+    int m_pending = 0;
+    unsigned long long m_generation = 0;
+    bool m_stop = false;
+};
+
+/// Output mesh with the index buffer of FSofaMeshSection::build: triangles, then each quad split as (0, 1, 2) (0, 2, 3).
+/// Vertices are welded by equal position like FSofaMeshSection::buildSeamMap, so UV seams are smoothed as SOFA does through vertPosIdx
+struct NormalsMesh
+{
+    SofaPhysicsOutputMesh* mesh = nullptr;
+    std::vector<int> triangles;
+    std::vector<int> weld;
+    SofaPhysicsVertexNormals<double> normals;
+    std::vector<float> result;
+
+    explicit NormalsMesh(SofaPhysicsOutputMesh* sofaMesh) : mesh(sofaMesh)
+    {
+        const Index* sofaTriangles = mesh->getTriangles();
+        triangles.assign(sofaTriangles, sofaTriangles + std::size_t(mesh->getNbTriangles()) * 3);
+        const Index* quads = mesh->getQuads();
+        for (unsigned int q = 0; q < mesh->getNbQuads(); ++q)
+        {
+            const int split[6] = { 0, 1, 2, 0, 2, 3 };
+            for (int corner : split)
+                triangles.push_back(int(quads[q * 4 + corner]));
+        }
+        const unsigned int nbrV = mesh->getNbVertices();
+        const Real* positions = mesh->getVPositions();
+        std::map<std::array<Real, 3>, int> welded;
+        weld.resize(nbrV);
+        for (unsigned int v = 0; v < nbrV; ++v)
+            weld[v] = welded.emplace(std::array<Real, 3>{ positions[v * 3], positions[v * 3 + 1], positions[v * 3 + 2] }, int(welded.size())).first->second;
+
+        normals.build(triangles.data(), int(triangles.size() / 3), int(nbrV), weld.data(), int(welded.size()));
+        result.resize(std::size_t(mesh->getNbVertices()) * 3);
+    }
+
+    template <class ParallelFor>
+    void compute(const ParallelFor& parallelFor)
+    {
+        const Real* positions = mesh->getVPositions();
+        normals.compute([positions](int v) { return positions + std::size_t(v) * 3; }, triangles.data(), parallelFor,
+            [this](int v, double x, double y, double z) { result[v * 3] = float(x); result[v * 3 + 1] = float(y); result[v * 3 + 2] = float(z); });
+    }
+};
+
+/// Output meshes named in argv[5..], all of them if none is given
+std::vector<SofaPhysicsOutputMesh*> findMeshes(SofaPhysicsAPI& api, int argc, char** argv)
+{
+    std::vector<SofaPhysicsOutputMesh*> meshes;
+    if (argc <= 5)
+    {
+        for (unsigned int i = 0; i < api.getNbOutputMeshes(); ++i)
+            meshes.push_back(api.getOutputMeshPtr(i));
+    }
+    for (int i = 5; i < argc; ++i)
+    {
+        if (SofaPhysicsOutputMesh* mesh = api.getOutputMeshPtr(argv[i]))
+            meshes.push_back(mesh);
+        else
+            std::cerr << "[SofaPhysicsBenchmark] No output mesh named " << argv[i] << std::endl;
+    }
+    return meshes;
+}
+
+int runNormals(SofaPhysicsAPI& api, int argc, char** argv)
+{
+    const int nbSteps = argc > 4 ? std::atoi(argv[4]) : 500;
+    ParallelForPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    const auto parallel = [&pool](int count, const std::function<void(int)>& body) { pool(count, body); };
+    const auto serial = [](int count, const std::function<void(int)>& body) { for (int i = 0; i < count; ++i) body(i); };
+
+    std::cout << "normals " << argv[3] << " steps=" << nbSteps << " threads=" << std::max(1u, std::thread::hardware_concurrency()) << std::endl;
+
+    // SOFA path: normals recomputed in updateVisual, inside the step
+    if (!loadScene(api, argv[3]))
+        return 2;
+    std::vector<SofaPhysicsOutputMesh*> meshes = findMeshes(api, argc, argv);
+    if (meshes.empty())
+        return 2;
+    for (SofaPhysicsOutputMesh* mesh : meshes)
+        mesh->setComputeNormals(true);
+    const double sofaStepMs = measureSteps(api, nbSteps, 20);
+
+    // both paths on the same deformed positions: largest angle between the SOFA normals and ours
+    double maxAngle = 0.0;
+    for (SofaPhysicsOutputMesh* mesh : meshes)
+    {
+        NormalsMesh normals(mesh);
+        normals.compute(parallel);
+        const Real* sofaNormals = mesh->getVNormals();
+        for (std::size_t i = 0; i < normals.result.size(); i += 3)
+        {
+            double dot = 0.0, sofaLength = 0.0, length = 0.0;
+            for (int c = 0; c < 3; ++c)
+            {
+                dot += double(sofaNormals[i + c]) * normals.result[i + c];
+                sofaLength += double(sofaNormals[i + c]) * sofaNormals[i + c];
+                length += double(normals.result[i + c]) * normals.result[i + c];
+            }
+            if (sofaLength > 0.0 && length > 0.0)
+                maxAngle = std::max(maxAngle, std::acos(std::min(1.0, dot / std::sqrt(sofaLength * length))));
+        }
+    }
+    api.unload();
+
+    // plugin path: SOFA normals off, SofaPhysicsVertexNormals after each step, same trajectory
+    if (!loadScene(api, argv[3]))
+        return 2;
+    meshes = findMeshes(api, argc, argv);
+    std::vector<NormalsMesh> normalsMeshes;
+    normalsMeshes.reserve(meshes.size());
+    for (SofaPhysicsOutputMesh* mesh : meshes)
+    {
+        mesh->setComputeNormals(false);
+        normalsMeshes.emplace_back(mesh);
+    }
+    for (int i = 0; i < 20; ++i)
+        api.step();
+
+    double stepSeconds = 0.0, parallelSeconds = 0.0, serialSeconds = 0.0;
+    for (int i = 0; i < nbSteps; ++i)
+    {
+        auto start = std::chrono::steady_clock::now();
+        api.step();
+        stepSeconds += elapsedSeconds(start);
+
+        start = std::chrono::steady_clock::now();
+        for (NormalsMesh& normals : normalsMeshes)
+            normals.compute(parallel);
+        parallelSeconds += elapsedSeconds(start);
+
+        start = std::chrono::steady_clock::now();
+        for (NormalsMesh& normals : normalsMeshes)
+            normals.compute(serial);
+        serialSeconds += elapsedSeconds(start);
+    }
+    api.unload();
+
+    const double stepMs = 1000.0 * stepSeconds / std::max(1, nbSteps);
+    const double parallelMs = 1000.0 * parallelSeconds / std::max(1, nbSteps);
+    const double serialMs = 1000.0 * serialSeconds / std::max(1, nbSteps);
+    for (const NormalsMesh& normals : normalsMeshes)
+        std::cout << "  mesh " << normals.mesh->getName() << ": " << normals.mesh->getNbVertices() << " vertices, " << normals.triangles.size() / 3 << " triangles" << std::endl;
+    std::cout << "  SOFA normals: " << sofaStepMs << " ms/step, " << sofaStepMs - stepMs << " ms/step spent on the normals" << std::endl;
+    std::cout << "  plugin normals: " << stepMs << " ms/step + " << parallelMs << " ms parallel (" << serialMs << " ms on one thread)" << std::endl;
+    std::cout << "  max angle to the SOFA normals: " << maxAngle * 180.0 / 3.14159265358979323846 << " deg" << std::endl;
+    return 0;
+}
+
+/// Step time mean, 95th percentile and max in ms, plus the mean and lowest quality, of @param nbSteps steps of the loaded scene
+struct BudgetRun
+{
+    double meanMs = 0.0;
+    double p95Ms = 0.0;
+    double maxMs = 0.0;
+    double meanQuality = 0.0;
+    double minQuality = 1.0;
+};
+
+BudgetRun measureBudget(SofaPhysicsAPI& api, int nbSteps)
+{
+    BudgetRun run;
+    std::vector<double> stepMs;
+    stepMs.reserve(std::size_t(std::max(0, nbSteps)));
+    for (int i = 0; i < nbSteps; ++i)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        api.step();
+        stepMs.push_back(1000.0 * elapsedSeconds(start));
+
+        const double quality = api.getStepQuality();
+        run.meanQuality += quality;
+        run.minQuality = std::min(run.minQuality, quality);
+    }
+    if (stepMs.empty())
+        return run;
+
+    for (double ms : stepMs)
+        run.meanMs += ms;
+    run.meanMs /= double(stepMs.size());
+    run.meanQuality /= double(stepMs.size());
+    std::sort(stepMs.begin(), stepMs.end());
+    run.p95Ms = stepMs[std::min(stepMs.size() - 1, std::size_t(0.95 * double(stepMs.size())))];
+    run.maxMs = stepMs.back();
+    return run;
+}
+
+int runBudget(SofaPhysicsAPI& api, int argc, char** argv)
+{
+    if (argc < 5)
+    {
+        std::cerr << "Usage: SofaPhysicsBenchmark <pluginDir> budget <scene> <budgetMs> [steps] [minSolverIterations] [minConstraintIterations]" << std::endl;
+        return 1;
+    }
+    const double budgetMs = std::atof(argv[4]);
+    const int nbSteps = argc > 5 ? std::atoi(argv[5]) : 1000;
+    const int minSolverIterations = argc > 6 ? std::atoi(argv[6]) : 5;
+    const int minConstraintIterations = argc > 7 ? std::atoi(argv[7]) : 50;
+
+    std::cout << "budget " << argv[3] << " budget=" << budgetMs << "ms steps=" << nbSteps
+        << " minSolverIterations=" << minSolverIterations << " minConstraintIterations=" << minConstraintIterations << std::endl;
+
+    BudgetRun budgeted;
+    for (const bool withBudget : { false, true })
+    {
+        // same trajectory for both runs: the scene restarts from its rest state, the budget is applied once it is loaded
+        if (!loadScene(api, argv[3]))
+            return 2;
+        api.setStepBudget(withBudget ? budgetMs : 0.0, minSolverIterations, minConstraintIterations);
+
+        const BudgetRun run = measureBudget(api, nbSteps);
+        std::cout << "  " << (withBudget ? "budgeted" : "scene iterations") << ": mean=" << run.meanMs << "ms p95=" << run.p95Ms << "ms max=" << run.maxMs << "ms"
+            << " quality mean=" << run.meanQuality << " min=" << run.minQuality << " degradedSteps=" << api.getNbDegradedSteps() << std::endl;
+        if (withBudget)
+            budgeted = run;
+        api.unload();
+    }
+    return budgeted.p95Ms <= budgetMs ? 0 : 3;
+}
+
+int runBroadPhase(SofaPhysicsAPI& api, int argc, char** argv)
+{
+    const int nbSteps = argc > 4 ? std::atoi(argv[4]) : 500;
+
+    std::cout << "broadphase " << argv[3] << " steps=" << nbSteps << std::endl;
+    double reference = 0.0;
+    for (const bool upgrade : { false, true })
+    {
+        api.setBroadPhaseUpgrade(upgrade);
+        if (!loadScene(api, argv[3]))
+            return 2;
+
+        const double stepMs = measureSteps(api, nbSteps, 20);
+        if (!upgrade)
+            reference = stepMs;
+        std::cout << "  " << (upgrade ? "sweep and prune" : "brute force") << ": " << stepMs << " ms/step (" << 100.0 * (reference - stepMs) / reference << "% faster)" << std::endl;
+        api.unload();
+    }
+    return 0;
+}
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 4)
+    {
+        std::cerr << "Usage: SofaPhysicsBenchmark <pluginDir> <mode> <scene> [mode arguments], mode: haptic, renumber, normals, budget, broadphase" << std::endl;
+        return 1;
+    }
+
+    SofaPhysicsAPI api(false);
+    api.activateMessageHandler(false);
+    loadPlugins(api, argv[1]);
+
+    const std::string mode = argv[2];
+    if (mode == "haptic")
+        return runHaptic(api, argc, argv);
+    if (mode == "renumber")
+        return runRenumber(api, argc, argv);
+    if (mode == "normals")
+        return runNormals(api, argc, argv);
+    if (mode == "budget")
+        return runBudget(api, argc, argv);
+    if (mode == "broadphase")
+        return runBroadPhase(api, argc, argv);
+
+    std::cerr << "[SofaPhysicsBenchmark] Unknown mode " << mode << std::endl;
+    return 1;
+}
@@ -0,0 +1,393 @@
+/******************************************************************************
+*                 SOFA, Simulation Open-Framework Architecture                *
+*                    (c) 2006 INRIA, USTL, UJF, CNRS, MGH                     *
+*                                                                             *
+* This program is free software; you can redistribute it and/or modify it     *
+* under the terms of the GNU General Public License as published by the Free  *
+* Software Foundation; either version 2 of the License, or (at your option)   *
+* any later version.                                                          *
+*                                                                             *
+* This program is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or       *
+* FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for    *
+* more details.                                                               *
+*                                                                             *
+* You should have received a copy of the GNU General Public License along     *
+* with this program. If not, see <http://www.gnu.org/licenses/>.              *
+*******************************************************************************
+* Authors: The SOFA Team and external contributors (see Authors.txt)          *
+*                                                                             *
+* Contact information: contact@sofa-framework.org                             *
+******************************************************************************/
+/// Simulation host process: runs a SofaPhysicsAPI out of the application process and talks to it through the
+/// shared memory region described in SofaPhysicsSharedMemory.h. A crash or hang of SOFA only takes this process down.
+///
+/// Usage: SofaPhysicsHost <regionName> <pluginDir> [maxCommandSeconds] [parentPid]
+///  - regionName: name of the region created by the application (without the leading '/' on POSIX)
+///  - pluginDir: folder holding sofa.ini, plugin_list.conf and the plugin libraries, as used by the application in process mode
+///  - maxCommandSeconds: longest a single command (load, step) may run before the heartbeat stops and the application sees a hang, 120 by default
+///  - parentPid: process the host belongs to, it exits when that process is gone. The parent process on POSIX if omitted
+#include "SofaPhysicsAPI.h"
+#include "SofaPhysicsSharedMemory.h"
+
+#include <sofa/helper/system/thread/CTime.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <direct.h>
+#define SOFA_HOST_PLUGIN_EXTENSION ".dll"
+#else
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SOFA_HOST_PLUGIN_EXTENSION ".so"
+#endif
+
+namespace
+{
+/// Map the region created by the application, null on failure
+SofaPhysicsShmHeader* mapRegion(const std::string& name)
+{
+#ifdef WIN32
+    HANDLE mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+    if (mapping == nullptr)
+        return nullptr;
+    void* view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    // the view keeps the mapping alive
+    CloseHandle(mapping);
+#else
+    const int fd = shm_open(("/" + name).c_str(), O_RDWR, 0);
+    if (fd < 0)
+        return nullptr;
+    struct stat info;
+    void* view = nullptr;
+    if (fstat(fd, &info) == 0 && info.st_size >= static_cast<off_t>(sizeof(SofaPhysicsShmHeader)))
+    {
+        view = mmap(nullptr, static_cast<std::size_t>(info.st_size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (view == MAP_FAILED)
+            view = nullptr;
+    }
+    close(fd);
+#endif
+    SofaPhysicsShmHeader* header = static_cast<SofaPhysicsShmHeader*>(view);
+    if (header == nullptr || header->magic != SOFA_SHM_MAGIC || header->version != SOFA_SHM_VERSION)
+        return nullptr;
+    return header;
+}
+
+#ifdef WIN32
+HANDLE parentProcess = nullptr;
+#else
+pid_t parentPid = 0;
+#endif
+
+/// Remember the application process, @param pid 0 for the parent process
+void watchParent(unsigned long pid)
+{
+#ifdef WIN32
+    // a waitable handle, the pid alone could be reused by another process once the application is gone
+    if (pid != 0)
+        parentProcess = OpenProcess(SYNCHRONIZE, FALSE, static_cast<DWORD>(pid));
+    if (parentProcess == nullptr)
+        std::cerr << "[SofaPhysicsHost] No parent process to watch, the host will not exit on its own" << std::endl;
+#else
+    parentPid = pid != 0 ? static_cast<pid_t>(pid) : getppid();
+#endif
+}
+
+bool isParentAlive()
+{
+#ifdef WIN32
+    return parentProcess == nullptr || WaitForSingleObject(parentProcess, 0) == WAIT_TIMEOUT;
+#else
+    // reparented to init or a subreaper when the parent dies, kill(0) covers an explicit pid
+    return getppid() == parentPid || kill(parentPid, 0) == 0;
+#endif
+}
+
+long long steadyMilliseconds()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// Start time of the command the main thread runs, 0 while it waits for commands
+std::atomic<long long> commandStart{ 0 };
+
+/// Body of the heartbeat thread: beat while the main thread is idle or in a command younger than @param maxCommandMs, so a long
+/// load or step is not taken for a hang while a stuck one still is. Ends the process as soon as the application is gone
+void beatLoop(SofaPhysicsShmHeader* header, long long maxCommandMs, const std::atomic<bool>& running)
+{
+    while (running.load(std::memory_order_acquire))
+    {
+        if (!isParentAlive())
+        {
+            std::cerr << "[SofaPhysicsHost] Application process is gone, exiting" << std::endl;
+            std::_Exit(3);
+        }
+
+        const long long start = commandStart.load(std::memory_order_acquire);
+        if (start == 0 || steadyMilliseconds() - start < maxCommandMs)
+            header->heartbeat.fetch_add(1, std::memory_order_relaxed);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+}
+
+void setError(SofaPhysicsShmHeader* header, const std::string& message)
+{
+    std::strncpy(header->error, message.c_str(), SOFA_SHM_TEXT_SIZE - 1);
+    header->error[SOFA_SHM_TEXT_SIZE - 1] = '\0';
+    std::cerr << "[SofaPhysicsHost] " << message << std::endl;
+}
+
+/// Same sequence as ASofaContext::loadDefaultPlugin: sofa.ini, then each plugin of plugin_list.conf by full path
+void loadPlugins(SofaPhysicsAPI& api, const std::string& pluginDir)
+{
+    api.loadSofaIni((pluginDir + "/sofa.ini").c_str());
+
+    std::ifstream pluginList(pluginDir + "/plugin_list.conf");
+    std::string line;
+    int nbLoaded = 0;
+    while (std::getline(pluginList, line))
+    {
+        std::istringstream in(line);
+        std::string pluginName;
+        if (!(in >> pluginName) || pluginName[0] == '#')
+            continue;
+        if (api.loadPlugin((pluginDir + "/" + pluginName + SOFA_HOST_PLUGIN_EXTENSION).c_str()) == API_SUCCESS)
+            ++nbLoaded;
+    }
+    std::cout << "[SofaPhysicsHost] Loaded " << nbLoaded << " plugins from " << pluginDir << std::endl;
+}
+
+/// Fill the mesh table and topology block from the loaded scene. Return false if it exceeds the region capacities
+bool publishTopology(SofaPhysicsAPI& api, SofaPhysicsShmHeader* header)
+{
+    uint32_t* indices = sofaShmIndices(header);
+    float* texCoords = sofaShmTexCoords(header);
+    uint32_t nbVertices = 0;
+    uint32_t nbTriangles = 0;
+    std::vector<int> quads;
+
+    header->nbMeshes = 0;
+    const unsigned int nbMeshes = api.getNbOutputMeshes();
+    for (unsigned int meshId = 0; meshId < nbMeshes && meshId < SOFA_SHM_MAX_MESHES; ++meshId)
+    {
+        // Entry i is output mesh i, publishFrame relies on it
+        SofaPhysicsOutputMesh* mesh = api.getOutputMeshPtr(meshId);
+        if (mesh == nullptr)
+        {
+            std::memset(&header->meshes[header->nbMeshes++], 0, sizeof(SofaPhysicsShmMesh));
+            continue;
+        }
+
+        const uint32_t meshVertices = mesh->getNbVertices();
+        const uint32_t meshTriangles = mesh->getNbTriangles();
+        const uint32_t meshQuads = mesh->getNbQuads();
+        if (nbVertices + meshVertices > header->maxVertices || nbTriangles + meshTriangles + 2 * meshQuads > header->maxTriangles)
+        {
+            setError(header, std::string("Scene exceeds the shared memory capacity at mesh '") + mesh->getName() + "'");
+            return false;
+        }
+
+        SofaPhysicsShmMesh& entry = header->meshes[header->nbMeshes++];
+        std::strncpy(entry.name, mesh->getName(), SOFA_SHM_NAME_SIZE - 1);
+        entry.name[SOFA_SHM_NAME_SIZE - 1] = '\0';
+        entry.nbVertices = meshVertices;
+        entry.nbTriangles = meshTriangles + 2 * meshQuads;
+        entry.firstVertex = nbVertices;
+        entry.firstIndex = nbTriangles * 3;
+
+        uint32_t* meshIndices = indices + entry.firstIndex;
+        mesh->getTriangles(reinterpret_cast<int*>(meshIndices));
+        quads.resize(std::size_t(meshQuads) * 4);
+        if (meshQuads > 0)
+            mesh->getQuads(quads.data());
+        // same split as FSofaMeshSection::build
+        uint32_t* quadIndices = meshIndices + std::size_t(meshTriangles) * 3;
+        for (uint32_t q = 0; q < meshQuads; ++q)
+        {
+            const int* quad = &quads[q * 4];
+            const uint32_t split[6] = { uint32_t(quad[0]), uint32_t(quad[1]), uint32_t(quad[2]), uint32_t(quad[0]), uint32_t(quad[2]), uint32_t(quad[3]) };
+            std::memcpy(quadIndices + q * 6, split, sizeof(split));
+        }
+        mesh->getVTexCoords(texCoords + std::size_t(entry.firstVertex) * 2);
+
+        nbVertices += meshVertices;
+        nbTriangles += entry.nbTriangles;
+    }
+    header->topologyRevision.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+/// Write positions and normals of all meshes in the next frame slot, then make it the latest
+void publishFrame(SofaPhysicsAPI& api, SofaPhysicsShmHeader* header, double stepDurationMs)
+{
+    const uint64_t frameId = header->latestFrame.load(std::memory_order_relaxed) + 1;
+    SofaPhysicsShmFrame* frame = sofaShmFrame(header, frameId);
+    float* positions = sofaShmFramePositions(frame);
+    float* normals = positions + std::size_t(header->maxVertices) * 3;
+
+    const uint64_t sequence = frame->sequence.load(std::memory_order_relaxed);
+    frame->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    for (uint32_t i = 0; i < header->nbMeshes; ++i)
+    {
+        SofaPhysicsOutputMesh* mesh = api.getOutputMeshPtr(i);
+        const SofaPhysicsShmMesh& entry = header->meshes[i];
+        if (mesh == nullptr || entry.nbVertices == 0 || mesh->getNbVertices() != entry.nbVertices)
+            continue;
+        mesh->getVPositions(positions + std::size_t(entry.firstVertex) * 3);
+        mesh->getVNormals(normals + std::size_t(entry.firstVertex) * 3);
+    }
+    frame->frameId = frameId;
+    frame->lastCommandId = header->lastCommandId.load(std::memory_order_relaxed);
+    frame->topologyRevision = header->topologyRevision.load(std::memory_order_relaxed);
+    frame->simulationTime = api.getTime();
+    frame->stepDurationMs = stepDurationMs;
+
+    frame->sequence.store(sequence + 2, std::memory_order_release);
+    header->latestFrame.store(frameId, std::memory_order_release);
+}
+
+/// Run the scene from its own folder so relative mesh paths resolve, as the application does in process mode
+int loadScene(SofaPhysicsAPI& api, const std::string& path)
+{
+    const std::size_t separator = path.find_last_of("/\\");
+    if (separator != std::string::npos)
+    {
+#ifdef WIN32
+        _chdir(path.substr(0, separator).c_str());
+#else
+        if (chdir(path.substr(0, separator).c_str()) != 0)
+            std::cerr << "[SofaPhysicsHost] Could not change directory to the scene folder" << std::endl;
+#endif
+    }
+    return api.load(path.c_str());
+}
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        std::cerr << "Usage: SofaPhysicsHost <regionName> <pluginDir> [maxCommandSeconds] [parentPid]" << std::endl;
+        return 1;
+    }
+
+    SofaPhysicsShmHeader* header = mapRegion(argv[1]);
+    if (header == nullptr)
+    {
+        std::cerr << "[SofaPhysicsHost] Could not map shared memory region '" << argv[1] << "'" << std::endl;
+        return 2;
+    }
+
+    const double maxCommandSeconds = argc > 3 ? std::atof(argv[3]) : 120.0;
+    watchParent(argc > 4 ? std::strtoul(argv[4], nullptr, 10) : 0);
+    std::atomic<bool> beating{ true };
+    std::thread heartbeat(beatLoop, header, static_cast<long long>((maxCommandSeconds > 0 ? maxCommandSeconds : 120.0) * 1000.0), std::cref(beating));
+
+    SofaPhysicsAPI api(false);
+    api.activateMessageHandler(false);
+    loadPlugins(api, argv[2]);
+    header->hostState.store(SOFA_SHM_HOST_READY, std::memory_order_release);
+
+    const double ticksPerMs = static_cast<double>(sofa::helper::system::thread::CTime::getTicksPerSec()) / 1000.0;
+    bool loaded = false;
+    bool running = true;
+    int idleLoops = 0;
+    while (running && isParentAlive())
+    {
+        SofaPhysicsShmCommand command;
+        bool processed = false;
+        while (running && sofaShmPopCommand(header, command))
+        {
+            processed = true;
+            commandStart.store(steadyMilliseconds(), std::memory_order_release);
+            command.text[SOFA_SHM_TEXT_SIZE - 1] = '\0';
+            switch (command.type)
+            {
+            case SOFA_SHM_CMD_LOAD:
+                header->error[0] = '\0';
+                loaded = loadScene(api, command.text) > 0 && publishTopology(api, header);
+                if (loaded)
+                {
+                    api.start();
+                    publishFrame(api, header, 0.0);
+                }
+                else if (header->error[0] == '\0')
+                {
+                    setError(header, std::string("Failed to load scene ") + command.text);
+                }
+                header->hostState.store(loaded ? SOFA_SHM_HOST_LOADED : SOFA_SHM_HOST_ERROR, std::memory_order_release);
+                break;
+            case SOFA_SHM_CMD_UNLOAD:
+                api.unload();
+                loaded = false;
+                header->hostState.store(SOFA_SHM_HOST_READY, std::memory_order_release);
+                break;
+            case SOFA_SHM_CMD_STEP:
+                if (loaded)
+                {
+                    const auto start = sofa::helper::system::thread::CTime::getFastTime();
+                    api.step();
+                    publishFrame(api, header, static_cast<double>(sofa::helper::system::thread::CTime::getFastTime() - start) / ticksPerMs);
+                }
+                break;
+            case SOFA_SHM_CMD_RESET:
+                api.reset();
+                break;
+            case SOFA_SHM_CMD_SET_TIMESTEP:
+                api.setTimeStep(command.values[0]);
+                break;
+            case SOFA_SHM_CMD_SET_GRAVITY:
+                api.setGravity(command.values);
+                break;
+            case SOFA_SHM_CMD_WAKE_UP:
+                api.wakeUp();
+                break;
+            case SOFA_SHM_CMD_SEND_VALUE:
+                api.sendValue(command.text, command.values[0]);
+                break;
+            case SOFA_SHM_CMD_QUIT:
+                running = false;
+                break;
+            default:
+                break;
+            }
+            header->lastCommandId.store(command.id, std::memory_order_release);
+            commandStart.store(0, std::memory_order_release);
+        }
+
+        // Spin a little after the last command for latency, then back off so an idle host costs nothing
+        idleLoops = processed ? 0 : idleLoops + 1;
+        if (idleLoops < 1000)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    if (loaded)
+        api.stop();
+    beating.store(false, std::memory_order_release);
+    heartbeat.join();
+    header->hostState.store(SOFA_SHM_HOST_EXITED, std::memory_order_release);
+    return 0;
+}
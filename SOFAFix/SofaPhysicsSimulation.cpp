@@ -21,6 +21,9 @@
 ******************************************************************************/
 #include "SofaPhysicsAPI.h"
 #include "SofaPhysicsSimulation.h"
+#include "SofaPhysicsBindings.h"
+#include "SofaPhysicsOutputMesh_impl.h"
+#include "SofaPhysicsTriangleBVH.h"
 
 #include <sofa/gl/gl.h>
 #include <sofa/gl/glu.h>
@@ -35,8 +38,25 @@
 #include <sofa/helper/BackTrace.h>
 #include <sofa/core/ObjectFactory.h>
 #include <sofa/core/objectmodel/GUIEvent.h>
+#include <sofa/core/loader/MeshLoader.h>
+#include <sofa/core/behavior/BaseMechanicalState.h>
+#include <sofa/core/behavior/BaseController.h>
+#include <sofa/core/behavior/BaseForceField.h>
+#include <sofa/core/behavior/BaseLinearSolver.h>
+#include <sofa/core/behavior/ConstraintSolver.h>
+#include <sofa/core/BaseMapping.h>
+#include <sofa/core/collision/BroadPhaseDetection.h>
+#include <sofa/core/collision/ContactManager.h>
+#include <sofa/core/collision/DetectionOutput.h>
+#include <sofa/core/collision/Intersection.h>
+#include <sofa/component/collision/geometry/CubeModel.h>
+#include <sofa/core/ConstraintParams.h>
 
 #include <sofa/simulation/graph/DAGSimulation.h>
+#include <sofa/simulation/CpuTask.h>
+#include <sofa/simulation/DefaultTaskScheduler.h>
+#include <sofa/simulation/MainTaskSchedulerFactory.h>
+#include <sofa/simulation/MainTaskSchedulerRegistry.h>
 #include <sofa/simulation/graph/init.h>
 
 #include <sofa/gui/common/GUIManager.h>
@@ -48,15 +68,40 @@
 
 #include <sofa/type/Vec.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <sstream>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+#ifdef WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #include <sofa/simulation/graph/SimpleApi.h>
 
 #include <sofa/component/init.h>
 
-SofaPhysicsAPI::SofaPhysicsAPI(bool useGUI, int GUIFramerate)
-    : impl(new SofaPhysicsSimulation(useGUI, GUIFramerate))
+SofaPhysicsAPI::SofaPhysicsAPI(bool useGUI, int GUIFramerate, const SofaPhysicsTaskSchedulerConfig* schedulerConfig)
+    : impl(new SofaPhysicsSimulation(useGUI, GUIFramerate, schedulerConfig))
 {
 }
 
@@ -124,6 +169,16 @@ int SofaPhysicsAPI::loadPlugin(const char* pluginPath)
     return impl->loadPlugin(pluginPath);
 }
 
+int SofaPhysicsAPI::setDofRenumbering(int method)
+{
+    return impl->setDofRenumbering(method);
+}
+
+int SofaPhysicsAPI::setBroadPhaseUpgrade(bool enable)
+{
+    return impl->setBroadPhaseUpgrade(enable);
+}
+
 void SofaPhysicsAPI::createScene()
 {
     return impl->createScene();
@@ -234,6 +289,137 @@ void SofaPhysicsAPI::setGravity(double* gravity)
     impl->setGravity(gravity);
 }
 
+int SofaPhysicsAPI::queueTimeStep(double dt)
+{
+    return impl->queueTimeStep(dt);
+}
+
+int SofaPhysicsAPI::queueGravity(const double* gravity)
+{
+    return impl->queueGravity(gravity);
+}
+
+int SofaPhysicsAPI::queueValue(const char* name, double value)
+{
+    return impl->queueValue(name, value);
+}
+
+int SofaPhysicsAPI::queueDataControllerValue(unsigned int controllerId, const char* value)
+{
+    return impl->queueDataControllerValue(controllerId, value);
+}
+
+unsigned int SofaPhysicsAPI::getNbQueuedCommands() const
+{
+    return impl->getNbQueuedCommands();
+}
+
+int SofaPhysicsAPI::applyQueuedCommands()
+{
+    impl->applyQueuedCommands();
+    return API_SUCCESS;
+}
+
+int SofaPhysicsAPI::setSleepThreshold(double maxVelocity, int quietSteps)
+{
+    return impl->setSleepThreshold(maxVelocity, quietSteps);
+}
+
+bool SofaPhysicsAPI::isSleeping() const
+{
+    return impl->isSleeping();
+}
+
+void SofaPhysicsAPI::wakeUp()
+{
+    impl->wakeUp();
+}
+
+int SofaPhysicsAPI::setStepBudget(double budgetMs, int minSolverIterations, int minConstraintIterations)
+{
+    return impl->setStepBudget(budgetMs, minSolverIterations, minConstraintIterations);
+}
+
+double SofaPhysicsAPI::getStepQuality() const
+{
+    return impl->getStepQuality();
+}
+
+unsigned int SofaPhysicsAPI::getNbDegradedSteps() const
+{
+    return impl->getNbDegradedSteps();
+}
+
+double SofaPhysicsAPI::getLastStepDuration() const
+{
+    return impl->getLastStepDuration();
+}
+
+int SofaPhysicsAPI::setAdaptiveTimeStep(bool enabled, double minDt, double maxDt)
+{
+    return impl->setAdaptiveTimeStep(enabled, minDt, maxDt);
+}
+
+double SofaPhysicsAPI::getLastStepDt() const
+{
+    return impl->getLastStepDt();
+}
+
+unsigned int SofaPhysicsAPI::getNbRollbacks() const
+{
+    return impl->getNbRollbacks();
+}
+
+int SofaPhysicsAPI::setContactExport(bool enabled, const char* modelNames)
+{
+    return impl->setContactExport(enabled, modelNames);
+}
+
+int SofaPhysicsAPI::getContacts(SofaPhysicsContacts* contacts) const
+{
+    return impl->getContacts(contacts);
+}
+
+unsigned int SofaPhysicsAPI::getNbCollisionModels() const
+{
+    return impl->getNbCollisionModels();
+}
+
+const char* SofaPhysicsAPI::getCollisionModelName(unsigned int modelId) const
+{
+    return impl->getCollisionModelName(modelId);
+}
+
+int SofaPhysicsAPI::startHapticLoop(const char* meshName, double rateHz, double stiffness, double toolRadius)
+{
+    return impl->startHapticLoop(meshName, rateHz, stiffness, toolRadius);
+}
+
+int SofaPhysicsAPI::stopHapticLoop()
+{
+    return impl->stopHapticLoop();
+}
+
+bool SofaPhysicsAPI::isHapticLoopRunning() const
+{
+    return impl->isHapticLoopRunning();
+}
+
+int SofaPhysicsAPI::setHapticToolPosition(const double* position)
+{
+    return impl->setHapticToolPosition(position);
+}
+
+int SofaPhysicsAPI::getHapticForce(double* force)
+{
+    return impl->getHapticForce(force);
+}
+
+int SofaPhysicsAPI::getHapticStats(SofaPhysicsHapticStats* stats)
+{
+    return impl->getHapticStats(stats);
+}
+
 int SofaPhysicsAPI::activateMessageHandler(bool value)
 {
     return impl->activateMessageHandler(value);
@@ -288,381 +474,2509 @@ SofaPhysicsDataController** SofaPhysicsAPI::getDataControllers()
 ////////////////////////////////////////
 ////////////////////////////////////////
 
-using namespace sofa::defaulttype;
-using namespace sofa::gl;
-using namespace sofa::core::objectmodel;
+class SofaPhysicsMeshBVH;
 
-static sofa::core::ObjectFactory::ClassEntry::SPtr classVisualModel;
-using sofa::helper::logging::MessageDispatcher;
-using sofa::helper::logging::LoggingMessageHandler;
+struct SofaPhysicsOutputMesh::Extension
+{
+    int  bboxRevision = -1;                     ///< vertices revision of the cached bounding box
+    Real bboxMin[3] = { 0, 0, 0 };              ///< cached bounding box min
+    Real bboxMax[3] = { 0, 0, 0 };              ///< cached bounding box max
+    std::shared_ptr<SofaPhysicsMeshBVH> bvh;    ///< raycast BVH, null if raycast is disabled. Always read and swapped with std::atomic_load/atomic_store
+    bool updateNormalsChanged = false;          ///< setComputeNormals overrode the scene value below
+    std::string sceneUpdateNormals;             ///< updateNormals as given by the scene
+};
 
-SofaPhysicsSimulation::SofaPhysicsSimulation(bool useGUI_, int GUIFramerate_)
-    : m_msgIsActivated(false)
-    , useGUI(useGUI_)
-    , GUIFramerate(GUIFramerate_)
+int SofaPhysicsOutputMesh::setComputeNormals(bool value)
 {
-    sofa::helper::init();
-    static bool first = true;
-    if (first)
-    {
-        if ( !useGUI )
-        {
-          // FakeGUI to be able to receive messages
-          FakeGUI::Create();
-        }
-        else
-        {
-          sofa::gui::common::init();
+    if (impl == nullptr || impl->getObject() == nullptr || m_extension == nullptr)
+        return API_MESH_NULL;
 
-          char* argv[]= { const_cast<char*>("a") };
+    // VisualModelImpl recomputes its normals in updateVisual() as long as this Data is true
+    sofa::core::objectmodel::BaseData* data = impl->getObject()->findData("updateNormals");
+    if (data == nullptr)
+        return API_MESH_NULL;
 
-          if (sofa::gui::common::GUIManager::Init(argv[0],"qt"))
-              std::cerr << "ERROR in sofa::gui::common::GUIManager::Init()" << std::endl;
+    if (!m_extension->updateNormalsChanged)
+    {
+        m_extension->sceneUpdateNormals = data->getValueString();
+        m_extension->updateNormalsChanged = true;
+    }
+    data->read(value ? "1" : "0");
+    return API_SUCCESS;
+}
 
-          if (sofa::gui::common::GUIManager::createGUI(NULL))
-              std::cerr << "ERROR in sofa::gui::common::GUIManager::CreateGUI()" << std::endl;
+int SofaPhysicsOutputMesh::resetComputeNormals()
+{
+    if (impl == nullptr || impl->getObject() == nullptr || m_extension == nullptr)
+        return API_MESH_NULL;
 
-          sofa::gui::common::GUIManager::SetDimension(600,600);
-        }
-        first = false;
-    }    
+    if (!m_extension->updateNormalsChanged)
+        return API_SUCCESS;
 
-    // create message handler
-    m_msgHandler = new LoggingMessageHandler();
-    MessageDispatcher::clearHandlers();
-    MessageDispatcher::addHandler(m_msgHandler);
+    sofa::core::objectmodel::BaseData* data = impl->getObject()->findData("updateNormals");
+    if (data == nullptr)
+        return API_MESH_NULL;
 
-    m_RootNode = NULL;
-    initGLDone = false;
-    initTexturesDone = false;
-    texLogo = nullptr;
-    lastW = 0;
-    lastH = 0;
-    vparams = sofa::core::visual::VisualParams::defaultInstance();
+    data->read(m_extension->sceneUpdateNormals);
+    m_extension->updateNormalsChanged = false;
+    return API_SUCCESS;
+}
 
-    // Initialize the simulation graph - THIS IS CRITICAL and was missing!
-    // Without this, getSimulation() returns null and causes crashes during load()
-    sofa::simulation::graph::init();
+int SofaPhysicsOutputMesh::getBoundingBox(Real* min, Real* max)
+{
+    if (impl == nullptr || impl->getObject() == nullptr || m_extension == nullptr)
+        return API_MESH_NULL;
 
-    assert(sofa::simulation::getSimulation());
+    const int revision = getVerticesRevision();
+    if (revision != m_extension->bboxRevision)
+    {
+        const unsigned int nbrV = getNbVertices();
+        const Real* positions = getVPositions();
 
-    sofa::component::init(); // force dependency on Sofa.Component
+        Real bmin[3] = { 0, 0, 0 };
+        Real bmax[3] = { 0, 0, 0 };
+        if (nbrV > 0 && positions != nullptr)
+        {
+            for (int c = 0; c < 3; ++c)
+                bmin[c] = bmax[c] = positions[c];
 
-    sofa::core::ObjectFactory::AddAlias("VisualModel", "OglModel", true,
-            &classVisualModel);
+            // branch free min/max over the packed Vec3 array, auto-vectorized by the compiler
+            for (unsigned int i = 1; i < nbrV; ++i)
+            {
+                const Real* p = positions + i * 3;
+                for (int c = 0; c < 3; ++c)
+                {
+                    bmin[c] = std::min(bmin[c], p[c]);
+                    bmax[c] = std::max(bmax[c], p[c]);
+                }
+            }
+        }
 
-    sofa::helper::system::PluginManager::getInstance().init();
+        for (int c = 0; c < 3; ++c)
+        {
+            m_extension->bboxMin[c] = bmin[c];
+            m_extension->bboxMax[c] = bmax[c];
+        }
+        m_extension->bboxRevision = revision;
+    }
 
-    timeTicks = sofa::helper::system::thread::CTime::getRefTicksPerSec();
-    frameCounter = 0;
-    currentFPS = 0.0;
-    lastRedrawTime = 0;
+    for (int c = 0; c < 3; ++c)
+    {
+        min[c] = m_extension->bboxMin[c];
+        max[c] = m_extension->bboxMax[c];
+    }
+    return API_SUCCESS;
 }
 
-SofaPhysicsSimulation::~SofaPhysicsSimulation()
+int SofaPhysicsOutputMesh::fillVertices(const SofaPhysicsVertexLayout& layout, void* dst, unsigned int stride)
 {
-    for (std::map<SofaOutputMesh*, SofaPhysicsOutputMesh*>::const_iterator it = outputMeshMap.begin(), itend = outputMeshMap.end(); it != itend; ++it)
-    {
-        if (it->second) delete it->second;
-    }
-    outputMeshMap.clear();
+    if (impl == nullptr || impl->getObject() == nullptr)
+        return API_MESH_NULL;
 
-    if ( useGUI ) {
-      // GUI Cleanup
-      //groot = dynamic_cast<sofa::simulation::Node*>( sofa::gui::common::GUIManager::CurrentSimulation() );
+    // each attribute must fit in one vertex, or it would overwrite the next vertex and run past the end of the buffer
+    auto fits = [stride](int offset, std::size_t size) { return offset < 0 || std::size_t(offset) + size <= stride; };
+    if (!fits(layout.positionOffset, 3 * sizeof(Real)) || !fits(layout.normalOffset, 3 * sizeof(Real)) || !fits(layout.texCoordOffset, 2 * sizeof(Real)))
+        return API_NULL;
 
-      //if (groot!=NULL)
-      //  sofa::simulation::getSimulation()->unload(groot);
+    const unsigned int nbrV = getNbVertices();
+    const Real* positions = layout.positionOffset >= 0 ? getVPositions() : nullptr;
+    const Real* normals = layout.normalOffset >= 0 ? getVNormals() : nullptr;
+    const Real* texCoords = layout.texCoordOffset >= 0 ? getVTexCoords() : nullptr;
+    if (nbrV == 0)
+        return API_SUCCESS;
+    if (dst == nullptr || (layout.positionOffset >= 0 && positions == nullptr) || (layout.normalOffset >= 0 && normals == nullptr) || (layout.texCoordOffset >= 0 && texCoords == nullptr))
+        return API_NULL;
 
+    const Real* m = layout.transform;
+    const Real sign = layout.flipNormals ? Real(-1) : Real(1);
 
-      //sofa::gui::common::GUIManager::closeGUI();
+    // normals go through the inverse transpose of the 3x3 part, so they stay orthogonal to the surface under non uniform scale or shear.
+    // It is the cofactor matrix over the determinant, only the determinant sign is kept since the result is renormalized
+    Real normalMatrix[9];
+    if (m)
+    {
+        for (int r = 0; r < 3; ++r)
+        {
+            for (int c = 0; c < 3; ++c)
+            {
+                const int r1 = (r + 1) % 3, r2 = (r + 2) % 3, c1 = (c + 1) % 3, c2 = (c + 2) % 3;
+                normalMatrix[r * 3 + c] = m[r1 * 4 + c1] * m[r2 * 4 + c2] - m[r1 * 4 + c2] * m[r2 * 4 + c1];
+            }
+        }
+        const Real det = m[0] * normalMatrix[0] + m[1] * normalMatrix[1] + m[2] * normalMatrix[2];
+        const Real normalSign = det < 0 ? -sign : sign;
+        for (Real& value : normalMatrix)
+            value *= normalSign;
     }
 
-    MessageDispatcher::rmHandler(m_msgHandler);
-    if (m_msgIsActivated)
-        m_msgHandler->deactivate();
-
-    if (m_msgHandler != nullptr)
+    char* vertex = static_cast<char*>(dst);
+    for (unsigned int i = 0; i < nbrV; ++i, vertex += stride)
     {
-        delete m_msgHandler;
-        m_msgHandler = nullptr;
-    }
-}
+        // memcpy through a local so unaligned offsets in the caller's layout are fine
+        if (positions)
+        {
+            const Real* p = positions + i * 3;
+            Real out[3] = { p[0], p[1], p[2] };
+            if (m)
+            {
+                for (int r = 0; r < 3; ++r)
+                    out[r] = m[r * 4] * p[0] + m[r * 4 + 1] * p[1] + m[r * 4 + 2] * p[2] + m[r * 4 + 3];
+            }
+            std::memcpy(vertex + layout.positionOffset, out, sizeof(out));
+        }
 
-const char *SofaPhysicsSimulation::APIName()
-{
-    return "SofaPhysicsSimulation API";
+        if (normals)
+        {
+            const Real* n = normals + i * 3;
+            Real out[3] = { sign * n[0], sign * n[1], sign * n[2] };
+            if (m)
+            {
+                for (int r = 0; r < 3; ++r)
+                    out[r] = normalMatrix[r * 3] * n[0] + normalMatrix[r * 3 + 1] * n[1] + normalMatrix[r * 3 + 2] * n[2];
+
+                const Real norm = std::sqrt(out[0] * out[0] + out[1] * out[1] + out[2] * out[2]);
+                if (norm > 0)
+                {
+                    for (int c = 0; c < 3; ++c)
+                        out[c] /= norm;
+                }
+            }
+            std::memcpy(vertex + layout.normalOffset, out, sizeof(out));
+        }
+
+        if (texCoords)
+        {
+            std::memcpy(vertex + layout.texCoordOffset, texCoords + i * 2, 2 * sizeof(Real));
+        }
+    }
+    return API_SUCCESS;
 }
 
-int SofaPhysicsSimulation::load(const char* cfilename)
+/// Raycast data of one output mesh: the shared triangle BVH and a private copy of the positions it was refit to.
+/// Built once per topology revision, then only the boxes are refit from the copy, so queries never read the
+/// SOFA buffers that animate() is writing.
+class SofaPhysicsMeshBVH
 {
-    std::string filename = cfilename;
-    sofa::helper::BackTrace::autodump();
+public:
+    typedef SofaPhysicsTriangleBVH<Real> Tree;
 
-    sofa::helper::system::DataRepository.findFile(filename);
-    m_RootNode = sofa::simulation::node::load(filename.c_str());
-    int result = API_SUCCESS;
-    if (m_RootNode.get())
+    /// true if the tree matches the given topology and vertex count
+    bool isBuiltFor(int trianglesRevision, int quadsRevision, unsigned int nbV) const
     {
-        sceneFileName = filename;
-        sofa::simulation::node::initRoot(m_RootNode.get());
-        result = updateOutputMeshes();
+        return m_tree.isValid() && trianglesRevision == m_trianglesRevision && quadsRevision == m_quadsRevision && nbV * 3 == m_positions.size();
+    }
 
-        if ( useGUI ) {
-          sofa::gui::common::GUIManager::SetScene(m_RootNode.get(),cfilename);
+    void build(SofaPhysicsOutputMesh* mesh)
+    {
+        m_tree.reset();
+        m_positions.clear();
+        m_verticesRevision = -1;
+        m_trianglesRevision = mesh->getTrianglesRevision();
+        m_quadsRevision = mesh->getQuadsRevision();
+
+        const unsigned int nbV = mesh->getNbVertices();
+        const unsigned int nbTri = mesh->getNbTriangles();
+        const unsigned int nbQuad = mesh->getNbQuads();
+        const Real* positions = mesh->getVPositions();
+        const Index* triangles = mesh->getTriangles();
+        const Index* quads = mesh->getQuads();
+        if (nbV == 0 || positions == nullptr || nbTri + nbQuad == 0)
+            return;
+
+        // Same numbering as the raycast output: triangles, then quads split in 2
+        std::vector<Index> allIndices;
+        allIndices.reserve((nbTri + 2 * nbQuad) * 3);
+        allIndices.insert(allIndices.end(), triangles, triangles + nbTri * 3);
+        for (unsigned int q = 0; q < nbQuad; ++q)
+        {
+            const Index* quad = quads + q * 4;
+            allIndices.insert(allIndices.end(), { quad[0], quad[1], quad[2], quad[0], quad[2], quad[3] });
         }
+
+        m_positions.assign(positions, positions + nbV * 3);
+        m_tree.build(vertexReader(), allIndices.data(), int(allIndices.size() / 3));
+        m_verticesRevision = mesh->getVerticesRevision();
     }
-    else
+
+    /// Copy the new positions and refit the boxes bottom-up. Leaves whose vertices did not move, and parents of unchanged children, are skipped.
+    void refit(SofaPhysicsOutputMesh* mesh)
     {
-        m_RootNode = sofa::simulation::getSimulation()->createNewGraph("");
-        return API_SCENE_FAILED;
+        const int revision = mesh->getVerticesRevision();
+        const Real* positions = mesh->getVPositions();
+        if (revision == m_verticesRevision || positions == nullptr)
+            return;
+
+        const std::vector<int>& leafIndices = m_tree.getLeafIndices();
+        const auto leafMoved = [&](int first, int last)
+        {
+            for (int k = first; k < last; ++k)
+            {
+                const std::size_t v = std::size_t(leafIndices[k]) * 3;
+                if (positions[v] != m_positions[v] || positions[v + 1] != m_positions[v + 1] || positions[v + 2] != m_positions[v + 2])
+                    return true;
+            }
+            return false;
+        };
+
+        // the comparison reads the previous positions, the boxes the new ones
+        m_tree.refitIf([positions](int v) { return positions + std::size_t(v) * 3; }, leafMoved);
+        std::copy(positions, positions + m_positions.size(), m_positions.begin());
+        m_verticesRevision = revision;
     }
-    initTexturesDone = false;
-    lastW = 0;
-    lastH = 0;
-    lastRedrawTime = sofa::helper::system::thread::CTime::getRefTime();
 
-    return result;
-}
+    bool raycast(const Real* origin, const Real* direction, Real maxDistance, Tree::Hit& hit) const
+    {
+        return m_tree.raycast(vertexReader(), origin, direction, maxDistance, hit);
+    }
 
-int SofaPhysicsSimulation::unload()
+    /// Readers (raycast) take it shared, the refit at the end of a step takes it exclusive
+    mutable std::shared_mutex m_mutex;
+
+protected:
+    auto vertexReader() const
+    {
+        const Real* positions = m_positions.data();
+        return [positions](int v) { return positions + std::size_t(v) * 3; };
+    }
+
+    Tree m_tree;
+    std::vector<Real> m_positions;   ///< positions at the last refit
+    int m_verticesRevision = -1;
+    int m_trianglesRevision = -1;
+    int m_quadsRevision = -1;
+};
+
+int SofaPhysicsOutputMesh::setRaycastEnabled(bool value)
 {
-    if (m_RootNode.get())
+    if (m_extension == nullptr)
+        return API_MESH_NULL;
+
+    if (!value)
     {
-        sofa::simulation::node::unload(m_RootNode);
+        // queries running on other threads keep their own reference until they return
+        std::atomic_store(&m_extension->bvh, std::shared_ptr<SofaPhysicsMeshBVH>());
+        return API_SUCCESS;
     }
-    else
+
+    if (impl == nullptr || impl->getObject() == nullptr)
+        return API_MESH_NULL;
+
+    if (std::atomic_load(&m_extension->bvh) == nullptr)
     {
-        msg_error("SofaPhysicsSimulation") << "Error: can't get scene root node.";
-        return API_SCENE_NULL;
+        std::shared_ptr<SofaPhysicsMeshBVH> bvh = std::make_shared<SofaPhysicsMeshBVH>();
+        bvh->build(this);
+        std::atomic_store(&m_extension->bvh, bvh);
     }
+    return API_SUCCESS;
+}
+
+void SofaPhysicsOutputMesh::refitRaycast()
+{
+    if (m_extension == nullptr)
+        return;
+
+    const std::shared_ptr<SofaPhysicsMeshBVH> bvh = std::atomic_load(&m_extension->bvh);
+    if (bvh == nullptr)
+        return;
+
+    std::unique_lock<std::shared_mutex> lock(bvh->m_mutex);
+    if (!bvh->isBuiltFor(getTrianglesRevision(), getQuadsRevision(), getNbVertices()))
+        bvh->build(this);
+    else
+        bvh->refit(this);
+}
+
+int SofaPhysicsOutputMesh::raycast(unsigned int nbRays, const Real* origins, const Real* directions, const Real* maxDistances, int* hitTriangles, Real* hitBarycentrics, Real* hitDistances)
+{
+    if (m_extension == nullptr)
+        return API_MESH_NULL;
+
+    const std::shared_ptr<SofaPhysicsMeshBVH> bvh = std::atomic_load(&m_extension->bvh);
+    if (bvh == nullptr)
+        return API_MESH_NULL;
+
+    std::shared_lock<std::shared_mutex> lock(bvh->m_mutex);
+
+    int nbHits = 0;
+    for (unsigned int i = 0; i < nbRays; ++i)
+    {
+        SofaPhysicsMeshBVH::Tree::Hit hit;
+        hitTriangles[i] = -1;
+        hitBarycentrics[i * 2] = hitBarycentrics[i * 2 + 1] = 0;
+        hitDistances[i] = maxDistances[i];
+        if (bvh->raycast(origins + i * 3, directions + i * 3, maxDistances[i], hit))
+        {
+            hitTriangles[i] = hit.triangle;
+            hitBarycentrics[i * 2] = hit.u;
+            hitBarycentrics[i * 2 + 1] = hit.v;
+            hitDistances[i] = hit.distance;
+            ++nbHits;
+        }
+    }
+    return nbHits;
+}
+
+////////////////////////////////////////
+////////////////////////////////////////
+////////////////////////////////////////
+
+using namespace sofa::defaulttype;
+using namespace sofa::gl;
+using namespace sofa::core::objectmodel;
+
+static sofa::core::ObjectFactory::ClassEntry::SPtr classVisualModel;
+using sofa::helper::logging::MessageDispatcher;
+using sofa::helper::logging::LoggingMessageHandler;
+
+namespace
+{
+/// True on a thread currently running a task given to the external dispatch
+thread_local bool t_runningExternalTask = false;
+
+/// Apply the affinity mask and priority of the configuration to the calling thread
+void configureCurrentThread(unsigned long long affinityMask, int priority)
+{
+#ifdef WIN32
+    if (affinityMask != 0)
+        SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(affinityMask));
+
+    const int priorities[] = { THREAD_PRIORITY_BELOW_NORMAL, THREAD_PRIORITY_NORMAL, THREAD_PRIORITY_ABOVE_NORMAL };
+    SetThreadPriority(GetCurrentThread(), priorities[std::clamp(priority, -1, 1) + 1]);
+#elif defined(__linux__)
+    if (affinityMask != 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int core = 0; core < 64 && core < CPU_SETSIZE; ++core)
+        {
+            if ((affinityMask >> core) & 1ull)
+                CPU_SET(core, &cpus);
+        }
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+    // per thread priorities need privileges on Linux, only the affinity is applied
+    (void)priority;
+#else
+    (void)affinityMask;
+    (void)priority;
+#endif
+}
+
+/// CpuTask running a function, owned by the caller
+class SofaPhysicsFunctionTask : public sofa::simulation::CpuTask
+{
+public:
+    SofaPhysicsFunctionTask(sofa::simulation::CpuTask::Status* status, std::function<void()> function)
+        : sofa::simulation::CpuTask(status)
+        , m_function(std::move(function))
+    {}
+
+    MemoryAlloc run() override
+    {
+        m_function();
+        return MemoryAlloc::Stack;
+    }
+
+private:
+    std::function<void()> m_function;
+};
+
+/// Task scheduler handing every SOFA task to the application pool through SofaPhysicsTaskSchedulerConfig::dispatch,
+/// so SOFA and the application share one set of threads instead of oversubscribing the cores.
+/// Tasks wait in a queue: each dispatched call runs the next one, and a thread waiting in workUntilDone runs them too,
+/// so a pool saturated by the application (or by threads blocked on SOFA) cannot stall a step.
+/// Components keep the scheduler pointer they got at init, so it stays registered for the process: detach() stops
+/// the dispatch when its simulation is destroyed, tasks then run on the thread adding them until attach() gives a new pool.
+class SofaPhysicsExternalTaskScheduler : public sofa::simulation::TaskScheduler
+{
+public:
+    explicit SofaPhysicsExternalTaskScheduler(const SofaPhysicsTaskSchedulerConfig& config, const void* owner)
+    {
+        attach(config, owner);
+    }
+
+    /// Dispatch the next tasks to the pool of @param config, on behalf of the simulation @param owner
+    void attach(const SofaPhysicsTaskSchedulerConfig& config, const void* owner)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_config = config;
+        m_owner = owner;
+    }
+
+    /// Stop dispatching if @param owner is the simulation that attached the current pool. Queued tasks are still run by their waiting thread
+    void detach(const void* owner)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_owner != owner)
+            return;
+        m_config.dispatch = nullptr;
+        m_owner = nullptr;
+    }
+
+    void init(const unsigned int) override {}
+    void stop() override {}
+    unsigned int getThreadCount() const override
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_config.dispatch != nullptr ? static_cast<unsigned int>(std::max(1, m_config.externalThreadCount)) : 1u;
+    }
+    const char* getCurrentThreadName() override { return t_runningExternalTask ? "External Worker" : "External Caller"; }
+    int getCurrentThreadType() override { return t_runningExternalTask ? 1 : 0; }
+
+    bool addTask(sofa::simulation::Task* task) override
+    {
+        task->getStatus()->setBusy(true);
+
+        // a task spawning sub tasks then waiting for them would hold a pool thread: run them inline instead
+        if (t_runningExternalTask)
+        {
+            runTask(task);
+            return true;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_config.dispatch == nullptr)
+        {
+            lock.unlock();
+            runTask(task);
+            return true;
+        }
+        m_queue.push_back(task);
+        const SofaPhysicsTaskSchedulerConfig config = m_config;
+        lock.unlock();
+
+        // one call per queued task, it may find the queue already emptied by a waiting thread
+        config.dispatch(config.userData, &SofaPhysicsExternalTaskScheduler::runQueuedTask, this);
+        return true;
+    }
+
+    void workUntilDone(sofa::simulation::Task::Status* status) override
+    {
+        while (status->isBusy())
+        {
+            if (!runNextQueuedTask())
+                std::this_thread::yield();
+        }
+    }
+
+    sofa::simulation::Task::Allocator* getTaskAllocator() override { return &m_allocator; }
+
+private:
+    /// Run the oldest queued task on the calling thread. Return false if the queue was empty
+    bool runNextQueuedTask()
+    {
+        sofa::simulation::Task* task = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_queue.empty())
+                return false;
+            task = m_queue.front();
+            m_queue.pop_front();
+        }
+        runTask(task);
+        return true;
+    }
+
+    /// Entry point given to the dispatch, @param scheduler is this adapter
+    static void runQueuedTask(void* scheduler)
+    {
+        static_cast<SofaPhysicsExternalTaskScheduler*>(scheduler)->runNextQueuedTask();
+    }
+
+    static void runTask(sofa::simulation::Task* task)
+    {
+        sofa::simulation::Task::Status* status = task->getStatus();
+
+        const bool wasRunning = t_runningExternalTask;
+        t_runningExternalTask = true;
+        const sofa::simulation::Task::MemoryAlloc alloc = task->run();
+        t_runningExternalTask = wasRunning;
+
+        status->setBusy(false);
+        if (alloc == sofa::simulation::Task::MemoryAlloc::Dynamic)
+            delete task;
+    }
+
+    class NewDeleteAllocator : public sofa::simulation::Task::Allocator
+    {
+    public:
+        void* allocate(std::size_t size) override { return ::operator new(size); }
+        void free(void* ptr, std::size_t) override { ::operator delete(ptr); }
+    };
+
+    mutable std::mutex m_mutex;
+    SofaPhysicsTaskSchedulerConfig m_config = {};
+    const void* m_owner = nullptr;
+    std::deque<sofa::simulation::Task*> m_queue;
+    NewDeleteAllocator m_allocator;
+};
+
+/// Adapter registered as the default SOFA scheduler of the process, null until a configuration with a dispatch is given
+SofaPhysicsExternalTaskScheduler* s_externalScheduler = nullptr;
+}
+
+void SofaPhysicsSimulation::configureTaskScheduler(const SofaPhysicsTaskSchedulerConfig& config)
+{
+    using sofa::simulation::MainTaskSchedulerFactory;
+    using sofa::simulation::MainTaskSchedulerRegistry;
+    using sofa::simulation::DefaultTaskScheduler;
+
+    if (config.dispatch != nullptr)
+    {
+        // a previous simulation installed the adapter: reattach it to this pool
+        if (s_externalScheduler != nullptr)
+        {
+            s_externalScheduler->attach(config, this);
+            msg_info("SofaPhysicsSimulation") << "SOFA tasks are dispatched again to the application pool (" << std::max(1, config.externalThreadCount) << " threads)";
+            return;
+        }
+
+        // components ask the registry for the default scheduler by name: registering the adapter under that name redirects them all
+        if (MainTaskSchedulerRegistry::hasScheduler(DefaultTaskScheduler::name()))
+        {
+            msg_warning("SofaPhysicsSimulation") << "A SOFA task scheduler already exists in this process, the external dispatch is not installed";
+            return;
+        }
+
+        s_externalScheduler = new SofaPhysicsExternalTaskScheduler(config, this);
+        MainTaskSchedulerRegistry::addTaskSchedulerToRegistry(s_externalScheduler, DefaultTaskScheduler::name());
+        msg_info("SofaPhysicsSimulation") << "SOFA tasks are dispatched to the application pool (" << std::max(1, config.externalThreadCount) << " threads)";
+        return;
+    }
+
+    if (config.nbThreads < 0)
+        return;
+
+    if (s_externalScheduler != nullptr)
+    {
+        msg_warning("SofaPhysicsSimulation") << "The external dispatch adapter is the SOFA task scheduler of this process, SOFA tasks run on the calling thread until a new dispatch is given";
+        return;
+    }
+
+    sofa::simulation::TaskScheduler* scheduler = MainTaskSchedulerFactory::createInRegistry();
+    if (scheduler == nullptr)
+        return;
+    scheduler->init(static_cast<unsigned int>(config.nbThreads));
+
+    // no access to the worker threads: one blocking task per worker makes each of them apply the settings to itself
+    const unsigned int nbWorkers = scheduler->getThreadCount() > 0 ? scheduler->getThreadCount() - 1 : 0;
+    if (nbWorkers > 0 && (config.affinityMask != 0 || config.priority != API_THREAD_PRIORITY_NORMAL))
+    {
+        const std::thread::id caller = std::this_thread::get_id();
+        std::atomic<unsigned int> arrived(0);
+        std::atomic<unsigned int> configured(0);
+        sofa::simulation::CpuTask::Status status;
+        std::vector<std::unique_ptr<SofaPhysicsFunctionTask>> tasks;
+        for (unsigned int i = 0; i < nbWorkers; ++i)
+        {
+            tasks.emplace_back(new SofaPhysicsFunctionTask(&status, [&]()
+            {
+                // the caller may pick a task while waiting, it keeps its own settings
+                if (std::this_thread::get_id() != caller)
+                {
+                    configureCurrentThread(config.affinityMask, config.priority);
+                    ++configured;
+                }
+                ++arrived;
+                while (arrived.load() < nbWorkers)
+                    std::this_thread::yield();
+            }));
+            scheduler->addTask(tasks.back().get());
+        }
+        scheduler->workUntilDone(&status);
+        msg_info("SofaPhysicsSimulation") << "Affinity/priority applied to " << configured.load() << " of " << nbWorkers << " SOFA workers";
+    }
+
+    msg_info("SofaPhysicsSimulation") << "SOFA task scheduler: " << scheduler->getThreadCount() << " threads";
+}
+
+SofaPhysicsSimulation::SofaPhysicsSimulation(bool useGUI_, int GUIFramerate_, const SofaPhysicsTaskSchedulerConfig* schedulerConfig)
+    : m_msgIsActivated(false)
+    , useGUI(useGUI_)
+    , GUIFramerate(GUIFramerate_)
+{
+    sofa::helper::init();
+    static bool first = true;
+    if (first)
+    {
+        if ( !useGUI )
+        {
+          // FakeGUI to be able to receive messages
+          FakeGUI::Create();
+        }
+        else
+        {
+          sofa::gui::common::init();
+
+          char* argv[]= { const_cast<char*>("a") };
+
+          if (sofa::gui::common::GUIManager::Init(argv[0],"qt"))
+              std::cerr << "ERROR in sofa::gui::common::GUIManager::Init()" << std::endl;
+
+          if (sofa::gui::common::GUIManager::createGUI(NULL))
+              std::cerr << "ERROR in sofa::gui::common::GUIManager::CreateGUI()" << std::endl;
+
+          sofa::gui::common::GUIManager::SetDimension(600,600);
+        }
+        first = false;
+    }    
+
+    // create message handler
+    m_msgHandler = new LoggingMessageHandler();
+    MessageDispatcher::clearHandlers();
+    MessageDispatcher::addHandler(m_msgHandler);
+
+    m_RootNode = NULL;
+    initGLDone = false;
+    initTexturesDone = false;
+    texLogo = nullptr;
+    lastW = 0;
+    lastH = 0;
+    vparams = sofa::core::visual::VisualParams::defaultInstance();
+
+    // Initialize the simulation graph - THIS IS CRITICAL and was missing!
+    // Without this, getSimulation() returns null and causes crashes during load()
+    sofa::simulation::graph::init();
+
+    assert(sofa::simulation::getSimulation());
+
+    sofa::component::init(); // force dependency on Sofa.Component
+
+    sofa::core::ObjectFactory::AddAlias("VisualModel", "OglModel", true,
+            &classVisualModel);
+
+    sofa::helper::system::PluginManager::getInstance().init();
+
+    if (schedulerConfig != nullptr)
+        configureTaskScheduler(*schedulerConfig);
+
+    timeTicks = sofa::helper::system::thread::CTime::getRefTicksPerSec();
+    frameCounter = 0;
+    currentFPS = 0.0;
+    lastRedrawTime = 0;
+}
+
+SofaPhysicsSimulation::~SofaPhysicsSimulation()
+{
+    stopHapticLoop();
+
+    // the application pool given with this simulation may not outlive it
+    if (s_externalScheduler != nullptr)
+        s_externalScheduler->detach(this);
+
+    for (std::map<SofaOutputMesh*, SofaPhysicsOutputMesh*>::const_iterator it = outputMeshMap.begin(), itend = outputMeshMap.end(); it != itend; ++it)
+    {
+        if (it->second)
+        {
+            it->second->setRaycastEnabled(false);
+            delete it->second->m_extension;
+            delete it->second;
+        }
+    }
+    outputMeshMap.clear();
+
+    if ( useGUI ) {
+      // GUI Cleanup
+      //groot = dynamic_cast<sofa::simulation::Node*>( sofa::gui::common::GUIManager::CurrentSimulation() );
+
+      //if (groot!=NULL)
+      //  sofa::simulation::getSimulation()->unload(groot);
+
+
+      //sofa::gui::common::GUIManager::closeGUI();
+    }
+
+    MessageDispatcher::rmHandler(m_msgHandler);
+    if (m_msgIsActivated)
+        m_msgHandler->deactivate();
+
+    if (m_msgHandler != nullptr)
+    {
+        delete m_msgHandler;
+        m_msgHandler = nullptr;
+    }
+}
+
+const char *SofaPhysicsSimulation::APIName()
+{
+    return "SofaPhysicsSimulation API";
+}
+
+namespace
+{
+using sofa::core::loader::MeshLoader;
+
+/// CSR vertex adjacency of all the elements of a loader, each element being a clique
+void buildVertexGraph(MeshLoader* loader, std::size_t nbV, std::vector<int>& offsets, std::vector<int>& neighbors)
+{
+    std::vector<std::pair<int, int>> edges;
+    auto addElements = [&edges](const auto& elements)
+    {
+        for (const auto& e : elements)
+        {
+            for (std::size_t i = 0; i < e.size(); ++i)
+                for (std::size_t j = 0; j < e.size(); ++j)
+                    if (i != j)
+                        edges.emplace_back(int(e[i]), int(e[j]));
+        }
+    };
+    addElements(loader->d_edges.getValue());
+    addElements(loader->d_triangles.getValue());
+    addElements(loader->d_quads.getValue());
+    addElements(loader->d_tetrahedra.getValue());
+    addElements(loader->d_hexahedra.getValue());
+    addElements(loader->d_prisms.getValue());
+    addElements(loader->d_pyramids.getValue());
+
+    std::sort(edges.begin(), edges.end());
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+    offsets.assign(nbV + 1, 0);
+    neighbors.resize(edges.size());
+    for (std::size_t k = 0; k < edges.size(); ++k)
+    {
+        offsets[edges[k].first + 1]++;
+        neighbors[k] = edges[k].second;
+    }
+    for (std::size_t v = 0; v < nbV; ++v)
+        offsets[v + 1] += offsets[v];
+}
+
+/// Matrix bandwidth of the vertex graph under a numbering, used to report the renumbering gain
+int computeBandwidth(const std::vector<int>& offsets, const std::vector<int>& neighbors, const std::vector<Index>& oldToNew)
+{
+    int bandwidth = 0;
+    for (std::size_t v = 0; v + 1 < offsets.size(); ++v)
+        for (int k = offsets[v]; k < offsets[v + 1]; ++k)
+            bandwidth = std::max(bandwidth, std::abs(int(oldToNew[v]) - int(oldToNew[neighbors[k]])));
+    return bandwidth;
+}
+
+/// Reverse Cuthill-McKee: BFS from a low degree vertex of each component, neighbors by increasing degree, then reversed
+std::vector<Index> computeRCM(std::size_t nbV, const std::vector<int>& offsets, const std::vector<int>& neighbors)
+{
+    auto degree = [&offsets](int v) { return offsets[v + 1] - offsets[v]; };
+
+    std::vector<int> byDegree(nbV);
+    std::iota(byDegree.begin(), byDegree.end(), 0);
+    std::stable_sort(byDegree.begin(), byDegree.end(), [&](int a, int b) { return degree(a) < degree(b); });
+
+    std::vector<Index> newToOld;
+    newToOld.reserve(nbV);
+    std::vector<char> visited(nbV, 0);
+    std::vector<int> sortedNeighbors;
+    for (int start : byDegree)
+    {
+        if (visited[start])
+            continue;
+
+        visited[start] = 1;
+        std::size_t head = newToOld.size();
+        newToOld.push_back(start);
+        while (head < newToOld.size())
+        {
+            const int v = int(newToOld[head++]);
+            sortedNeighbors.assign(neighbors.begin() + offsets[v], neighbors.begin() + offsets[v + 1]);
+            std::stable_sort(sortedNeighbors.begin(), sortedNeighbors.end(), [&](int a, int b) { return degree(a) < degree(b); });
+            for (int n : sortedNeighbors)
+            {
+                if (!visited[n])
+                {
+                    visited[n] = 1;
+                    newToOld.push_back(n);
+                }
+            }
+        }
+    }
+
+    std::reverse(newToOld.begin(), newToOld.end());
+    return newToOld;
+}
+
+/// Morton order of the rest positions, 10 bits per axis in the bounding box
+std::vector<Index> computeMorton(const sofa::type::vector<sofa::type::Vec3>& positions)
+{
+    const std::size_t nbV = positions.size();
+    sofa::type::Vec3 bmin = positions[0];
+    sofa::type::Vec3 bmax = positions[0];
+    for (const auto& p : positions)
+    {
+        for (int c = 0; c < 3; ++c)
+        {
+            bmin[c] = std::min(bmin[c], p[c]);
+            bmax[c] = std::max(bmax[c], p[c]);
+        }
+    }
+
+    // Spread the 10 low bits of x so that 2 zero bits separate each of them
+    auto spreadBits = [](uint32_t x)
+    {
+        x &= 0x3ff;
+        x = (x | (x << 16)) & 0x030000ff;
+        x = (x | (x << 8)) & 0x0300f00f;
+        x = (x | (x << 4)) & 0x030c30c3;
+        x = (x | (x << 2)) & 0x09249249;
+        return x;
+    };
+
+    std::vector<uint32_t> codes(nbV);
+    for (std::size_t v = 0; v < nbV; ++v)
+    {
+        uint32_t code = 0;
+        for (int c = 0; c < 3; ++c)
+        {
+            const SReal extent = bmax[c] - bmin[c];
+            const SReal t = extent > 0 ? (positions[v][c] - bmin[c]) / extent : 0;
+            code |= spreadBits(uint32_t(t * 1023)) << c;
+        }
+        codes[v] = code;
+    }
+
+    std::vector<Index> newToOld(nbV);
+    std::iota(newToOld.begin(), newToOld.end(), 0);
+    std::stable_sort(newToOld.begin(), newToOld.end(), [&codes](Index a, Index b) { return codes[a] < codes[b]; });
+    return newToOld;
+}
+
+/// Permute the vertex data of the loader and remap its element indices
+void applyRenumbering(MeshLoader* loader, const std::vector<Index>& newToOld, const std::vector<Index>& oldToNew)
+{
+    const std::size_t nbV = newToOld.size();
+    auto permute = [&](auto& data)
+    {
+        auto values = sofa::helper::getWriteAccessor(data);
+        if (values.size() != nbV)
+            return;
+
+        const auto source = values.ref();
+        for (std::size_t i = 0; i < nbV; ++i)
+            values[i] = source[newToOld[i]];
+    };
+    permute(loader->d_positions);
+    permute(loader->d_normals);
+
+    auto remap = [&oldToNew](auto& data)
+    {
+        auto elements = sofa::helper::getWriteAccessor(data);
+        for (std::size_t k = 0; k < elements.size(); ++k)
+            for (auto& v : elements[k])
+                v = oldToNew[v];
+    };
+    remap(loader->d_polylines);
+    remap(loader->d_edges);
+    remap(loader->d_triangles);
+    remap(loader->d_quads);
+    remap(loader->d_polygons);
+    remap(loader->d_tetrahedra);
+    remap(loader->d_hexahedra);
+    remap(loader->d_prisms);
+    remap(loader->d_pyramids);
+}
+
+/// Return true if a link of @param object points to @param state (mappings "input", interactions "object1"/"object2", ...)
+bool linksTo(sofa::core::objectmodel::BaseObject* object, const sofa::core::objectmodel::Base* state)
+{
+    for (sofa::core::objectmodel::BaseLink* link : object->getLinks())
+    {
+        for (std::size_t i = 0; i < link->getSize(); ++i)
+        {
+            if (link->getLinkedBase(i) == state)
+                return true;
+        }
+    }
+    return false;
+}
+
+/// State the index Data @param name of @param object numbers, nullptr if it is not an index Data known to the renumbering
+const sofa::core::objectmodel::Base* indexDataTarget(sofa::core::objectmodel::BaseObject* object, const std::string& name)
+{
+    // Data numbering the state of a named link: interaction force fields and constraints, external rest shape of RestShapeSpringsForceField
+    static const std::pair<const char*, const char*> linkedIndices[] = { { "indices1", "object1" }, { "indices2", "object2" }, { "external_points", "external_rest_shape" } };
+    for (const auto& linked : linkedIndices)
+    {
+        if (name != linked.first)
+            continue;
+        sofa::core::objectmodel::BaseLink* link = object->findLink(linked.second);
+        return (link && link->getSize() > 0) ? link->getLinkedBase(0) : nullptr;
+    }
+
+    // "indices" (FixedProjectiveConstraint, ConstantForceField, SubsetMapping...) and "points" (RestShapeSpringsForceField) number the state
+    // of their node, or the input of a mapping
+    if (name != "indices" && name != "points")
+        return nullptr;
+    if (sofa::core::BaseMapping* mapping = dynamic_cast<sofa::core::BaseMapping*>(object))
+    {
+        const auto from = mapping->getFrom();
+        return from.size() == 1 ? from[0] : nullptr;
+    }
+    return object->getContext()->getMechanicalState();
+}
+
+/// Remap the indices of @param data, written as a flat list of vertex indices
+int remapIndexData(sofa::core::objectmodel::BaseData* data, const std::vector<Index>& oldToNew)
+{
+    std::istringstream in(data->getValueString());
+    std::ostringstream out;
+    int nbRemapped = 0;
+    unsigned int index;
+    while (in >> index)
+    {
+        out << (nbRemapped++ ? " " : "") << (index < oldToNew.size() ? oldToNew[index] : index);
+    }
+    if (nbRemapped > 0)
+        data->read(out.str());
+    return nbRemapped;
+}
+}
+
+int SofaPhysicsSimulation::setDofRenumbering(int method)
+{
+    if (method < API_RENUMBER_NONE || method > API_RENUMBER_MORTON)
+        return API_NULL;
+
+    m_dofRenumbering = method;
+    return API_SUCCESS;
+}
+
+void SofaPhysicsSimulation::renumberDofs()
+{
+    sofa::simulation::Node* groot = getScene();
+    if (!groot)
+        return;
+
+    // Loaders read their file at parse, so their Data are filled but the topologies and states linked to them are not initialized yet
+    std::vector<MeshLoader*> loaders;
+    groot->getTreeObjects<MeshLoader>(&loaders);
+
+    std::vector<sofa::core::behavior::BaseMechanicalState*> states;
+    groot->getTreeObjects<sofa::core::behavior::BaseMechanicalState>(&states);
+
+    // The whole graph: index Data may sit in the node of the state, in child nodes (mappings) or in other branches (interactions). Links are resolved by the scene loader
+    std::vector<sofa::core::objectmodel::BaseObject*> objects;
+    groot->getTreeObjects<sofa::core::objectmodel::BaseObject>(&objects);
+
+    for (MeshLoader* loader : loaders)
+    {
+        // Only volumetric meshes, surface loaders feed visual models whose layout is handled on the renderer side
+        const std::size_t nbV = loader->d_positions.getValue().size();
+        if (nbV == 0 || (loader->d_tetrahedra.getValue().empty() && loader->d_hexahedra.getValue().empty()))
+            continue;
+
+        std::vector<int> offsets;
+        std::vector<int> neighbors;
+        buildVertexGraph(loader, nbV, offsets, neighbors);
+
+        std::vector<Index> identity(nbV);
+        std::iota(identity.begin(), identity.end(), 0);
+        const int bandwidthBefore = computeBandwidth(offsets, neighbors, identity);
+
+        const std::vector<Index> newToOld = (m_dofRenumbering == API_RENUMBER_RCM) ? computeRCM(nbV, offsets, neighbors) : computeMorton(loader->d_positions.getValue());
+        std::vector<Index> oldToNew(nbV);
+        for (std::size_t i = 0; i < nbV; ++i)
+            oldToNew[newToOld[i]] = Index(i);
+
+        // Every Data of the graph holding vertex indices of a state sourced from this loader must follow the permutation. Known index Data are remapped,
+        // any other integer list set on a component using these states (its node state, a mapping input, a link) would silently go stale: refuse instead.
+        // Data linked to another one (e.g. BoxROI indices computed at init from the permuted positions) and mappings computed at init need nothing.
+        std::vector<const sofa::core::objectmodel::Base*> sourcedStates;
+        for (sofa::core::behavior::BaseMechanicalState* state : states)
+        {
+            sofa::core::objectmodel::BaseData* position = state->findData("position");
+            if (position != nullptr && position->getParent() == &loader->d_positions)
+                sourcedStates.push_back(state);
+        }
+        auto isSourced = [&sourcedStates](const sofa::core::objectmodel::Base* state)
+        {
+            return std::find(sourcedStates.begin(), sourcedStates.end(), state) != sourcedStates.end();
+        };
+
+        std::vector<sofa::core::objectmodel::BaseData*> indexData;
+        std::string unknownData;
+        for (sofa::core::objectmodel::BaseObject* object : objects)
+        {
+            if (dynamic_cast<MeshLoader*>(object) || dynamic_cast<sofa::core::behavior::BaseMechanicalState*>(object))
+                continue;
+
+            bool usesState = isSourced(object->getContext()->getMechanicalState());
+            for (std::size_t s = 0; s < sourcedStates.size() && !usesState; ++s)
+                usesState = linksTo(object, sourcedStates[s]);
+            if (!usesState)
+                continue;
+
+            for (sofa::core::objectmodel::BaseData* data : object->getDataFields())
+            {
+                const sofa::defaulttype::AbstractTypeInfo* typeInfo = data->getValueTypeInfo();
+                if (typeInfo == nullptr || !typeInfo->Container() || !typeInfo->Integer() || data->getParent() != nullptr || data->getValueString().empty())
+                    continue;
+
+                const sofa::core::objectmodel::Base* target = indexDataTarget(object, data->getName());
+                if (target == nullptr)
+                    unknownData += " " + object->getPathName() + "." + data->getName();
+                else if (isSourced(target))
+                    indexData.push_back(data);
+            }
+        }
+
+        if (!unknownData.empty())
+        {
+            msg_warning("SofaPhysicsSimulation") << "DOFs of '" << loader->getName() << "' not renumbered, these integer lists may hold vertex indices the renumbering cannot remap:" << unknownData;
+            continue;
+        }
+
+        applyRenumbering(loader, newToOld, oldToNew);
+        int nbRemapped = 0;
+        for (sofa::core::objectmodel::BaseData* data : indexData)
+            nbRemapped += remapIndexData(data, oldToNew);
+
+        msg_info("SofaPhysicsSimulation") << "Renumbered " << nbV << " DOFs of '" << loader->getName() << "' ("
+            << (m_dofRenumbering == API_RENUMBER_RCM ? "RCM" : "Morton") << "), bandwidth " << bandwidthBefore << " -> "
+            << computeBandwidth(offsets, neighbors, oldToNew) << ", " << nbRemapped << " indices remapped in " << indexData.size() << " Data";
+    }
+}
+
+namespace
+{
+/// Sweep and prune broad phase substituted to BruteForceBroadPhase by setBroadPhaseUpgrade. The root boxes of the collision models, grown by the
+/// alarm distance, are sorted along the axis where their centers spread the most. Only the models overlapping in the sweep go through the same
+/// tests as BruteForceBroadPhase (collision groups, intersector, root elements), so the pairs are the same in O(n log n + overlapping pairs).
+class SofaPhysicsSweepAndPruneBroadPhase : public sofa::core::collision::BroadPhaseDetection
+{
+public:
+    SOFA_CLASS(SofaPhysicsSweepAndPruneBroadPhase, sofa::core::collision::BroadPhaseDetection);
+
+    void beginBroadPhase() override
+    {
+        BroadPhaseDetection::beginBroadPhase();
+        m_models.clear();
+    }
+
+    void addCollisionModel(sofa::core::CollisionModel* cm) override
+    {
+        if (cm == nullptr || cm->empty())
+            return;
+
+        if (cm->isSimulated() && cm->getLast()->canCollideWith(cm->getLast()))
+        {
+            bool swapModels = false;
+            if (intersectionMethod->findIntersector(cm, cm, swapModels) != nullptr)
+                cmPairs.emplace_back(cm, cm);
+        }
+
+        // models without a cube root (no bounding tree) get an infinite box, they are tested against all the others
+        SweptModel model;
+        model.root = cm;
+        const SReal margin = intersectionMethod->getAlarmDistance() + cm->getProximity();
+        if (auto* cubes = dynamic_cast<sofa::component::collision::geometry::CubeCollisionModel*>(cm))
+        {
+            const sofa::component::collision::geometry::Cube root(cubes, 0);
+            for (int c = 0; c < 3; ++c)
+            {
+                model.min[c] = root.minVect()[c] - margin;
+                model.max[c] = root.maxVect()[c] + margin;
+            }
+        }
+        m_models.push_back(model);
+    }
+
+    void endBroadPhase() override
+    {
+        const std::size_t nbModels = m_models.size();
+        if (nbModels < 2)
+            return;
+
+        // sweep along the axis of largest spread of the finite box centers
+        double mean[3] = { 0, 0, 0 };
+        double square[3] = { 0, 0, 0 };
+        std::size_t nbFinite = 0;
+        for (const SweptModel& model : m_models)
+        {
+            if (!model.isFinite())
+                continue;
+            ++nbFinite;
+            for (int c = 0; c < 3; ++c)
+            {
+                const double center = 0.5 * (model.min[c] + model.max[c]);
+                mean[c] += center;
+                square[c] += center * center;
+            }
+        }
+        int axis = 0;
+        double bestVariance = -1.0;
+        for (int c = 0; nbFinite > 0 && c < 3; ++c)
+        {
+            const double variance = square[c] / nbFinite - (mean[c] / nbFinite) * (mean[c] / nbFinite);
+            if (variance > bestVariance)
+            {
+                bestVariance = variance;
+                axis = c;
+            }
+        }
+
+        m_order.resize(nbModels);
+        std::iota(m_order.begin(), m_order.end(), 0);
+        std::sort(m_order.begin(), m_order.end(), [&](std::size_t a, std::size_t b) { return m_models[a].min[axis] < m_models[b].min[axis]; });
+
+        m_active.clear();
+        for (const std::size_t current : m_order)
+        {
+            const SweptModel& model = m_models[current];
+            m_active.erase(std::remove_if(m_active.begin(), m_active.end(), [&](std::size_t other) { return m_models[other].max[axis] < model.min[axis]; }), m_active.end());
+            for (const std::size_t other : m_active)
+            {
+                if (overlap(model, m_models[other]))
+                    addPair(m_models[std::min(current, other)].root, m_models[std::max(current, other)].root);
+            }
+            m_active.push_back(current);
+        }
+    }
+
+protected:
+    struct SweptModel
+    {
+        sofa::core::CollisionModel* root = nullptr;
+        SReal min[3] = { -std::numeric_limits<SReal>::max(), -std::numeric_limits<SReal>::max(), -std::numeric_limits<SReal>::max() };
+        SReal max[3] = { std::numeric_limits<SReal>::max(), std::numeric_limits<SReal>::max(), std::numeric_limits<SReal>::max() };
+
+        bool isFinite() const { return min[0] > -std::numeric_limits<SReal>::max(); }
+    };
+
+    static bool overlap(const SweptModel& a, const SweptModel& b)
+    {
+        for (int c = 0; c < 3; ++c)
+        {
+            if (a.max[c] < b.min[c] || b.max[c] < a.min[c])
+                return false;
+        }
+        return true;
+    }
+
+    /// Tests of BruteForceBroadPhase::addCollisionModel for the model @param earlier added before @param later
+    void addPair(sofa::core::CollisionModel* earlier, sofa::core::CollisionModel* later)
+    {
+        sofa::core::CollisionModel* finestEarlier = earlier->getLast();
+        sofa::core::CollisionModel* finestLater = later->getLast();
+        if (!finestEarlier->canCollideWith(finestLater) || !finestLater->canCollideWith(finestEarlier))
+            return;
+        if (!finestEarlier->isSimulated() && !finestLater->isSimulated())
+            return;
+
+        bool swapModels = false;
+        sofa::core::collision::ElementIntersector* intersector = intersectionMethod->findIntersector(later, earlier, swapModels);
+        if (intersector == nullptr)
+            return;
+
+        sofa::core::CollisionModel* cm1 = swapModels ? earlier : later;
+        sofa::core::CollisionModel* cm2 = swapModels ? later : earlier;
+        if (intersector->canIntersect(cm1->begin(), cm2->begin(), intersectionMethod))
+            cmPairs.emplace_back(cm1, cm2);
+    }
+
+    std::vector<SweptModel> m_models;
+    std::vector<std::size_t> m_order;
+    std::vector<std::size_t> m_active;
+};
+
+const int SofaPhysicsSweepAndPruneBroadPhaseClass = sofa::core::RegisterObject("Sweep and prune broad phase on the collision model root boxes, substituted to BruteForceBroadPhase by SofaPhysicsAPI::setBroadPhaseUpgrade")
+    .add<SofaPhysicsSweepAndPruneBroadPhase>();
+}
+
+int SofaPhysicsSimulation::upgradeBroadPhase()
+{
+    sofa::simulation::Node* groot = getScene();
+    if (!groot)
+        return 0;
+
+    std::vector<sofa::core::collision::BroadPhaseDetection*> broadPhases;
+    groot->getTreeObjects<sofa::core::collision::BroadPhaseDetection>(&broadPhases);
+    broadPhases.erase(std::remove_if(broadPhases.begin(), broadPhases.end(),
+        [](sofa::core::collision::BroadPhaseDetection* broadPhase) { return broadPhase->getClassName() != "BruteForceBroadPhase"; }),
+        broadPhases.end());
+    if (broadPhases.empty())
+        return 0;
+
+    const char* sweepAndPrune = "SofaPhysicsSweepAndPruneBroadPhase";
+    int nbReplaced = 0;
+    for (sofa::core::collision::BroadPhaseDetection* broadPhase : broadPhases)
+    {
+        sofa::simulation::Node* node = dynamic_cast<sofa::simulation::Node*>(broadPhase->getContext());
+        if (node == nullptr)
+            continue;
+
+        // the sweep has no filtering box, a broad phase restricted to one keeps its behavior
+        sofa::core::objectmodel::BaseData* box = broadPhase->findData("box");
+        if (box != nullptr && box->isSet())
+        {
+            msg_warning("SofaPhysicsSimulation") << "Broad phase upgrade: '" << broadPhase->getName() << "' has a box, keeping BruteForceBroadPhase";
+            continue;
+        }
+
+        // Same name, so links and the pipeline lookup (first BroadPhaseDetection of the context) are unchanged
+        sofa::core::objectmodel::BaseObjectDescription desc(broadPhase->getName().c_str(), sweepAndPrune);
+
+        sofa::core::objectmodel::BaseObject::SPtr previous = broadPhase;
+        node->removeObject(previous);
+        sofa::core::objectmodel::BaseObject::SPtr replacement = sofa::core::ObjectFactory::CreateObject(node, &desc);
+        if (replacement == nullptr)
+        {
+            node->addObject(previous);
+            continue;
+        }
+        ++nbReplaced;
+    }
+
+    msg_info("SofaPhysicsSimulation") << "Broad phase upgrade: " << nbReplaced << " BruteForceBroadPhase replaced by " << sweepAndPrune;
+    return nbReplaced;
+}
+
+int SofaPhysicsSimulation::load(const char* cfilename)
+{
+    std::string filename = cfilename;
+    sofa::helper::BackTrace::autodump();
+
+    sofa::helper::system::DataRepository.findFile(filename);
+
+    // the previous graph goes away with the assignment below
+    m_mechanicalStates.clear();
+    m_forceInputs.clear();
+    m_timeDrivenComponent.clear();
+    m_solverCaps.clear();
+    m_convergenceProbes.clear();
+    m_rollbackBlocker.clear();
+    m_snapshot.clear();
+    m_collisionModels.clear();
+    m_narrowPhases.clear();
+    m_constraintForceData = nullptr;
+    m_constraintForceSwitch = nullptr;
+    m_RootNode = sofa::simulation::node::load(filename.c_str());
+    int result = API_SUCCESS;
+    if (m_RootNode.get())
+    {
+        sceneFileName = filename;
+
+        // Must run before initRoot, while topologies and states have not copied the loader data yet
+        if (m_dofRenumbering != API_RENUMBER_NONE)
+            renumberDofs();
+        if (m_upgradeBroadPhase)
+            upgradeBroadPhase();
+
+        sofa::simulation::node::initRoot(m_RootNode.get());
+        result = updateOutputMeshes();
+
+        m_mechanicalStates.clear();
+        m_RootNode->getTreeObjects<sofa::core::behavior::BaseMechanicalState>(&m_mechanicalStates);
+        collectSleepInputs();
+        wakeUp();
+        collectSolverCaps();
+        collectConvergenceProbes();
+        collectContactSources();
+
+        if ( useGUI ) {
+          sofa::gui::common::GUIManager::SetScene(m_RootNode.get(),cfilename);
+        }
+    }
+    else
+    {
+        m_RootNode = sofa::simulation::getSimulation()->createNewGraph("");
+        return API_SCENE_FAILED;
+    }
+    initTexturesDone = false;
+    lastW = 0;
+    lastH = 0;
+    lastRedrawTime = sofa::helper::system::thread::CTime::getRefTime();
+
+    return result;
+}
+
+int SofaPhysicsSimulation::unload()
+{
+    if (m_RootNode.get())
+    {
+        m_mechanicalStates.clear();
+        m_forceInputs.clear();
+        m_timeDrivenComponent.clear();
+        m_solverCaps.clear();
+        m_convergenceProbes.clear();
+        m_rollbackBlocker.clear();
+        m_snapshot.clear();
+        m_collisionModels.clear();
+        m_narrowPhases.clear();
+        m_constraintForceData = nullptr;
+        m_constraintForceSwitch = nullptr;
+        wakeUp();
+        sofa::simulation::node::unload(m_RootNode);
+    }
+    else
+    {
+        msg_error("SofaPhysicsSimulation") << "Error: can't get scene root node.";
+        return API_SCENE_NULL;
+    }
+
+    return API_SUCCESS;
+}
+
+int SofaPhysicsSimulation::loadPlugin(const char* pluginPath)
+{
+    sofa::helper::system::PluginManager::PluginLoadStatus plugres = sofa::helper::system::PluginManager::getInstance().loadPlugin(pluginPath);
+    if (plugres == sofa::helper::system::PluginManager::PluginLoadStatus::SUCCESS || plugres == sofa::helper::system::PluginManager::PluginLoadStatus::ALREADY_LOADED)
+        return API_SUCCESS;
+    else if (plugres == sofa::helper::system::PluginManager::PluginLoadStatus::INVALID_LOADING)
+        return API_PLUGIN_INVALID_LOADING;
+    else if (plugres == sofa::helper::system::PluginManager::PluginLoadStatus::MISSING_SYMBOL)
+        return API_PLUGIN_MISSING_SYMBOL;
+    else if (plugres == sofa::helper::system::PluginManager::PluginLoadStatus::PLUGIN_FILE_NOT_FOUND)
+        return API_PLUGIN_FILE_NOT_FOUND;
+    else
+        return API_PLUGIN_LOADING_FAILED;
+}
+
+void SofaPhysicsSimulation::createScene()
+{
+    m_RootNode = sofa::simulation::getSimulation()->createNewGraph("root");
+    sofa::simpleapi::createObject(m_RootNode, "CollisionPipeline", { {"name","Collision Pipeline"} });
+    sofa::simpleapi::createObject(m_RootNode, "BruteForceBroadPhase", { {"name","Broad Phase Detection"} });
+    sofa::simpleapi::createObject(m_RootNode, "BVHNarrowPhase", { {"name","Narrow Phase Detection"} });
+    sofa::simpleapi::createObject(m_RootNode, "MinProximityIntersection", { {"name","Proximity"},
+                                                               {"alarmDistance", "0.3"},
+                                                               {"contactDistance", "0.2"} });
+
+    sofa::simpleapi::createObject(m_RootNode, "CollisionResponse", {
+                                {"name", "Contact Manager"},
+                                {"response", "PenalityContactForceField"}
+        });
+
+    if (m_RootNode.get())
+    {
+        m_RootNode->setGravity({ 0,-9.8,0 });
+        this->createScene_impl();
+
+        sofa::simulation::node::initRoot(m_RootNode.get());
+
+        updateOutputMeshes();
+    }
+    else
+        std::cerr <<"Error: can't get m_RootNode" << std::endl;
+}
+
+void SofaPhysicsSimulation::createScene_impl()
+{
+    if (!m_RootNode.get())
+        return;
+}
+
+
+void SofaPhysicsSimulation::sendValue(const char* name, double value)
+{
+    // send a GUIEvent to the tree
+    if (m_RootNode!=0)
+    {
+        std::ostringstream oss;
+        oss << value;
+        sofa::core::objectmodel::GUIEvent event("",name,oss.str().c_str());
+        m_RootNode->propagateEvent(sofa::core::ExecParams::defaultInstance(), &event);
+    }
+    wakeUp();
+    this->update();
+}
+
+bool SofaPhysicsSimulation::isAnimated() const
+{
+    if (getScene())
+        return getScene()->getContext()->getAnimate();
+    return false;
+}
+
+void SofaPhysicsSimulation::setAnimated(bool val)
+{
+    if (val) start();
+    else stop();
+}
+
+double SofaPhysicsSimulation::getTimeStep() const
+{
+    if (getScene())
+        return getScene()->getContext()->getDt();
+    else
+        return 0.0;
+}
+
+void SofaPhysicsSimulation::setTimeStep(double dt)
+{
+    if (getScene())
+    {
+        getScene()->getContext()->setDt(dt);
+    }
+    wakeUp();
+}
+
+double SofaPhysicsSimulation::getTime() const
+{
+    if (getScene())
+        return getScene()->getContext()->getTime();
+    else
+        return 0.0;
+}
+
+double SofaPhysicsSimulation::getCurrentFPS() const
+{
+    return currentFPS;
+}
+
+double *SofaPhysicsSimulation::getGravity() const
+{
+    double* gravityVec = new double[3];
+
+    if (getScene())
+    {
+        const auto& g = getScene()->getContext()->getGravity();
+        gravityVec[0] = g.x();
+        gravityVec[1] = g.y();
+        gravityVec[2] = g.z();
+    }
+
+    return gravityVec;
+}
+
+int SofaPhysicsSimulation::getGravity(double* values) const
+{
+    if (getScene())
+    {
+        const auto& g = getScene()->getContext()->getGravity();
+        values[0] = g.x();
+        values[1] = g.y();
+        values[2] = g.z();
+        return API_SUCCESS;
+    }
+    else
+    {
+        return API_SCENE_NULL;
+    }
+}
+
+void SofaPhysicsSimulation::setGravity(double* gravity)
+{
+    const auto& g = sofa::type::Vec3d(gravity[0], gravity[1], gravity[2]);
+    getScene()->getContext()->setGravity(g);
+    wakeUp();
+}
+
+
+void SofaPhysicsSimulation::start()
+{
+    if (isAnimated()) return;
+    if (getScene())
+    {
+        getScene()->getContext()->setAnimate(true);
+        //animatedChanged();
+    }
+}
+
+void SofaPhysicsSimulation::stop()
+{
+    if (!isAnimated()) return;
+    if (getScene())
+    {
+        getScene()->getContext()->setAnimate(false);
+        //animatedChanged();
+    }
+}
+
+
+void SofaPhysicsSimulation::reset()
+{
+    if (getScene())
+    {
+        sofa::simulation::node::reset(getScene());
+        wakeUp();
+        this->update();
+    }
+}
+
+void SofaPhysicsSimulation::resetView()
+{
+    if (getScene() && currentCamera)
+    {
+        currentCamera->setDefaultView(getScene()->getGravity());
+        if (!sceneFileName.empty())
+        {
+            std::string viewFileName = sceneFileName + ".view";
+            if (!currentCamera->importParametersFromFile(viewFileName))
+                currentCamera->setDefaultView(getScene()->getGravity());
+        }
+    }
+}
+
+void SofaPhysicsSimulation::update()
+{
+}
+
+void SofaPhysicsSimulation::step()
+{
+    sofa::simulation::Node* groot = getScene();
+    if (!groot) return;
+
+    // Asleep: no animate, no visual update, output meshes keep their revision, the time stops. Only the inputs and the command queue are polled
+    if (m_sleeping)
+    {
+        if (getNbQueuedCommands() == 0 && getInputSignature() == m_inputSignature)
+            return;
+        wakeUp();
+    }
+
+    const sofa::helper::system::thread::ctime_t stepStart = sofa::helper::system::thread::CTime::getRefTime();
+    beginStep();
+    animateAdaptive(groot);
+    sofa::simulation::node::updateVisual(groot);
+    if ( useGUI ) {
+      sofa::gui::common::BaseGUI* gui = sofa::gui::common::GUIManager::getGUI();
+      gui->stepMainLoop();
+      if (GUIFramerate)
+      {
+          sofa::helper::system::thread::ctime_t curtime = sofa::helper::system::thread::CTime::getRefTime();
+          if ((curtime-lastRedrawTime) > (double)timeTicks/GUIFramerate)
+          {
+              lastRedrawTime = curtime;
+              gui->redraw();
+          }
+      }
+    }
+    endStep();
+
+    m_lastStepDuration = double(sofa::helper::system::thread::CTime::getRefTime() - stepStart) * 1000.0 / double(timeTicks);
+    if (m_stepBudget > 0)
+        updateStepBudget(m_lastStepDuration);
+}
+
+void SofaPhysicsSimulation::beginStep()
+{
+    applyQueuedCommands();
+}
+
+int SofaPhysicsSimulation::pushCommand(const QueuedCommand& command)
+{
+    const unsigned int head = m_commandHead.load(std::memory_order_relaxed);
+    if (head - m_commandTail.load(std::memory_order_acquire) >= CommandQueueSize)
+        return API_COMMAND_QUEUE_FULL;
+
+    m_commands[head % CommandQueueSize] = command;
+    m_commandHead.store(head + 1, std::memory_order_release);
+    return API_SUCCESS;
+}
+
+void SofaPhysicsSimulation::applyQueuedCommands()
+{
+    // Commands queued while these are applied wait for the next step, so a step sees a consistent set
+    const unsigned int head = m_commandHead.load(std::memory_order_acquire);
+    unsigned int tail = m_commandTail.load(std::memory_order_relaxed);
+    if (tail == head)
+        return;
+
+    for (; tail != head; ++tail)
+    {
+        QueuedCommand& command = m_commands[tail % CommandQueueSize];
+        switch (command.type)
+        {
+        case QueuedCommand::TimeStep:
+            setTimeStep(command.values[0]);
+            break;
+        case QueuedCommand::Gravity:
+            if (getScene())
+                setGravity(command.values);
+            break;
+        case QueuedCommand::Value:
+            sendValue(command.text, command.values[0]);
+            break;
+        case QueuedCommand::DataControllerValue:
+            if (dataControllers.empty() && getScene())
+                getDataControllers();
+            if (command.index < dataControllers.size())
+                dataControllers[command.index]->setValue(command.text);
+            break;
+        }
+    }
+    m_commandTail.store(head, std::memory_order_release);
+}
+
+int SofaPhysicsSimulation::queueTimeStep(double dt)
+{
+    QueuedCommand command;
+    command.type = QueuedCommand::TimeStep;
+    command.values[0] = dt;
+    return pushCommand(command);
+}
+
+int SofaPhysicsSimulation::queueGravity(const double* gravity)
+{
+    if (gravity == nullptr)
+        return API_NULL;
+
+    QueuedCommand command;
+    command.type = QueuedCommand::Gravity;
+    std::copy(gravity, gravity + 3, command.values);
+    return pushCommand(command);
+}
+
+int SofaPhysicsSimulation::queueValue(const char* name, double value)
+{
+    if (name == nullptr || std::strlen(name) >= QueuedCommand::TextSize)
+        return API_NULL;
+
+    QueuedCommand command;
+    command.type = QueuedCommand::Value;
+    command.values[0] = value;
+    std::strcpy(command.text, name);
+    return pushCommand(command);
+}
+
+int SofaPhysicsSimulation::queueDataControllerValue(unsigned int controllerId, const char* value)
+{
+    if (value == nullptr || std::strlen(value) >= QueuedCommand::TextSize)
+        return API_NULL;
+
+    QueuedCommand command;
+    command.type = QueuedCommand::DataControllerValue;
+    command.index = controllerId;
+    std::strcpy(command.text, value);
+    return pushCommand(command);
+}
+
+void SofaPhysicsSimulation::endStep()
+{
+    update();
+    updateCurrentFPS();
+    updateOutputMeshes();
+
+    // Raycast trees follow the state of this step, queries from other threads wait for the refit
+    for (SofaPhysicsOutputMesh* mesh : outputMeshes)
+        mesh->refitRaycast();
+
+    updateHapticSurface();
+    if (m_contactExport)
+        exportContacts();
+    updateSleepState();
+}
+
+int SofaPhysicsSimulation::setContactExport(bool enabled, const char* modelNames)
+{
+    m_contactExport = enabled;
+    m_contactModelFilter.clear();
+
+    std::istringstream names(modelNames ? modelNames : "");
+    std::string name;
+    while (std::getline(names, name, ','))
+    {
+        name.erase(0, name.find_first_not_of(" \t"));
+        name.erase(name.find_last_not_of(" \t") + 1);
+        if (!name.empty())
+            m_contactModelFilter.push_back(name);
+    }
+
+    collectContactSources();
+    return API_SUCCESS;
+}
+
+int SofaPhysicsSimulation::getContacts(SofaPhysicsContacts* contacts) const
+{
+    if (contacts == nullptr)
+        return API_NULL;
+
+    contacts->revision = m_contactRevision;
+    contacts->nbContacts = static_cast<unsigned int>(m_contactDepths.size());
+    contacts->points = m_contactPoints.data();
+    contacts->normals = m_contactNormals.data();
+    contacts->depths = m_contactDepths.data();
+    contacts->forces = m_contactForces.data();
+    contacts->models = m_contactModels.data();
+    return API_SUCCESS;
+}
+
+const char* SofaPhysicsSimulation::getCollisionModelName(unsigned int modelId) const
+{
+    if (modelId >= m_collisionModels.size())
+        return nullptr;
+
+    return m_collisionModels[modelId]->getName().c_str();
+}
+
+void SofaPhysicsSimulation::collectContactSources()
+{
+    m_collisionModels.clear();
+    m_contactModelSelected.clear();
+    m_narrowPhases.clear();
+    m_constraintForceData = nullptr;
+
+    // hand the solver back its own setting, load and unload drop the switch with the graph it belonged to
+    if (m_constraintForceSwitch)
+    {
+        m_constraintForceSwitch->read(m_constraintForceSwitchValue);
+        m_constraintForceSwitch = nullptr;
+    }
+
+    sofa::simulation::Node* groot = getScene();
+    if (!groot)
+        return;
+
+    groot->getTreeObjects<sofa::core::CollisionModel>(&m_collisionModels);
+    for (sofa::core::CollisionModel* model : m_collisionModels)
+    {
+        const bool selected = m_contactModelFilter.empty()
+            || std::find(m_contactModelFilter.begin(), m_contactModelFilter.end(), model->getName()) != m_contactModelFilter.end();
+        m_contactModelSelected.push_back(selected ? 1 : 0);
+    }
+    groot->getTreeObjects<sofa::core::collision::NarrowPhaseDetection>(&m_narrowPhases);
+
+    if (!m_contactExport)
+        return;
+
+    // GenericConstraintSolver only fills constraintForces when asked to, LCPConstraintSolver has no such output
+    std::vector<sofa::core::behavior::ConstraintSolver*> constraintSolvers;
+    groot->getTreeObjects<sofa::core::behavior::ConstraintSolver>(&constraintSolvers);
+    for (sofa::core::behavior::ConstraintSolver* solver : constraintSolvers)
+    {
+        sofa::core::objectmodel::BaseData* compute = solver->findData("computeConstraintForces");
+        sofa::core::objectmodel::BaseData* forces = solver->findData("constraintForces");
+        if (compute && forces)
+        {
+            m_constraintForceSwitch = compute;
+            m_constraintForceSwitchValue = compute->getValueString();
+            if (m_constraintForceSwitchValue != "1")
+                msg_info("SofaPhysicsSimulation") << "Contact export: computeConstraintForces of '" << solver->getName()
+                    << "' set to 1 (was " << m_constraintForceSwitchValue << "), restored when the export is disabled";
+            compute->read("1");
+            m_constraintForceData = forces;
+            break;
+        }
+    }
+
+    if (m_narrowPhases.empty())
+        msg_warning("SofaPhysicsSimulation") << "Contact export enabled but the scene has no collision pipeline";
+}
+
+void SofaPhysicsSimulation::exportContacts()
+{
+    ++m_contactRevision;
+    m_contactPoints.clear();
+    m_contactNormals.clear();
+    m_contactDepths.clear();
+    m_contactForces.clear();
+    m_contactModels.clear();
+
+    sofa::simulation::Node* groot = getScene();
+    if (!groot || m_narrowPhases.empty())
+        return;
+
+    // Lagrange multipliers are impulses: force of each contact constraint row over the step dt, keyed by the persistent id of the contact
+    m_constraintForces.clear();
+    const auto* lambdaData = dynamic_cast<const sofa::core::objectmodel::Data<sofa::type::vector<SReal>>*>(m_constraintForceData);
+    const SReal dt = groot->getDt();
+    if (lambdaData && dt > 0)
+    {
+        const sofa::type::vector<SReal>& lambdas = lambdaData->getValue();
+        m_stepConstraints.clear();
+        m_constraintBlocks.clear();
+        m_constraintIds.clear();
+        m_constraintPositions.clear();
+        m_constraintDirections.clear();
+        m_constraintAreas.clear();
+
+        // contact constraints are created by the collision response of each step, they are looked up again every time
+        groot->getTreeObjects<sofa::core::behavior::BaseConstraint>(&m_stepConstraints);
+        for (sofa::core::behavior::BaseConstraint* constraint : m_stepConstraints)
+            constraint->getConstraintInfo(sofa::core::ConstraintParams::defaultInstance(), m_constraintBlocks, m_constraintIds, m_constraintPositions, m_constraintDirections, m_constraintAreas);
+
+        for (const auto& block : m_constraintBlocks)
+        {
+            if (!block.hasId || !block.hasPosition)
+                continue;
+
+            // a contact takes nbLines rows, the normal one first
+            for (int group = 0; group < block.nbGroups; ++group)
+            {
+                const std::size_t row = std::size_t(block.const0 + group * block.nbLines);
+                if (row >= lambdas.size())
+                    break;
+
+                const auto& position = m_constraintPositions[block.offsetPosition + group];
+                m_constraintForces.push_back({ std::llabs((long long)m_constraintIds[block.offsetId + group]),
+                    { position[0], position[1], position[2] }, std::abs(lambdas[row]) / dt });
+            }
+        }
+        std::sort(m_constraintForces.begin(), m_constraintForces.end(), [](const ContactForce& a, const ContactForce& b) { return a.id < b.id; });
+    }
+
+    auto modelIndex = [this](sofa::core::CollisionModel* model)
+    {
+        const auto it = std::find(m_collisionModels.begin(), m_collisionModels.end(), model);
+        return it == m_collisionModels.end() ? -1 : int(it - m_collisionModels.begin());
+    };
+
+    for (sofa::core::collision::NarrowPhaseDetection* narrowPhase : m_narrowPhases)
+    {
+        for (const auto& pairOutputs : narrowPhase->getDetectionOutputs())
+        {
+            const int model0 = modelIndex(pairOutputs.first.first);
+            const int model1 = modelIndex(pairOutputs.first.second);
+            if ((model0 < 0 || !m_contactModelSelected[model0]) && (model1 < 0 || !m_contactModelSelected[model1]))
+                continue;
+
+            // every TDetectionOutputVector is also a plain vector of DetectionOutput, whatever its model types
+            const auto* outputs = dynamic_cast<const sofa::type::vector<sofa::core::collision::DetectionOutput>*>(pairOutputs.second);
+            if (outputs == nullptr)
+                continue;
+
+            for (const sofa::core::collision::DetectionOutput& output : *outputs)
+            {
+                SReal force = 0;
+                const ContactForce key = { std::llabs((long long)output.id), {}, 0 };
+                const auto range = std::equal_range(m_constraintForces.begin(), m_constraintForces.end(), key,
+                    [](const ContactForce& a, const ContactForce& b) { return a.id < b.id; });
+                SReal closest = std::numeric_limits<SReal>::max();
+                for (auto it = range.first; it != range.second; ++it)
+                {
+                    // ids are only unique within a pair of models, the contact point tells the pairs apart
+                    const sofa::type::Vec3 delta(it->position[0] - output.point[0][0], it->position[1] - output.point[0][1], it->position[2] - output.point[0][2]);
+                    if (delta.norm2() < closest)
+                    {
+                        closest = delta.norm2();
+                        force = it->force;
+                    }
+                }
+
+                for (int c = 0; c < 3; ++c)
+                {
+                    m_contactPoints.push_back(Real(output.point[0][c]));
+                    m_contactNormals.push_back(Real(output.normal[c]));
+                }
+                m_contactDepths.push_back(Real(-output.value));
+                m_contactForces.push_back(Real(force));
+                m_contactModels.push_back(model0);
+                m_contactModels.push_back(model1);
+            }
+        }
+    }
+}
+
+namespace
+{
+/// Steady clock time in seconds
+double hapticClock()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+}
+
+int SofaPhysicsSimulation::startHapticLoop(const char* meshName, double rateHz, double stiffness, double toolRadius)
+{
+    if (meshName == nullptr || rateHz <= 0 || stiffness < 0 || toolRadius <= 0)
+        return API_NULL;
+    if (getOutputMeshPtr(meshName) == nullptr)
+        return API_MESH_NULL;
+
+    stopHapticLoop();
+    {
+        // a step ending on another thread may be reading the settings in updateHapticSurface
+        std::lock_guard<std::mutex> lock(m_hapticSurfaceMutex);
+        m_hapticMeshName = meshName;
+        m_hapticPeriod = 1.0 / rateHz;
+        m_hapticStiffness = stiffness;
+        m_hapticToolRadius = toolRadius;
+        m_hapticRunning.store(true, std::memory_order_release);
+    }
+
+    // first surface from the current state, the loop does not wait for a step
+    updateHapticSurface();
+    m_hapticThread = std::thread(&SofaPhysicsSimulation::hapticLoop, this);
+
+    msg_info("SofaPhysicsSimulation") << "Haptic loop started at " << rateHz << " Hz on " << meshName;
+    return API_SUCCESS;
+}
+
+int SofaPhysicsSimulation::stopHapticLoop()
+{
+    if (!m_hapticThread.joinable())
+        return API_SUCCESS;
+
+    m_hapticRunning.store(false, std::memory_order_release);
+    m_hapticThread.join();
+    return API_SUCCESS;
+}
+
+int SofaPhysicsSimulation::setHapticToolPosition(const double* position)
+{
+    if (position == nullptr)
+        return API_NULL;
+
+    std::copy(position, position + 3, m_hapticPose.back().v);
+    m_hapticPose.publish();
+    return API_SUCCESS;
+}
+
+int SofaPhysicsSimulation::getHapticForce(double* force)
+{
+    if (force == nullptr)
+        return API_NULL;
 
+    m_hapticForce.acquire();
+    std::copy(m_hapticForce.front().v, m_hapticForce.front().v + 3, force);
     return API_SUCCESS;
 }
 
-int SofaPhysicsSimulation::loadPlugin(const char* pluginPath)
+int SofaPhysicsSimulation::getHapticStats(SofaPhysicsHapticStats* stats)
 {
-    sofa::helper::system::PluginManager::PluginLoadStatus plugres = sofa::helper::system::PluginManager::getInstance().loadPlugin(pluginPath);
-    if (plugres == sofa::helper::system::PluginManager::PluginLoadStatus::SUCCESS || plugres == sofa::helper::system::PluginManager::PluginLoadStatus::ALREADY_LOADED)
-        return API_SUCCESS;
-    else if (plugres == sofa::helper::system::PluginManager::PluginLoadStatus::INVALID_LOADING)
-        return API_PLUGIN_INVALID_LOADING;
-    else if (plugres == sofa::helper::system::PluginManager::PluginLoadStatus::MISSING_SYMBOL)
-        return API_PLUGIN_MISSING_SYMBOL;
-    else if (plugres == sofa::helper::system::PluginManager::PluginLoadStatus::PLUGIN_FILE_NOT_FOUND)
-        return API_PLUGIN_FILE_NOT_FOUND;
-    else
-        return API_PLUGIN_LOADING_FAILED;
+    if (stats == nullptr)
+        return API_NULL;
+
+    m_hapticStats.acquire();
+    *stats = m_hapticStats.front();
+    return API_SUCCESS;
 }
 
-void SofaPhysicsSimulation::createScene()
+void SofaPhysicsSimulation::updateHapticSurface()
 {
-    m_RootNode = sofa::simulation::getSimulation()->createNewGraph("root");
-    sofa::simpleapi::createObject(m_RootNode, "CollisionPipeline", { {"name","Collision Pipeline"} });
-    sofa::simpleapi::createObject(m_RootNode, "BruteForceBroadPhase", { {"name","Broad Phase Detection"} });
-    sofa::simpleapi::createObject(m_RootNode, "BVHNarrowPhase", { {"name","Narrow Phase Detection"} });
-    sofa::simpleapi::createObject(m_RootNode, "MinProximityIntersection", { {"name","Proximity"},
-                                                               {"alarmDistance", "0.3"},
-                                                               {"contactDistance", "0.2"} });
+    std::lock_guard<std::mutex> lock(m_hapticSurfaceMutex);
+    if (!m_hapticRunning.load(std::memory_order_acquire))
+        return;
 
-    sofa::simpleapi::createObject(m_RootNode, "CollisionResponse", {
-                                {"name", "Contact Manager"},
-                                {"response", "PenalityContactForceField"}
-        });
+    HapticSurface& surface = m_hapticSurface.back();
+    surface.stepTime = hapticClock();
 
-    if (m_RootNode.get())
+    // the mesh is looked up by name at each step, it survives a reload of a scene with the same mesh
+    SofaPhysicsOutputMesh* mesh = getOutputMeshPtr(m_hapticMeshName.c_str());
+    const Real* positions = mesh ? mesh->getVPositions() : nullptr;
+    const unsigned int nbVertices = positions ? mesh->getNbVertices() : 0;
+    if (nbVertices == 0)
     {
-        m_RootNode->setGravity({ 0,-9.8,0 });
-        this->createScene_impl();
+        surface.positions.clear();
+        surface.tree.reset();
+        m_hapticSurface.publish();
+        return;
+    }
 
-        sofa::simulation::node::initRoot(m_RootNode.get());
+    const bool sameTopology = surface.tree.isValid() && surface.positions.size() == std::size_t(nbVertices) * 3
+        && surface.trianglesRevision == mesh->getTrianglesRevision() && surface.quadsRevision == mesh->getQuadsRevision();
+    surface.positions.assign(positions, positions + 3 * nbVertices);
 
-        updateOutputMeshes();
+    const float* copy = surface.positions.data();
+    const auto vertex = [copy](int v) { return copy + std::size_t(v) * 3; };
+    if (sameTopology)
+    {
+        surface.tree.refit(vertex);
     }
     else
-        std::cerr <<"Error: can't get m_RootNode" << std::endl;
+    {
+        // same triangle numbering as the raycast: triangles, then quads split in 2
+        const unsigned int nbTriangles = mesh->getNbTriangles();
+        const unsigned int nbQuads = mesh->getNbQuads();
+        const Index* triangles = mesh->getTriangles();
+        const Index* quads = mesh->getQuads();
+        surface.indices.clear();
+        if (triangles)
+            surface.indices.insert(surface.indices.end(), triangles, triangles + 3 * nbTriangles);
+        for (unsigned int q = 0; quads && q < nbQuads; ++q)
+        {
+            const Index* quad = quads + q * 4;
+            surface.indices.insert(surface.indices.end(), { int(quad[0]), int(quad[1]), int(quad[2]), int(quad[0]), int(quad[2]), int(quad[3]) });
+        }
+        surface.tree.build(vertex, surface.indices.data(), int(surface.indices.size() / 3));
+        surface.vertexNormals.build(surface.indices.data(), int(surface.indices.size() / 3), int(nbVertices));
+        surface.trianglesRevision = mesh->getTrianglesRevision();
+        surface.quadsRevision = mesh->getQuadsRevision();
+    }
+
+    // the inside/outside reference follows these positions: the SOFA normals are stale when the application computes its own
+    surface.normals.resize(std::size_t(nbVertices) * 3);
+    float* normals = surface.normals.data();
+    surface.vertexNormals.compute(vertex, surface.indices.data(),
+        [](int count, const auto& body) { for (int i = 0; i < count; ++i) body(i); },
+        [normals](int v, double x, double y, double z) { normals[v * 3] = float(x); normals[v * 3 + 1] = float(y); normals[v * 3 + 2] = float(z); });
+
+    m_hapticSurface.publish();
 }
 
-void SofaPhysicsSimulation::createScene_impl()
+void SofaPhysicsSimulation::computeHapticForce(const HapticSurface& surface, const double* center, double* force) const
 {
-    if (!m_RootNode.get())
+    force[0] = force[1] = force[2] = 0.0;
+    if (!surface.tree.isValid())
         return;
-}
 
+    const float* positions = surface.positions.data();
+    const auto vertex = [positions](int v) { return positions + std::size_t(v) * 3; };
+    SofaPhysicsTriangleBVH<double>::Hit hit;
+    if (!surface.tree.closestPoint(vertex, center, m_hapticToolRadius, hit))
+        return;
 
-void SofaPhysicsSimulation::sendValue(const char* name, double value)
-{
-    // send a GUIEvent to the tree
-    if (m_RootNode!=0)
+    // closest point and the normal interpolated there, the vertex normals tell which side of the surface the center is on
+    const int* triangle = &surface.indices[std::size_t(hit.triangle) * 3];
+    const double weights[3] = { 1.0 - hit.u - hit.v, hit.u, hit.v };
+    double closest[3] = { 0.0, 0.0, 0.0 };
+    double normal[3] = { 0.0, 0.0, 0.0 };
+    for (int k = 0; k < 3; ++k)
     {
-        std::ostringstream oss;
-        oss << value;
-        sofa::core::objectmodel::GUIEvent event("",name,oss.str().c_str());
-        m_RootNode->propagateEvent(sofa::core::ExecParams::defaultInstance(), &event);
+        const float* p = &surface.positions[std::size_t(triangle[k]) * 3];
+        const float* n = &surface.normals[std::size_t(triangle[k]) * 3];
+        for (int c = 0; c < 3; ++c)
+        {
+            closest[c] += weights[k] * p[c];
+            normal[c] += weights[k] * n[c];
+        }
     }
-    this->update();
-}
+    const double normalNorm = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+    if (normalNorm <= 0.0)
+        return;
 
-bool SofaPhysicsSimulation::isAnimated() const
-{
-    if (getScene())
-        return getScene()->getContext()->getAnimate();
-    return false;
+    // outside: pushed away from the closest point by the overlap. Past the surface: pushed back along the normal by the overlap plus the distance
+    const double d[3] = { center[0] - closest[0], center[1] - closest[1], center[2] - closest[2] };
+    const bool outside = d[0] * normal[0] + d[1] * normal[1] + d[2] * normal[2] >= 0.0;
+    double direction[3];
+    if (outside && hit.distance > 1e-9 * m_hapticToolRadius)
+    {
+        for (int c = 0; c < 3; ++c)
+            direction[c] = d[c] / hit.distance;
+    }
+    else
+    {
+        for (int c = 0; c < 3; ++c)
+            direction[c] = normal[c] / normalNorm;
+    }
+
+    const double depth = outside ? m_hapticToolRadius - hit.distance : m_hapticToolRadius + hit.distance;
+    for (int c = 0; c < 3; ++c)
+        force[c] = m_hapticStiffness * depth * direction[c];
 }
 
-void SofaPhysicsSimulation::setAnimated(bool val)
+void SofaPhysicsSimulation::hapticLoop()
 {
-    if (val) start();
-    else stop();
+    configureCurrentThread(0, API_THREAD_PRIORITY_HIGH);
+
+    // OS sleeps are coarser than a millisecond period: sleep until close to the deadline, then spin
+    const double spinMargin = 0.002;
+    SofaPhysicsHapticStats stats = {};
+    double jitterSum = 0.0;
+    double deadline = hapticClock();
+    while (m_hapticRunning.load(std::memory_order_acquire))
+    {
+        double start = hapticClock();
+        while (start < deadline)
+        {
+            if (deadline - start > spinMargin)
+                std::this_thread::sleep_for(std::chrono::duration<double>(deadline - start - spinMargin));
+            else
+                std::this_thread::yield();
+            start = hapticClock();
+        }
+
+        m_hapticSurface.acquire();
+        m_hapticPose.acquire();
+        const HapticSurface& surface = m_hapticSurface.front();
+        computeHapticForce(surface, m_hapticPose.front().v, m_hapticForce.back().v);
+        m_hapticForce.publish();
+
+        const double end = hapticClock();
+        const double jitter = (start - deadline) * 1000.0;
+        ++stats.nbIterations;
+        if (end > deadline + m_hapticPeriod)
+            ++stats.nbMissedDeadlines;
+        jitterSum += jitter;
+        stats.meanJitterMs = jitterSum / stats.nbIterations;
+        stats.maxJitterMs = std::max(stats.maxJitterMs, jitter);
+        stats.maxComputeMs = std::max(stats.maxComputeMs, (end - start) * 1000.0);
+        stats.surfaceAgeMs = (end - surface.stepTime) * 1000.0;
+        m_hapticStats.back() = stats;
+        m_hapticStats.publish();
+
+        // after a stall the period restarts from now instead of bursting to catch up
+        deadline = std::max(deadline + m_hapticPeriod, end);
+    }
+
+    // the device must not keep the last contact force once the loop is gone
+    HapticVec3& force = m_hapticForce.back();
+    force.v[0] = force.v[1] = force.v[2] = 0.0;
+    m_hapticForce.publish();
 }
 
-double SofaPhysicsSimulation::getTimeStep() const
+int SofaPhysicsSimulation::setSleepThreshold(double maxVelocity, int quietSteps)
 {
-    if (getScene())
-        return getScene()->getContext()->getDt();
-    else
-        return 0.0;
+    if (quietSteps < 1)
+        return API_NULL;
+
+    m_sleepVelocity = maxVelocity;
+    m_sleepQuietSteps = quietSteps;
+    if (m_sleepVelocity > 0 && !m_timeDrivenComponent.empty())
+        msg_info("SofaPhysicsSimulation") << "Sleep disabled: '" << m_timeDrivenComponent << "' depends on the simulation time";
+    wakeUp();
+    return API_SUCCESS;
 }
 
-void SofaPhysicsSimulation::setTimeStep(double dt)
+void SofaPhysicsSimulation::collectSleepInputs()
 {
-    if (getScene())
+    m_forceInputs.clear();
+    m_timeDrivenComponent.clear();
+    sofa::simulation::Node* groot = getScene();
+    if (!groot)
+        return;
+
+    // the external forces applied to the states, and any Data of a force field (ConstantForceField forces, spring stiffness...) written by the application
+    for (sofa::core::behavior::BaseMechanicalState* state : m_mechanicalStates)
     {
-        getScene()->getContext()->setDt(dt);
+        if (sofa::core::objectmodel::BaseData* externalForce = state->findData("externalForce"))
+            m_forceInputs.push_back(externalForce);
+    }
+    std::vector<sofa::core::behavior::BaseForceField*> forceFields;
+    groot->getTreeObjects<sofa::core::behavior::BaseForceField>(&forceFields);
+    for (sofa::core::behavior::BaseForceField* forceField : forceFields)
+    {
+        for (sofa::core::objectmodel::BaseData* data : forceField->getDataFields())
+            m_forceInputs.push_back(data);
     }
-}
 
-double SofaPhysicsSimulation::getTime() const
-{
-    if (getScene())
-        return getScene()->getContext()->getTime();
+    // the time stops while asleep: controllers (scripted or not) and key time motions would never get to their next event
+    std::vector<sofa::core::behavior::BaseController*> controllers;
+    groot->getTreeObjects<sofa::core::behavior::BaseController>(&controllers);
+    if (!controllers.empty())
+    {
+        m_timeDrivenComponent = controllers.front()->getPathName();
+    }
     else
-        return 0.0;
+    {
+        std::vector<sofa::core::objectmodel::BaseObject*> objects;
+        groot->getTreeObjects<sofa::core::objectmodel::BaseObject>(&objects);
+        for (sofa::core::objectmodel::BaseObject* object : objects)
+        {
+            if (object->findData("keyTimes"))
+            {
+                m_timeDrivenComponent = object->getPathName();
+                break;
+            }
+        }
+    }
+
+    if (!m_timeDrivenComponent.empty() && m_sleepVelocity > 0)
+        msg_info("SofaPhysicsSimulation") << "Sleep disabled: '" << m_timeDrivenComponent << "' depends on the simulation time";
 }
 
-double SofaPhysicsSimulation::getCurrentFPS() const
+void SofaPhysicsSimulation::wakeUp()
 {
-    return currentFPS;
+    if (m_sleeping)
+        msg_info("SofaPhysicsSimulation") << "Waking up at t=" << getTime();
+
+    m_sleeping = false;
+    m_quietSteps = 0;
 }
 
-double *SofaPhysicsSimulation::getGravity() const
+void SofaPhysicsSimulation::updateSleepState()
 {
-    double* gravityVec = new double[3];
+    if (m_sleepVelocity <= 0 || m_mechanicalStates.empty() || !m_timeDrivenComponent.empty())
+        return;
 
-    if (getScene())
+    // infinity norm of the velocities of this step, the kinetic energy would need the masses for little gain
+    SReal maxVelocity = 0;
+    for (sofa::core::behavior::BaseMechanicalState* state : m_mechanicalStates)
+        maxVelocity = std::max(maxVelocity, state->vMax(sofa::core::ExecParams::defaultInstance(), sofa::core::ConstVecDerivId::velocity()));
+
+    if (maxVelocity >= m_sleepVelocity)
     {
-        const auto& g = getScene()->getContext()->getGravity();
-        gravityVec[0] = g.x();
-        gravityVec[1] = g.y();
-        gravityVec[2] = g.z();
+        m_quietSteps = 0;
+        return;
     }
 
-    return gravityVec;
+    if (++m_quietSteps >= m_sleepQuietSteps)
+    {
+        m_sleeping = true;
+        m_inputSignature = getInputSignature();
+        msg_info("SofaPhysicsSimulation") << "Falling asleep at t=" << getTime() << " after " << m_quietSteps << " steps under " << m_sleepVelocity;
+    }
 }
 
-int SofaPhysicsSimulation::getGravity(double* values) const
+int SofaPhysicsSimulation::setStepBudget(double budgetMs, int minSolverIterations, int minConstraintIterations)
 {
-    if (getScene())
+    if (minSolverIterations < 1 || minConstraintIterations < 1)
+        return API_NULL;
+
+    m_stepBudget = budgetMs;
+    m_minSolverIterations = minSolverIterations;
+    m_minConstraintIterations = minConstraintIterations;
+    m_stepTimeAverage = 0.0;
+    m_degradedSteps = 0;
+
+    // restore the scene values, then re-read them with the new minimums
+    m_budgetScale = 1.0;
+    applySolverCaps();
+    collectSolverCaps();
+    return API_SUCCESS;
+}
+
+void SofaPhysicsSimulation::collectSolverCaps()
+{
+    m_budgetScale = 1.0;
+    m_stepTimeAverage = 0.0;
+    m_solverCaps.clear();
+
+    sofa::simulation::Node* groot = getScene();
+    if (!groot)
+        return;
+
+    auto addCap = [this](sofa::core::objectmodel::BaseObject* solver, const char* dataName, int minValue)
     {
-        const auto& g = getScene()->getContext()->getGravity();
-        values[0] = g.x();
-        values[1] = g.y();
-        values[2] = g.z();
-        return API_SUCCESS;
-    }
-    else
+        sofa::core::objectmodel::BaseData* data = solver->findData(dataName);
+        if (data == nullptr)
+            return false;
+
+        const int sceneValue = std::atoi(data->getValueString().c_str());
+        if (sceneValue > 0)
+            m_solverCaps.push_back({ data, sceneValue, std::min(minValue, sceneValue) });
+        return true;
+    };
+
+    std::vector<sofa::core::behavior::BaseLinearSolver*> linearSolvers;
+    groot->getTreeObjects<sofa::core::behavior::BaseLinearSolver>(&linearSolvers);
+    for (sofa::core::behavior::BaseLinearSolver* solver : linearSolvers)
+        addCap(solver, "iterations", m_minSolverIterations);
+
+    // LCPConstraintSolver names it maxIt, GenericConstraintSolver maxIterations
+    std::vector<sofa::core::behavior::ConstraintSolver*> constraintSolvers;
+    groot->getTreeObjects<sofa::core::behavior::ConstraintSolver>(&constraintSolvers);
+    for (sofa::core::behavior::ConstraintSolver* solver : constraintSolvers)
     {
-        return API_SCENE_NULL;
+        if (!addCap(solver, "maxIt", m_minConstraintIterations))
+            addCap(solver, "maxIterations", m_minConstraintIterations);
     }
 }
 
-void SofaPhysicsSimulation::setGravity(double* gravity)
+void SofaPhysicsSimulation::updateStepBudget(double stepDuration)
 {
-    const auto& g = sofa::type::Vec3d(gravity[0], gravity[1], gravity[2]);
-    getScene()->getContext()->setGravity(g);
-}
+    // exponential average so one contact spike does not drop the quality alone
+    m_stepTimeAverage = (m_stepTimeAverage <= 0) ? stepDuration : 0.8 * m_stepTimeAverage + 0.2 * stepDuration;
 
+    double scale = m_budgetScale;
+    if (m_stepTimeAverage > m_stepBudget)
+        scale *= std::max(0.5, m_stepBudget / m_stepTimeAverage);
+    else if (m_stepTimeAverage < 0.75 * m_stepBudget)
+        scale = std::min(1.0, scale * 1.1);
+    scale = std::max(scale, 0.01);
 
-void SofaPhysicsSimulation::start()
-{
-    if (isAnimated()) return;
-    if (getScene())
+    if (scale != m_budgetScale)
     {
-        getScene()->getContext()->setAnimate(true);
-        //animatedChanged();
+        const bool wasDegraded = m_budgetScale < 1.0;
+        m_budgetScale = scale;
+        applySolverCaps();
+
+        if (wasDegraded != (m_budgetScale < 1.0))
+        {
+            msg_info("SofaPhysicsSimulation") << (wasDegraded ? "Solver quality restored" : "Solver quality degraded") << " at t=" << getTime()
+                << ", step " << m_stepTimeAverage << " ms for a budget of " << m_stepBudget << " ms";
+        }
     }
+
+    if (m_budgetScale < 1.0)
+        ++m_degradedSteps;
 }
 
-void SofaPhysicsSimulation::stop()
+void SofaPhysicsSimulation::applySolverCaps()
 {
-    if (!isAnimated()) return;
-    if (getScene())
+    for (const SolverCap& cap : m_solverCaps)
     {
-        getScene()->getContext()->setAnimate(false);
-        //animatedChanged();
+        const int value = std::max(cap.minValue, int(std::lround(cap.sceneValue * m_budgetScale)));
+        cap.data->read(std::to_string(value));
     }
 }
 
+int SofaPhysicsSimulation::setAdaptiveTimeStep(bool enabled, double minDt, double maxDt)
+{
+    if (enabled && (minDt <= 0 || maxDt < minDt))
+        return API_NULL;
+
+    m_adaptiveDt = enabled;
+    m_minDt = minDt;
+    m_maxDt = maxDt;
+    m_calmSteps = 0;
+    m_nbRollbacks = 0;
+    if (enabled && !m_rollbackBlocker.empty())
+        msg_info("SofaPhysicsSimulation") << "Adaptive time step without rollback: '" << m_rollbackBlocker << "' keeps a state a snapshot does not restore";
+    if (!enabled)
+        m_snapshot.clear();
+    else if (getScene())
+        getScene()->getContext()->setDt(std::clamp(getTimeStep(), minDt, maxDt));
+    return API_SUCCESS;
+}
 
-void SofaPhysicsSimulation::reset()
+void SofaPhysicsSimulation::collectConvergenceProbes()
 {
-    if (getScene())
+    m_convergenceProbes.clear();
+    m_rollbackBlocker.clear();
+    sofa::simulation::Node* groot = getScene();
+    if (!groot)
+        return;
+
+    // a snapshot only holds the states: controllers would see the events of the step twice, constraint solvers keep the
+    // previous lambdas to warm start and the contact manager its contact responses. None of them would replay the step
+    std::vector<sofa::core::behavior::BaseController*> controllers;
+    std::vector<sofa::core::behavior::ConstraintSolver*> constraintSolvers;
+    std::vector<sofa::core::collision::ContactManager*> contactManagers;
+    groot->getTreeObjects<sofa::core::behavior::BaseController>(&controllers);
+    groot->getTreeObjects<sofa::core::behavior::ConstraintSolver>(&constraintSolvers);
+    groot->getTreeObjects<sofa::core::collision::ContactManager>(&contactManagers);
+    if (!controllers.empty())
+        m_rollbackBlocker = controllers.front()->getPathName();
+    else if (!constraintSolvers.empty())
+        m_rollbackBlocker = constraintSolvers.front()->getPathName();
+    else if (!contactManagers.empty())
+        m_rollbackBlocker = contactManagers.front()->getPathName();
+    if (!m_rollbackBlocker.empty())
     {
-        sofa::simulation::node::reset(getScene());
-        this->update();
+        if (m_adaptiveDt)
+            msg_info("SofaPhysicsSimulation") << "Adaptive time step without rollback: '" << m_rollbackBlocker << "' keeps a state a snapshot does not restore";
+    }
+
+    // CGLinearSolver keeps its per iteration error in "graph"
+    std::vector<sofa::core::behavior::BaseLinearSolver*> linearSolvers;
+    groot->getTreeObjects<sofa::core::behavior::BaseLinearSolver>(&linearSolvers);
+    for (sofa::core::behavior::BaseLinearSolver* solver : linearSolvers)
+    {
+        sofa::core::objectmodel::BaseData* used = solver->findData("graph");
+        sofa::core::objectmodel::BaseData* limit = solver->findData("iterations");
+        if (used && limit)
+            m_convergenceProbes.push_back({ used, limit });
+    }
+
+    // GenericConstraintSolver outputs its iteration count, LCPConstraintSolver has no such output and is not probed
+    for (sofa::core::behavior::ConstraintSolver* solver : constraintSolvers)
+    {
+        sofa::core::objectmodel::BaseData* used = solver->findData("currentIterations");
+        sofa::core::objectmodel::BaseData* limit = solver->findData("maxIterations");
+        if (used && limit)
+            m_convergenceProbes.push_back({ used, limit });
     }
 }
 
-void SofaPhysicsSimulation::resetView()
+double SofaPhysicsSimulation::getSolverLoad() const
 {
-    if (getScene() && currentCamera)
+    typedef sofa::core::objectmodel::Data<std::map<std::string, sofa::type::vector<SReal> > > GraphData;
+
+    double load = 0.0;
+    for (const ConvergenceProbe& probe : m_convergenceProbes)
     {
-        currentCamera->setDefaultView(getScene()->getGravity());
-        if (!sceneFileName.empty())
+        // compare with the scene limit: a solver stopping on a cap lowered by the step budget is not a divergence,
+        // otherwise both controllers would react to the same degraded step, the budget by lowering the caps and this one by halving dt
+        int limit = std::atoi(probe.limit->getValueString().c_str());
+        for (const SolverCap& cap : m_solverCaps)
         {
-            std::string viewFileName = sceneFileName + ".view";
-            if (!currentCamera->importParametersFromFile(viewFileName))
-                currentCamera->setDefaultView(getScene()->getGravity());
+            if (cap.data == probe.limit)
+                limit = cap.sceneValue;
+        }
+        if (limit <= 0)
+            continue;
+
+        std::size_t used = 0;
+        if (const GraphData* graph = dynamic_cast<const GraphData*>(probe.used))
+        {
+            // CGLinearSolver pushes the initial residual before iterating, the history has one entry more than iterations
+            for (const auto& curve : graph->getValue())
+            {
+                if (curve.first.find("Error") != std::string::npos && !curve.second.empty())
+                    used = std::max(used, curve.second.size() - 1);
+            }
+        }
+        else
+        {
+            used = static_cast<std::size_t>(std::max(0, std::atoi(probe.used->getValueString().c_str())));
         }
+        load = std::max(load, double(used) / double(limit));
     }
+    return load;
 }
 
-void SofaPhysicsSimulation::update()
+void SofaPhysicsSimulation::animateAdaptive(sofa::simulation::Node* groot)
 {
+    if (!m_adaptiveDt)
+    {
+        sofa::simulation::node::animate(groot);
+        m_lastStepDt = getTimeStep();
+        return;
+    }
+
+    // without rollback a failed step is kept, the next one starts with half the dt
+    const bool rollback = m_rollbackBlocker.empty();
+    if (rollback)
+        saveSnapshot();
+    for (int attempt = 0; ; ++attempt)
+    {
+        const double dt = getTimeStep();
+        sofa::simulation::node::animate(groot);
+        const double load = getSolverLoad();
+
+        if (!rollback && load >= 1.0)
+        {
+            m_lastStepDt = dt;
+            groot->getContext()->setDt(std::max(m_minDt, dt * 0.5));
+            m_calmSteps = 0;
+            break;
+        }
+
+        // a solver stopped on its iteration limit: restart the step with half the dt, a few times at most
+        if (load >= 1.0 && dt > m_minDt && attempt < 3)
+        {
+            restoreSnapshot();
+            groot->getContext()->setDt(std::max(m_minDt, dt * 0.5));
+            m_calmSteps = 0;
+            ++m_nbRollbacks;
+            continue;
+        }
+
+        m_lastStepDt = dt;
+        // a step run on budget-lowered caps is not calm: growing dt would make it even more costly
+        m_calmSteps = (load <= 0.5 && m_budgetScale >= 1.0) ? m_calmSteps + 1 : 0;
+        if (m_calmSteps >= 10 && dt < m_maxDt)
+        {
+            groot->getContext()->setDt(std::min(m_maxDt, dt * 1.25));
+            m_calmSteps = 0;
+        }
+        break;
+    }
 }
 
-void SofaPhysicsSimulation::step()
+void SofaPhysicsSimulation::saveSnapshot()
 {
-    sofa::simulation::Node* groot = getScene();
-    if (!groot) return;
-    beginStep();
-    sofa::simulation::node::animate(groot);
-    sofa::simulation::node::updateVisual(groot);
-    if ( useGUI ) {
-      sofa::gui::common::BaseGUI* gui = sofa::gui::common::GUIManager::getGUI();
-      gui->stepMainLoop();
-      if (GUIFramerate)
-      {
-          sofa::helper::system::thread::ctime_t curtime = sofa::helper::system::thread::CTime::getRefTime();
-          if ((curtime-lastRedrawTime) > (double)timeTicks/GUIFramerate)
-          {
-              lastRedrawTime = curtime;
-              gui->redraw();
-          }
-      }
+    m_snapshotTime = getTime();
+    m_snapshot.resize(m_mechanicalStates.size());
+    for (std::size_t i = 0; i < m_mechanicalStates.size(); ++i)
+    {
+        // mapped states are recomputed from their parents, copying all of them is simpler and still cheap next to a step
+        StateSnapshot& snapshot = m_snapshot[i];
+        snapshot.state = m_mechanicalStates[i];
+
+        const sofa::core::objectmodel::BaseData* position = snapshot.state->baseRead(sofa::core::ConstVecCoordId::position());
+        const sofa::core::objectmodel::BaseData* velocity = snapshot.state->baseRead(sofa::core::ConstVecDerivId::velocity());
+        snapshot.position.resize(position ? position->getValueTypeInfo()->size(position->getValueVoidPtr()) : 0);
+        snapshot.velocity.resize(velocity ? velocity->getValueTypeInfo()->size(velocity->getValueVoidPtr()) : 0);
+        if (!snapshot.position.empty())
+            snapshot.state->copyToBuffer(snapshot.position.data(), sofa::core::ConstVecCoordId::position(), unsigned(snapshot.position.size()));
+        if (!snapshot.velocity.empty())
+            snapshot.state->copyToBuffer(snapshot.velocity.data(), sofa::core::ConstVecDerivId::velocity(), unsigned(snapshot.velocity.size()));
     }
-    endStep();
 }
 
-void SofaPhysicsSimulation::beginStep()
+void SofaPhysicsSimulation::restoreSnapshot()
 {
+    for (const StateSnapshot& snapshot : m_snapshot)
+    {
+        if (!snapshot.position.empty())
+            snapshot.state->copyFromBuffer(sofa::core::VecCoordId::position(), snapshot.position.data(), unsigned(snapshot.position.size()));
+        if (!snapshot.velocity.empty())
+            snapshot.state->copyFromBuffer(sofa::core::VecDerivId::velocity(), snapshot.velocity.data(), unsigned(snapshot.velocity.size()));
+    }
+    getScene()->setTime(m_snapshotTime);
 }
 
-void SofaPhysicsSimulation::endStep()
+std::size_t SofaPhysicsSimulation::getInputSignature() const
 {
-    update();
-    updateCurrentFPS();
-    updateOutputMeshes();
+    std::size_t signature = 0;
+    for (SofaDataController* controller : sofaDataControllers)
+    {
+        for (const sofa::core::objectmodel::BaseData* data : controller->getDataFields())
+            signature += static_cast<std::size_t>(data->getCounter());
+    }
+    for (const sofa::core::objectmodel::BaseData* data : m_forceInputs)
+        signature += static_cast<std::size_t>(data->getCounter());
+    return signature;
 }
 
 void SofaPhysicsSimulation::updateCurrentFPS()
@@ -712,6 +3026,7 @@ int SofaPhysicsSimulation::updateOutputMeshes()
         if (oMesh == NULL)
         {
             oMesh = new SofaPhysicsOutputMesh;
+            oMesh->m_extension = new SofaPhysicsOutputMesh::Extension;
             oMesh->impl->setObject(sMesh);
         }
         outputMeshes[i] = oMesh;
@@ -1164,3 +3479,32 @@ void SofaPhysicsSimulation::calcProjection()
 
     glMatrixMode(GL_MODELVIEW);
 }
+
+
+////////////////////////////////////////
+////////////////////////////////////////
+////////////////////////////////////////
+
+// Defined with the patched sources so SofaPhysicsBindings.cpp does not need to be replaced
+EXPORT_API int sofaVisualModel_fillVertices(void* api_ptr, const char* name, int positionOffset, int normalOffset, int texCoordOffset, const float* transform, bool flipNormals, void* buffer, int stride)
+{
+    SofaPhysicsAPI* api = static_cast<SofaPhysicsAPI*>(api_ptr);
+    if (api == nullptr)
+        return API_NULL;
+
+    SofaPhysicsOutputMesh* mesh = api->getOutputMeshPtr(name);
+    if (mesh == nullptr)
+        return API_MESH_NULL;
+
+    // fillVertices also rejects an attribute not fitting in the stride
+    if (stride <= 0 || buffer == nullptr)
+        return API_NULL;
+
+    SofaPhysicsVertexLayout layout;
+    layout.positionOffset = positionOffset;
+    layout.normalOffset = normalOffset;
+    layout.texCoordOffset = texCoordOffset;
+    layout.transform = transform;
+    layout.flipNormals = flipNormals;
+    return mesh->fillVertices(layout, buffer, static_cast<unsigned int>(stride));
+}
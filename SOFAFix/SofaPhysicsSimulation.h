@@ -0,0 +1,420 @@
+/******************************************************************************
+*                 SOFA, Simulation Open-Framework Architecture                *
+*                    (c) 2006 INRIA, USTL, UJF, CNRS, MGH                     *
+*                                                                             *
+* This program is free software; you can redistribute it and/or modify it     *
+* under the terms of the GNU General Public License as published by the Free  *
+* Software Foundation; either version 2 of the License, or (at your option)   *
+* any later version.                                                          *
+*                                                                             *
+* This program is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or       *
+* FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for    *
+* more details.                                                               *
+*                                                                             *
+* You should have received a copy of the GNU General Public License along     *
+* with this program. If not, see <http://www.gnu.org/licenses/>.              *
+*******************************************************************************
+* Authors: The SOFA Team and external contributors (see Authors.txt)          *
+*                                                                             *
+* Contact information: contact@sofa-framework.org                             *
+******************************************************************************/
+#pragma once
+
+#include "SofaPhysicsAPI.h"
+#include "SofaPhysicsOutputMesh_impl.h"
+#include "SofaPhysicsDataMonitor_impl.h"
+#include "SofaPhysicsDataController_impl.h"
+#include "SofaPhysicsTriangleBVH.h"
+#include "SofaPhysicsVertexNormals.h"
+
+#include <sofa/simulation/Simulation.h>
+#include <sofa/simulation/Node.h>
+#include <sofa/helper/system/thread/CTime.h>
+#include <sofa/helper/logging/LoggingMessageHandler.h>
+#include <sofa/core/visual/VisualParams.h>
+#include <sofa/core/behavior/BaseConstraint.h>
+#include <sofa/core/behavior/BaseMechanicalState.h>
+#include <sofa/core/collision/NarrowPhaseDetection.h>
+#include <sofa/component/visual/BaseCamera.h>
+#include <sofa/gl/Texture.h>
+#include <sofa/gl/gl.h>
+
+#include <array>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// Lock-free hand over of the latest value from one writer thread to one reader thread: the writer fills back() then calls publish(),
+/// the reader calls acquire() then reads front(). Neither side waits, a value published twice before a read is overwritten.
+template <class T>
+class SofaPhysicsTripleBuffer
+{
+public:
+    T& back() { return m_buffers[m_back]; }
+    void publish() { m_back = m_middle.exchange(m_back | Fresh, std::memory_order_acq_rel) & IndexMask; }
+
+    /// Take the last published value as front(), return false if nothing was published since the previous call
+    bool acquire()
+    {
+        if ((m_middle.load(std::memory_order_relaxed) & Fresh) == 0)
+            return false;
+        m_front = m_middle.exchange(m_front, std::memory_order_acq_rel) & IndexMask;
+        return true;
+    }
+    const T& front() const { return m_buffers[m_front]; }
+
+private:
+    static constexpr int IndexMask = 3;
+    static constexpr int Fresh = 4;
+
+    T m_buffers[3] = {};
+    int m_back = 0;
+    std::atomic<int> m_middle{ 1 };
+    int m_front = 2;
+};
+
+/// Internal implementation of SofaPhysicsAPI, patched version of the SOFA file (see SOFAFix/SofaPhysicsSimulation.cpp)
+class SOFA_SOFAPHYSICSAPI_API SofaPhysicsSimulation
+{
+public:
+    SofaPhysicsSimulation(bool useGUI_ = false, int GUIFramerate_ = 0, const SofaPhysicsTaskSchedulerConfig* schedulerConfig = nullptr);
+    virtual ~SofaPhysicsSimulation();
+
+    virtual const char* APIName();
+
+    int load(const char* filename);
+    int unload();
+    int loadPlugin(const char* pluginPath);
+    virtual void createScene();
+
+    void start();
+    void stop();
+    void step();
+    void reset();
+    void resetView();
+    void sendValue(const char* name, double value);
+    void drawGL();
+
+    unsigned int getNbOutputMeshes() const;
+    SofaPhysicsOutputMesh* getOutputMeshPtr(unsigned int meshID) const;
+    SofaPhysicsOutputMesh* getOutputMeshPtr(const char* name) const;
+    SofaPhysicsOutputMesh** getOutputMesh(unsigned int meshID);
+    SofaPhysicsOutputMesh** getOutputMeshes();
+
+    bool isAnimated() const;
+    void setAnimated(bool val);
+
+    double getTimeStep() const;
+    void   setTimeStep(double dt);
+    double getTime() const;
+    double getCurrentFPS() const;
+
+    double* getGravity() const;
+    int getGravity(double* values) const;
+    void setGravity(double* gravity);
+
+    /// message API
+    int activateMessageHandler(bool value);
+    int getNbMessages();
+    std::string getMessage(int messageId, int& msgType);
+    int clearMessages();
+
+    unsigned int getNbDataMonitors();
+    SofaPhysicsDataMonitor** getDataMonitors();
+
+    unsigned int getNbDataControllers();
+    SofaPhysicsDataController** getDataControllers();
+
+    /// DOF renumbering applied by the next load(), one of API_RENUMBER_*
+    int setDofRenumbering(int method);
+
+    /// Substitute the sweep and prune broad phase to BruteForceBroadPhase at the next load()
+    int setBroadPhaseUpgrade(bool enable) { m_upgradeBroadPhase = enable; return API_SUCCESS; }
+
+    /// Record a command applied by the next beginStep, never blocks. Single producer
+    int queueTimeStep(double dt);
+    int queueGravity(const double* gravity);
+    int queueValue(const char* name, double value);
+    int queueDataControllerValue(unsigned int controllerId, const char* value);
+    unsigned int getNbQueuedCommands() const { return m_commandHead.load(std::memory_order_acquire) - m_commandTail.load(std::memory_order_acquire); }
+    /// Consumer side: apply the commands queued before the call, in order. Called by beginStep, or directly when no step runs
+    void applyQueuedCommands();
+
+    /// Sleep after @param quietSteps steps with all velocities under @param maxVelocity, 0 disables
+    int setSleepThreshold(double maxVelocity, int quietSteps);
+    bool isSleeping() const { return m_sleeping; }
+    void wakeUp();
+
+    /// Adapt the solver iteration caps so a step stays within @param budgetMs milliseconds, 0 restores the scene values
+    int setStepBudget(double budgetMs, int minSolverIterations, int minConstraintIterations);
+    double getStepQuality() const { return m_budgetScale; }
+    unsigned int getNbDegradedSteps() const { return m_degradedSteps; }
+    double getLastStepDuration() const { return m_lastStepDuration; }
+
+    /// Let the wrapper choose dt in [@param minDt, @param maxDt] from the solvers convergence, with rollback of failed steps
+    int setAdaptiveTimeStep(bool enabled, double minDt, double maxDt);
+    double getLastStepDt() const { return m_lastStepDt; }
+    unsigned int getNbRollbacks() const { return m_nbRollbacks; }
+
+    /// Contact export filled by endStep, @param modelNames comma separated, empty for every collision model
+    int setContactExport(bool enabled, const char* modelNames);
+    int getContacts(SofaPhysicsContacts* contacts) const;
+    unsigned int getNbCollisionModels() const { return static_cast<unsigned int>(m_collisionModels.size()); }
+    const char* getCollisionModelName(unsigned int modelId) const;
+
+    /// Penalty force of a spherical tool against a copy of an output mesh refreshed by each step, computed at @param rateHz on a thread of its own
+    int startHapticLoop(const char* meshName, double rateHz, double stiffness, double toolRadius);
+    int stopHapticLoop();
+    bool isHapticLoopRunning() const { return m_hapticThread.joinable(); }
+    int setHapticToolPosition(const double* position);
+    int getHapticForce(double* force);
+    int getHapticStats(SofaPhysicsHapticStats* stats);
+
+    typedef SofaPhysicsOutputMesh::Impl::SofaOutputMesh SofaOutputMesh;
+    typedef SofaPhysicsDataMonitor::Impl::SofaDataMonitor SofaDataMonitor;
+    typedef SofaPhysicsDataController::Impl::SofaDataController SofaDataController;
+
+    const char* getSceneFileName() const { return sceneFileName.c_str(); }
+
+    sofa::simulation::Node* getScene() const { return m_RootNode.get(); }
+
+protected:
+    void createScene_impl();
+    void update();
+    void beginStep();
+    void endStep();
+    void updateCurrentFPS();
+    int updateOutputMeshes();
+    void calcProjection();
+
+    /// Set up the process wide SOFA task scheduler: native workers with affinity/priority, or the external dispatch adapter
+    void configureTaskScheduler(const SofaPhysicsTaskSchedulerConfig& config);
+
+    /// Renumber the vertices of the volumetric mesh loaders of the loaded, not yet initialized, graph
+    void renumberDofs();
+
+    /// Replace the BruteForceBroadPhase components of the parsed graph, before initRoot. Return the number replaced
+    int upgradeBroadPhase();
+
+    /// Command recorded by the queue* methods, fixed size so recording does not allocate
+    struct QueuedCommand
+    {
+        enum Type { TimeStep, Gravity, Value, DataControllerValue };
+        static constexpr std::size_t TextSize = 128;
+
+        Type type;
+        unsigned int index;
+        double values[3];
+        char text[TextSize];
+    };
+    /// Producer side of the queue: copy @param command in the next free slot, API_COMMAND_QUEUE_FULL if there is none
+    int pushCommand(const QueuedCommand& command);
+
+    /// Find the collision models, narrow phases and constraint force outputs of the loaded scene and apply the model filter
+    void collectContactSources();
+    /// Copy the detection outputs of this step, with the force of their contact constraint, into the export arrays. Called by endStep
+    void exportContacts();
+
+    /// Vertices, normals and triangles of the haptic mesh at the end of a step, with a BVH refit to these positions.
+    /// Each of the 3 buffers keeps its own tree and normal adjacency, rebuilt only when the topology changes
+    struct HapticSurface
+    {
+        std::vector<float> positions;
+        std::vector<float> normals;             ///< computed from positions, SOFA may not update the mesh normals (setComputeNormals)
+        std::vector<int> indices;               ///< 3 per triangle, the quads split in 2
+        SofaPhysicsTriangleBVH<double> tree;
+        SofaPhysicsVertexNormals<double> vertexNormals;
+        int trianglesRevision = -1;
+        int quadsRevision = -1;
+        double stepTime = 0.0;                  ///< steady clock time of the copy, in seconds
+    };
+    /// Copy the haptic mesh of this step into the back surface and publish it. Called by endStep and startHapticLoop, serialized by m_hapticSurfaceMutex
+    void updateHapticSurface();
+    /// Body of the haptic thread: one force per period until m_hapticRunning is cleared
+    void hapticLoop();
+    /// Penalty force of the tool sphere centered at @param center against the closest point of @param surface, written in @param force
+    void computeHapticForce(const HapticSurface& surface, const double* center, double* force) const;
+
+    /// Count the quiet steps at the end of a step and fall asleep after m_sleepQuietSteps
+    void updateSleepState();
+    /// Find the force inputs polled while asleep, and the first component depending on the simulation time, which keeps the scene awake
+    void collectSleepInputs();
+    /// Sum of the Data counters of the data controllers and of the force inputs, changes on every write to one of them
+    std::size_t getInputSignature() const;
+
+    /// Find the iteration Data of the linear and constraint solvers of the loaded scene, keeping the scene values as upper bounds
+    void collectSolverCaps();
+    /// Update the step time average with @param stepDuration (ms) and rescale the solver caps if over or well under the budget
+    void updateStepBudget(double stepDuration);
+    /// Write the scene caps scaled by m_budgetScale, clamped to their minimum
+    void applySolverCaps();
+
+    /// Find the Data telling how many iterations the linear and constraint solvers used, next to their limit, and the rollback blocker
+    void collectConvergenceProbes();
+    /// Highest ratio between used iterations and the scene limit over the solvers in the last step, 1 or more means a solver did not converge
+    double getSolverLoad() const;
+    /// Animate one step, in adaptive mode retry from a snapshot with a smaller dt while the solvers do not converge
+    void animateAdaptive(sofa::simulation::Node* groot);
+    void saveSnapshot();
+    void restoreSnapshot();
+
+    sofa::simulation::NodeSPtr m_RootNode;
+    std::string sceneFileName;
+
+    /// Pointer to the LoggingMessageHandler
+    sofa::helper::logging::LoggingMessageHandler* m_msgHandler;
+    /// Status of the LoggingMessageHandler
+    bool m_msgIsActivated;
+
+    bool useGUI;
+    int GUIFramerate;
+
+    sofa::component::visual::BaseCamera::SPtr currentCamera;
+
+    std::map<SofaOutputMesh*, SofaPhysicsOutputMesh*> outputMeshMap;
+
+    sofa::type::vector<SofaOutputMesh*> sofaOutputMeshes;
+    sofa::type::vector<SofaPhysicsOutputMesh*> outputMeshes;
+
+    sofa::type::vector<SofaDataMonitor*> sofaDataMonitors;
+    sofa::type::vector<SofaPhysicsDataMonitor*> dataMonitors;
+
+    sofa::type::vector<SofaDataController*> sofaDataControllers;
+    sofa::type::vector<SofaPhysicsDataController*> dataControllers;
+
+    sofa::gl::Texture* texLogo;
+    double lastProjectionMatrix[16];
+    double lastModelviewMatrix[16];
+    bool initGLDone;
+    bool initTexturesDone;
+    int lastW, lastH;
+    sofa::core::visual::VisualParams* vparams;
+
+    sofa::helper::system::thread::ctime_t stepTime[10];
+    sofa::helper::system::thread::ctime_t timeTicks;
+    sofa::helper::system::thread::ctime_t lastRedrawTime;
+    int frameCounter;
+    double currentFPS;
+
+    /// One of API_RENUMBER_*, applied between the scene parsing and its initialization
+    int m_dofRenumbering = 0;
+
+    /// If true, BruteForceBroadPhase is swapped for SofaPhysicsSweepAndPruneBroadPhase between the parsing and the initialization
+    bool m_upgradeBroadPhase = false;
+
+    /// Sleep detection: max velocity (any component of any mechanical state) under which a step is quiet, 0 disables
+    double m_sleepVelocity = 0.0;
+    int m_sleepQuietSteps = 30;
+    int m_quietSteps = 0;
+    bool m_sleeping = false;
+    std::size_t m_inputSignature = 0;
+    /// External forces of the states and Data of the force fields, gathered once after initRoot
+    std::vector<sofa::core::objectmodel::BaseData*> m_forceInputs;
+    /// Path of a controller or key time component of the loaded scene, empty if none. Such a scene never sleeps
+    std::string m_timeDrivenComponent;
+    /// Mechanical states of the loaded scene, gathered once after initRoot
+    sofa::type::vector<sofa::core::behavior::BaseMechanicalState*> m_mechanicalStates;
+
+    /// Iteration limit of one solver: the Data, its value in the scene and the lowest value the budget may set
+    struct SolverCap
+    {
+        sofa::core::objectmodel::BaseData* data;
+        int sceneValue;
+        int minValue;
+    };
+
+    /// Step budget: 0 disables. The caps are the scene values times m_budgetScale
+    double m_stepBudget = 0.0;
+    int m_minSolverIterations = 5;
+    int m_minConstraintIterations = 50;
+    double m_budgetScale = 1.0;
+    double m_stepTimeAverage = 0.0;
+    double m_lastStepDuration = 0.0;
+    unsigned int m_degradedSteps = 0;
+    std::vector<SolverCap> m_solverCaps;
+
+    /// Iteration count of a solver after a step (CG "graph" Error history or "currentIterations") and its limit
+    struct ConvergenceProbe
+    {
+        sofa::core::objectmodel::BaseData* used;
+        sofa::core::objectmodel::BaseData* limit;
+    };
+
+    /// Positions and velocities of one mechanical state, restored when a step is rolled back
+    struct StateSnapshot
+    {
+        sofa::core::behavior::BaseMechanicalState* state;
+        std::vector<SReal> position;
+        std::vector<SReal> velocity;
+    };
+
+    /// Adaptive time step: dt grows after calm steps and is halved on a failed step, within [m_minDt, m_maxDt]
+    bool m_adaptiveDt = false;
+    double m_minDt = 0.001;
+    double m_maxDt = 0.04;
+    double m_lastStepDt = 0.0;
+    int m_calmSteps = 0;
+    unsigned int m_nbRollbacks = 0;
+    std::vector<ConvergenceProbe> m_convergenceProbes;
+    std::vector<StateSnapshot> m_snapshot;
+    double m_snapshotTime = 0.0;
+    /// Path of a controller, constraint solver or contact manager of the loaded scene, empty if none. Such a scene is never rolled back
+    std::string m_rollbackBlocker;
+
+    /// Single producer / single consumer ring of deferred commands, head written by the producer and tail by step()
+    static constexpr unsigned int CommandQueueSize = 256;
+    std::array<QueuedCommand, CommandQueueSize> m_commands;
+    alignas(64) std::atomic<unsigned int> m_commandHead{ 0 };
+    alignas(64) std::atomic<unsigned int> m_commandTail{ 0 };
+
+    /// Normal force of one contact constraint of the step, matched to its detection output by persistent id, then by position
+    struct ContactForce
+    {
+        long long id;
+        SReal position[3];
+        SReal force;
+    };
+
+    /// Contact export: sources gathered at load, SoA arrays and scratch vectors cleared, not freed, at each step
+    bool m_contactExport = false;
+    std::vector<std::string> m_contactModelFilter;
+    std::vector<sofa::core::CollisionModel*> m_collisionModels;
+    std::vector<char> m_contactModelSelected;
+    std::vector<sofa::core::collision::NarrowPhaseDetection*> m_narrowPhases;
+    sofa::core::objectmodel::BaseData* m_constraintForceData = nullptr;
+    /// computeConstraintForces forced on for the export and the value the scene gave it
+    sofa::core::objectmodel::BaseData* m_constraintForceSwitch = nullptr;
+    std::string m_constraintForceSwitchValue;
+    unsigned long long m_contactRevision = 0;
+    std::vector<Real> m_contactPoints;
+    std::vector<Real> m_contactNormals;
+    std::vector<Real> m_contactDepths;
+    std::vector<Real> m_contactForces;
+    std::vector<int> m_contactModels;
+    std::vector<sofa::core::behavior::BaseConstraint*> m_stepConstraints;
+    sofa::core::behavior::BaseConstraint::VecConstraintBlockInfo m_constraintBlocks;
+    sofa::core::behavior::BaseConstraint::VecPersistentID m_constraintIds;
+    sofa::core::behavior::BaseConstraint::VecConstCoord m_constraintPositions;
+    sofa::core::behavior::BaseConstraint::VecConstDeriv m_constraintDirections;
+    sofa::core::behavior::BaseConstraint::VecConstArea m_constraintAreas;
+    std::vector<ContactForce> m_constraintForces;
+
+    /// Haptic loop: the surface goes from endStep to the haptic thread, the pose from the application to it and the force and stats back
+    struct HapticVec3 { double v[3]; };
+    std::string m_hapticMeshName;
+    double m_hapticPeriod = 0.001;
+    double m_hapticStiffness = 0.0;
+    double m_hapticToolRadius = 0.0;
+    std::thread m_hapticThread;
+    std::atomic<bool> m_hapticRunning{ false };
+    /// The surface triple buffer has a single producer side: endStep and startHapticLoop take turns on it, and on the haptic settings above
+    std::mutex m_hapticSurfaceMutex;
+    SofaPhysicsTripleBuffer<HapticSurface> m_hapticSurface;
+    SofaPhysicsTripleBuffer<HapticVec3> m_hapticPose;
+    SofaPhysicsTripleBuffer<HapticVec3> m_hapticForce;
+    SofaPhysicsTripleBuffer<SofaPhysicsHapticStats> m_hapticStats;
+};
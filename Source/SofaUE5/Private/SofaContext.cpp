@@ -26,8 +26,9 @@
 #include "Engine.h"
 #include "CoreMinimal.h"
 #include "SofaVisualMesh.h"
+#include "SofaRemoteSimulation.h"
 #include "Interfaces/IPluginManager.h"
-#include "Kismet/GameplayStatics.h"
+#include "EngineUtils.h"
 #include <vector>
 #include <string>
 
@@ -36,6 +37,29 @@
 #include "Windows/HideWindowsPlatformTypes.h"
 
 #include "SofaUE5Library/SofaPhysicsAPI.h"
+#include "Async/ParallelFor.h"
+#include "Async/TaskGraphInterfaces.h"
+#include "Tasks/Task.h"
+
+DECLARE_CYCLE_STAT(TEXT("Context Step"), STAT_SofaContextStep, STATGROUP_SofaUE5);
+DECLARE_CYCLE_STAT(TEXT("Context Update Visual Meshes"), STAT_SofaContextUpdateMeshes, STATGROUP_SofaUE5);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("Context Step Quality"), STAT_SofaContextStepQuality, STATGROUP_SofaUE5);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Context Degraded Steps"), STAT_SofaContextDegradedSteps, STATGROUP_SofaUE5);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("Context Step Dt"), STAT_SofaContextStepDt, STATGROUP_SofaUE5);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Context Rollbacks"), STAT_SofaContextRollbacks, STATGROUP_SofaUE5);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("Context Remote Step Latency (ms)"), STAT_SofaContextRemoteLatency, STATGROUP_SofaUE5);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("Context Remote Step Time (ms)"), STAT_SofaContextRemoteStepTime, STATGROUP_SofaUE5);
+DECLARE_FLOAT_COUNTER_STAT(TEXT("Context Haptic Max Jitter (ms)"), STAT_SofaContextHapticJitter, STATGROUP_SofaUE5);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Context Haptic Missed Deadlines"), STAT_SofaContextHapticMissed, STATGROUP_SofaUE5);
+
+namespace
+{
+    /** SofaPhysicsTaskSchedulerConfig::dispatch running each SOFA task on a UE task graph worker */
+    void dispatchSofaTask(void* /*userData*/, void (*run)(void* task), void* task)
+    {
+        UE::Tasks::Launch(UE_SOURCE_LOCATION, [run, task]() { run(task); });
+    }
+}
 
  // Sets default values
 ASofaContext::ASofaContext()
@@ -80,7 +104,7 @@ void ASofaContext::BeginPlay()
         UE_LOG(LogTemp, Warning, TEXT("[SOFA] Starting SOFA simulation..."));
         m_sofaAPI->start();
     }
-    else
+    else if (m_remote == nullptr)
     {
         UE_LOG(LogTemp, Error, TEXT("[SOFA] m_sofaAPI is null in BeginPlay"));
     }
@@ -92,7 +116,16 @@ void ASofaContext::BeginPlay()
 void ASofaContext::setDT(float value)
 {
     if (m_sofaAPI)
-        m_sofaAPI->setTimeStep(value);
+    {
+        // Applied by SOFA at the beginning of its next step, never in the middle of one
+        if (m_sofaAPI->queueTimeStep(value) != API_SUCCESS)
+            UE_LOG(SUnreal_log, Warning, TEXT("## ASofaContext::setDT: command queue full, %f dropped"), value);
+        applyCommandsIfNotStepping();
+    }
+    else if (m_remote)
+    {
+        m_remote->setTimeStep(value);
+    }
 }
 
 void ASofaContext::setGravity(FVector value)
@@ -100,12 +133,126 @@ void ASofaContext::setGravity(FVector value)
     if (m_sofaAPI)
     {
         UE_LOG(SUnreal_log, Warning, TEXT("## ASofaContext::setGravity: %f, %f, %f"), value.X, value.Y, value.Z);
-        double* grav = new double[3];
-        grav[0] = value.X;
-        grav[1] = value.Y;
-        grav[2] = value.Z;
-        m_sofaAPI->setGravity(grav);
+        const double grav[3] = { value.X, value.Y, value.Z };
+        if (m_sofaAPI->queueGravity(grav) != API_SUCCESS)
+            UE_LOG(SUnreal_log, Warning, TEXT("## ASofaContext::setGravity: command queue full, gravity change dropped"));
+        applyCommandsIfNotStepping();
     }
+    else if (m_remote)
+    {
+        m_remote->setGravity(value);
+    }
+}
+
+bool ASofaContext::isStepping() const
+{
+    const UWorld* world = GetWorld();
+    return m_sofaAPI && m_status != -1 && HasActorBegunPlay() && IsActorTickEnabled() && world && !world->IsPaused();
+}
+
+void ASofaContext::applyCommandsIfNotStepping()
+{
+    // No step will consume the queue (editor, paused game, tick disabled): apply now, Tick is not running meanwhile
+    if (m_sofaAPI && !isStepping())
+        m_sofaAPI->applyQueuedCommands();
+}
+
+void ASofaContext::wakeSimulation()
+{
+    if (m_sofaAPI)
+        m_sofaAPI->wakeUp();
+    else if (m_remote)
+        m_remote->wakeUp();
+}
+
+bool ASofaContext::isSimulationSleeping() const
+{
+    return m_sofaAPI && m_sofaAPI->isSleeping();
+}
+
+float ASofaContext::getStepQuality() const
+{
+    return m_sofaAPI ? static_cast<float>(m_sofaAPI->getStepQuality()) : 1.0f;
+}
+
+float ASofaContext::getLastStepDt() const
+{
+    return m_sofaAPI ? static_cast<float>(m_sofaAPI->getLastStepDt()) : Dt;
+}
+
+bool ASofaContext::startHapticLoop()
+{
+    if (m_sofaAPI == nullptr)
+    {
+        UE_LOG(SUnreal_log, Warning, TEXT("## ASofaContext::startHapticLoop: no in-process simulation"));
+        return false;
+    }
+
+    // The device thread may call in before the next Tick
+    m_hapticTransform.GetWriteBuffer() = GetActorTransform();
+    m_hapticTransform.SwapWriteBuffers();
+
+    const int res = m_sofaAPI->startHapticLoop(TCHAR_TO_ANSI(*m_hapticMeshName), m_hapticRateHz, m_hapticStiffness, m_hapticToolRadius);
+    if (res != API_SUCCESS)
+        UE_LOG(SUnreal_log, Warning, TEXT("## ASofaContext::startHapticLoop: failed on mesh %s, error %d"), *m_hapticMeshName, res);
+    return res == API_SUCCESS;
+}
+
+void ASofaContext::stopHapticLoop()
+{
+    if (m_sofaAPI)
+        m_sofaAPI->stopHapticLoop();
+}
+
+void ASofaContext::setHapticToolLocation(FVector worldLocation)
+{
+    if (m_sofaAPI == nullptr)
+        return;
+
+    // SOFA positions live in the context local space, see the actor scale set in the constructor
+    setHapticToolLocalPosition(GetActorTransform().InverseTransformPosition(worldLocation));
+}
+
+FVector ASofaContext::getHapticForce()
+{
+    double force[3] = { 0.0, 0.0, 0.0 };
+    if (m_sofaAPI == nullptr || m_sofaAPI->getHapticForce(force) != API_SUCCESS)
+        return FVector::ZeroVector;
+
+    // only the direction follows the actor transform, the magnitude stays in SOFA units
+    const FVector local(force[0], force[1], force[2]);
+    return GetActorTransform().TransformVector(local).GetSafeNormal() * local.Size();
+}
+
+void ASofaContext::setHapticToolLocalPosition(const FVector& localPosition)
+{
+    if (m_sofaAPI == nullptr)
+        return;
+
+    // No UObject access: only the SOFA pose triple buffer is written
+    const double position[3] = { localPosition.X, localPosition.Y, localPosition.Z };
+    m_sofaAPI->setHapticToolPosition(position);
+}
+
+void ASofaContext::setHapticToolLocationFromDevice(const FVector& worldLocation)
+{
+    if (m_hapticTransform.IsDirty())
+        m_hapticTransform.SwapReadBuffers();
+
+    setHapticToolLocalPosition(m_hapticTransform.Read().InverseTransformPosition(worldLocation));
+}
+
+FVector ASofaContext::getHapticForceFromDevice()
+{
+    double force[3] = { 0.0, 0.0, 0.0 };
+    if (m_sofaAPI == nullptr || m_sofaAPI->getHapticForce(force) != API_SUCCESS)
+        return FVector::ZeroVector;
+
+    if (m_hapticTransform.IsDirty())
+        m_hapticTransform.SwapReadBuffers();
+
+    const FVector local(force[0], force[1], force[2]);
+    return m_hapticTransform.Read().TransformVector(local).GetSafeNormal() * local.Size();
 }
 
 void ASofaContext::BeginDestroy()
@@ -118,11 +265,19 @@ void ASofaContext::BeginDestroy()
         if (m_log)
             UE_LOG(SUnreal_log, Warning, TEXT("######### ASofaContext::BeginDestroy(): Delete SofaAdvancePhysicsAPI: %s"), *this->GetName());
 
+        clearVisualMeshBindings();
         m_sofaAPI->stop();
         delete m_sofaAPI;
         m_sofaAPI = NULL;
     }
 
+    if (m_remote)
+    {
+        clearVisualMeshBindings();
+        delete m_remote;
+        m_remote = nullptr;
+    }
+
     Super::BeginDestroy();
 }
 
@@ -153,6 +308,21 @@ void ASofaContext::PostEditChangeProperty(FPropertyChangedEvent& PropertyChanged
             UE_LOG(LogTemp, Warning, TEXT("Gravity is %s"), *Gravity.ToString());
             setGravity(Gravity);
         }
+        else if (MemberName.Compare(TEXT("m_sleepVelocityThreshold")) == 0 || MemberName.Compare(TEXT("m_sleepQuietSteps")) == 0)
+        {
+            if (m_sofaAPI)
+                m_sofaAPI->setSleepThreshold(m_sleepVelocityThreshold, m_sleepQuietSteps);
+        }
+        else if (MemberName.Compare(TEXT("m_stepBudgetMs")) == 0 || MemberName.Compare(TEXT("m_minSolverIterations")) == 0 || MemberName.Compare(TEXT("m_minConstraintIterations")) == 0)
+        {
+            if (m_sofaAPI)
+                m_sofaAPI->setStepBudget(m_stepBudgetMs, m_minSolverIterations, m_minConstraintIterations);
+        }
+        else if (MemberName.Compare(TEXT("m_adaptiveDt")) == 0 || MemberName.Compare(TEXT("m_minDt")) == 0 || MemberName.Compare(TEXT("m_maxDt")) == 0)
+        {
+            if (m_sofaAPI)
+                m_sofaAPI->setAdaptiveTimeStep(m_adaptiveDt, m_minDt, m_maxDt);
+        }
         else if (MemberName.Compare(TEXT("Dt")) == 0)
         {
             UE_LOG(LogTemp, Warning, TEXT("Dt is %f"), Dt);
@@ -178,9 +348,59 @@ void ASofaContext::PostEditChangeProperty(FPropertyChangedEvent& PropertyChanged
 // Called every frame
 void ASofaContext::Tick(float DeltaTime)
 {
-    if (m_status != -1 && m_sofaAPI)
+    if (m_hostRestartPending || (m_status > 0 && m_remote && !m_remote->isAlive()))
+    {
+        // A crash or hang of SOFA only stops the host: report it and reload the scene in a new one, with backoff
+        tickHostWatchdog();
+    }
+    else if (m_status > 0 && m_remote)
+    {
+        {
+            SCOPE_CYCLE_COUNTER(STAT_SofaContextStep);
+            m_remote->step();
+        }
+
+        // Frames come back asynchronously, meshes show the newest finished step
+        updateVisualMeshes();
+
+        SET_FLOAT_STAT(STAT_SofaContextRemoteLatency, m_remote->getLastLatencyMs());
+        SET_FLOAT_STAT(STAT_SofaContextRemoteStepTime, m_remote->getLastStepDurationMs());
+    }
+    else if (m_status != -1 && m_sofaAPI)
     {
-        m_sofaAPI->step();
+        {
+            SCOPE_CYCLE_COUNTER(STAT_SofaContextStep);
+            m_stepSequence.fetch_add(1, std::memory_order_acq_rel);
+            m_sofaAPI->step();
+            m_stepSequence.fetch_add(1, std::memory_order_acq_rel);
+        }
+
+        if (m_stepBudgetMs > 0.0f)
+        {
+            SET_FLOAT_STAT(STAT_SofaContextStepQuality, m_sofaAPI->getStepQuality());
+            SET_DWORD_STAT(STAT_SofaContextDegradedSteps, m_sofaAPI->getNbDegradedSteps());
+        }
+
+        if (m_adaptiveDt)
+        {
+            SET_FLOAT_STAT(STAT_SofaContextStepDt, m_sofaAPI->getLastStepDt());
+            SET_DWORD_STAT(STAT_SofaContextRollbacks, m_sofaAPI->getNbRollbacks());
+        }
+
+        if (m_sofaAPI->isHapticLoopRunning())
+        {
+            // The device thread converts world poses with this copy, GetActorTransform is game thread only
+            m_hapticTransform.GetWriteBuffer() = GetActorTransform();
+            m_hapticTransform.SwapWriteBuffers();
+
+            SofaPhysicsHapticStats hapticStats;
+            m_sofaAPI->getHapticStats(&hapticStats);
+            SET_FLOAT_STAT(STAT_SofaContextHapticJitter, hapticStats.maxJitterMs);
+            SET_DWORD_STAT(STAT_SofaContextHapticMissed, hapticStats.nbMissedDeadlines);
+        }
+
+        // Meshes read the state of this step, in the same frame and in a fixed order
+        updateVisualMeshes();
 
         if (m_isMsgHandlerActivated == true)
             catchSofaMessages();
@@ -197,21 +417,51 @@ void ASofaContext::createSofaContext()
     FString curPath = FPaths::ConvertRelativePathToFull(FPaths::ProjectDir());
     UE_LOG(LogTemp, Warning, TEXT("[SOFA] ProjectDir = %s"), *curPath);
 
+    // A new scene load gets a fresh restart budget
+    m_hostRestarts = 0;
+    m_hostRestartPending = false;
+
     // Step 1. If we already have a SOFA API, destroy it completely and start fresh
     if (m_sofaAPI != nullptr)
     {
         UE_LOG(LogTemp, Warning, TEXT("[SOFA] Destroying previous SofaPhysicsAPI and creating fresh one..."));
+        clearVisualMeshBindings();
         m_sofaAPI->stop();
         delete m_sofaAPI;
         m_sofaAPI = nullptr;
         m_status = -1;
     }
+    if (m_remote != nullptr)
+    {
+        UE_LOG(LogTemp, Warning, TEXT("[SOFA] Stopping previous simulation host..."));
+        clearVisualMeshBindings();
+        delete m_remote;
+        m_remote = nullptr;
+        m_status = -1;
+    }
+
+    // Out-of-process mode: nothing of SOFA is loaded in this process
+    if (m_outOfProcess)
+    {
+        createRemoteContext();
+        return;
+    }
 
     // Step 2. Create API
     if (m_sofaAPI == nullptr)
     {
         UE_LOG(LogTemp, Warning, TEXT("[SOFA] m_sofaAPI is null, creating new SofaPhysicsAPI..."));
-        m_sofaAPI = new SofaPhysicsAPI(false);
+        SofaPhysicsTaskSchedulerConfig schedulerConfig = {};
+        schedulerConfig.nbThreads = m_sofaWorkerThreads;
+        schedulerConfig.affinityMask = static_cast<unsigned long long>(m_sofaThreadAffinity);
+        schedulerConfig.priority = static_cast<int>(m_sofaThreadPriority) - 1;
+        if (m_useUETaskGraph)
+        {
+            schedulerConfig.dispatch = &dispatchSofaTask;
+            schedulerConfig.externalThreadCount = FTaskGraphInterface::Get().GetNumWorkerThreads() + 1;
+        }
+
+        m_sofaAPI = new SofaPhysicsAPI(false, 0, &schedulerConfig);
 
         if (m_sofaAPI == nullptr)
         {
@@ -269,6 +519,9 @@ void ASofaContext::createSofaContext()
     SetCurrentDirectory(*SceneDir);
     UE_LOG(LogTemp, Warning, TEXT("[SOFA] Changed working directory to: %s"), *SceneDir);
 
+    m_sofaAPI->setDofRenumbering(static_cast<int>(m_dofRenumbering));
+    m_sofaAPI->setBroadPhaseUpgrade(m_upgradeBroadPhase);
+
     UE_LOG(LogTemp, Warning, TEXT("[SOFA] About to call m_sofaAPI->load() with path: %s"), *my_filePath);
     const char* pathfile = TCHAR_TO_ANSI(*my_filePath);
     int resScene = m_sofaAPI->load(pathfile);
@@ -288,6 +541,10 @@ void ASofaContext::createSofaContext()
     // Mark scene as successfully loaded
     m_status = resScene;
 
+    m_sofaAPI->setSleepThreshold(m_sleepVelocityThreshold, m_sleepQuietSteps);
+    m_sofaAPI->setStepBudget(m_stepBudgetMs, m_minSolverIterations, m_minConstraintIterations);
+    m_sofaAPI->setAdaptiveTimeStep(m_adaptiveDt, m_minDt, m_maxDt);
+
     // Step 4. Check number of meshes
     unsigned int nbr = m_sofaAPI->getNbOutputMeshes();
     UE_LOG(LogTemp, Warning, TEXT("[SOFA] NbOutputMeshes = %d"), nbr);
@@ -314,6 +571,8 @@ void ASofaContext::createSofaContext()
 
     UE_LOG(LogTemp, Warning, TEXT("[SOFA] Finished createSofaContext() with status = %d"), m_status);
 
+    onSceneLoadCompleted();
+
     // Auto-spawn visual mesh actors if no existing ones are set up for this context
     if (m_status > 0 && !HasExistingVisualMeshes())
     {
@@ -326,23 +585,109 @@ void ASofaContext::createSofaContext()
     }
 }
 
-void ASofaContext::loadDefaultPlugin()
+FString ASofaContext::getSofaBinariesDir() const
 {
-    if (m_sofaAPI == nullptr)
-        return;
-
     // Get the plugin base directory dynamically using the plugin manager
     TSharedPtr<IPlugin> Plugin = IPluginManager::Get().FindPlugin("SofaUE5");
     if (!Plugin.IsValid())
     {
         UE_LOG(LogTemp, Error, TEXT("[SOFA] Failed to find SofaUE5 plugin!"));
-        return;
+        return FString();
     }
-    
+
     FString BaseDir = Plugin->GetBaseDir();
-    const FString PluginDir = FPaths::ConvertRelativePathToFull(
+    return FPaths::ConvertRelativePathToFull(
         FPaths::Combine(*BaseDir, TEXT("Binaries/ThirdParty/SofaUE5Library/Win64"))
     );
+}
+
+void ASofaContext::createRemoteContext()
+{
+    if (filePath.FilePath.IsEmpty())
+    {
+        UE_LOG(LogTemp, Error, TEXT("[SOFA] No filePath set for the scene."));
+        return;
+    }
+
+    const FString scenePath = FPaths::ConvertRelativePathToFull(filePath.FilePath);
+    if (!FPaths::FileExists(scenePath))
+    {
+        UE_LOG(LogTemp, Error, TEXT("[SOFA] Scene file does not exist: %s"), *scenePath);
+        return;
+    }
+
+    const FString binariesDir = getSofaBinariesDir();
+    const FString hostPath = m_hostPath.FilePath.IsEmpty() ? FPaths::Combine(*binariesDir, TEXT("SofaPhysicsHost.exe")) : FPaths::ConvertRelativePathToFull(m_hostPath.FilePath);
+    UE_LOG(LogTemp, Warning, TEXT("[SOFA] Starting simulation host %s for scene %s"), *hostPath, *scenePath);
+
+    m_remote = new FSofaRemoteSimulation();
+    if (!m_remote->start(hostPath, binariesDir, m_hostMaxVertices, m_hostMaxTriangles, m_hostTimeoutSeconds, m_hostMaxCommandSeconds) || !m_remote->load(scenePath))
+    {
+        UE_LOG(LogTemp, Error, TEXT("[SOFA] Out-of-process scene loading failed: %s"), *m_remote->getError());
+        delete m_remote;
+        m_remote = nullptr;
+        return;
+    }
+
+    m_status = 1;
+    UE_LOG(LogTemp, Warning, TEXT("[SOFA] Host loaded the scene, %d output meshes"), m_remote->getNbMeshes());
+
+    onSceneLoadCompleted();
+
+    if (!HasExistingVisualMeshes())
+    {
+        UE_LOG(LogTemp, Warning, TEXT("[SOFA] No existing visual meshes found, auto-spawning..."));
+        SpawnVisualMeshActors();
+    }
+}
+
+void ASofaContext::tickHostWatchdog()
+{
+    if (m_remote)
+    {
+        UE_LOG(LogTemp, Error, TEXT("[SOFA] Simulation host stopped responding. Last host error: %s"), *m_remote->getError());
+        clearVisualMeshBindings();
+        delete m_remote;
+        m_remote = nullptr;
+        m_status = -1;
+        scheduleHostRestart();
+        return;
+    }
+
+    if (!m_hostRestartPending || FPlatformTime::Seconds() < m_nextHostRestartTime)
+        return;
+
+    // Restarting blocks the game thread for the host start and the scene load, the backoff bounds how often
+    m_hostRestartPending = false;
+    m_hostRestarts++;
+    UE_LOG(LogTemp, Warning, TEXT("[SOFA] Restarting simulation host, attempt %d of %d"), m_hostRestarts, m_hostMaxRestarts);
+    createRemoteContext();
+    if (m_remote == nullptr)
+        scheduleHostRestart();
+}
+
+void ASofaContext::scheduleHostRestart()
+{
+    if (m_hostRestarts >= m_hostMaxRestarts)
+    {
+        UE_LOG(LogTemp, Error, TEXT("[SOFA] Simulation host failed %d times, out-of-process simulation disabled until the scene is reloaded"), m_hostRestarts + 1);
+        return;
+    }
+
+    const double delay = m_hostRestartDelaySeconds * FMath::Pow(2.0, double(m_hostRestarts));
+    m_nextHostRestartTime = FPlatformTime::Seconds() + delay;
+    m_hostRestartPending = true;
+    UE_LOG(LogTemp, Warning, TEXT("[SOFA] Simulation host restart in %.1f s"), delay);
+}
+
+void ASofaContext::loadDefaultPlugin()
+{
+    if (m_sofaAPI == nullptr)
+        return;
+
+    const FString PluginDir = getSofaBinariesDir();
+    if (PluginDir.IsEmpty())
+        return;
     FPlatformProcess::AddDllDirectory(*PluginDir);
     UE_LOG(LogTemp, Warning, TEXT("[SOFA] PluginDir (DLL search path) = %s"), *PluginDir);
 
@@ -414,25 +759,117 @@ void ASofaContext::loadDefaultPlugin()
 
 SofaPhysicsOutputMesh* ASofaContext::getOutputMeshByName(const FString& name)
 {
-    if (m_sofaAPI == nullptr || m_status <= 0)
+    if (m_sofaAPI == nullptr || m_status <= 0 || name.IsEmpty())
         return nullptr;
 
-    unsigned int nbr = m_sofaAPI->getNbOutputMeshes();
+    if (SofaPhysicsOutputMesh** mesh = m_outputMeshesByName.Find(name))
+        return *mesh;
+
+    // Fallback to the loose matching for names typed by hand. Only reached once per mesh, at binding time.
+    for (const TPair<FString, SofaPhysicsOutputMesh*>& entry : m_outputMeshesByName)
+    {
+        if (entry.Key.Equals(name, ESearchCase::IgnoreCase) || entry.Key.Contains(name))
+        {
+            UE_LOG(LogTemp, Warning, TEXT("[SOFA] Found mesh '%s' for '%s'"), *entry.Key, *name);
+            return entry.Value;
+        }
+    }
+    UE_LOG(LogTemp, Warning, TEXT("[SOFA] Mesh '%s' not found among %d meshes"), *name, m_outputMeshesByName.Num());
+    return nullptr;
+}
+
+void ASofaContext::registerVisualMesh(ASofaVisualMesh* visualMesh)
+{
+    if (visualMesh == nullptr || m_visualMeshes.Contains(visualMesh))
+        return;
+
+    m_visualMeshes.Add(visualMesh);
+    OnSceneLoaded.AddUObject(visualMesh, &ASofaVisualMesh::onSceneLoaded);
+
+    if (isSceneLoaded())
+        visualMesh->onSceneLoaded(this);
+}
+
+void ASofaContext::unregisterVisualMesh(ASofaVisualMesh* visualMesh)
+{
+    m_visualMeshes.Remove(visualMesh);
+    OnSceneLoaded.RemoveAll(visualMesh);
+}
+
+void ASofaContext::onSceneLoadCompleted()
+{
+    m_outputMeshes.Reset();
+    m_outputMeshesByName.Reset();
+    if ((m_sofaAPI == nullptr && m_remote == nullptr) || m_status <= 0)
+        return;
+
+    // The host meshes are not SofaPhysicsOutputMesh, visual meshes look them up in getRemoteSimulation()
+    unsigned int nbr = m_sofaAPI ? m_sofaAPI->getNbOutputMeshes() : 0;
     for (unsigned int meshID = 0; meshID < nbr; meshID++)
     {
         SofaPhysicsOutputMesh* mesh = m_sofaAPI->getOutputMeshPtr(meshID);
         if (mesh)
         {
-            FString meshName(mesh->getName());
-            if (meshName.Equals(name, ESearchCase::IgnoreCase) || meshName.Contains(name))
-            {
-                UE_LOG(LogTemp, Warning, TEXT("[SOFA] Found mesh '%s' at index %d"), *meshName, meshID);
-                return mesh;
-            }
+            m_outputMeshes.Add(mesh);
+            m_outputMeshesByName.Add(FString(mesh->getName()), mesh);
         }
     }
-    UE_LOG(LogTemp, Warning, TEXT("[SOFA] Mesh '%s' not found among %d meshes"), *name, nbr);
-    return nullptr;
+
+    OnSceneLoaded.Broadcast(this);
+}
+
+void ASofaContext::updateVisualMeshes()
+{
+    SCOPE_CYCLE_COUNTER(STAT_SofaContextUpdateMeshes);
+
+    // Out-of-process mode: a copy out of the shared frame per mesh, nothing to convert in parallel
+    if (m_remote)
+    {
+        for (const TWeakObjectPtr<ASofaVisualMesh>& visualMesh : m_visualMeshes)
+        {
+            if (ASofaVisualMesh* VisualMesh = visualMesh.Get())
+                VisualMesh->updateFromRemote();
+        }
+        return;
+    }
+
+    // Game thread: revision and visibility checks
+    m_meshesToUpdate.Reset();
+    for (const TWeakObjectPtr<ASofaVisualMesh>& visualMesh : m_visualMeshes)
+    {
+        ASofaVisualMesh* VisualMesh = visualMesh.Get();
+        if (VisualMesh && VisualMesh->prepareUpdate())
+            m_meshesToUpdate.Add(VisualMesh);
+    }
+
+    // Worker threads: one pass over all meshes to convert. The SOFA output mesh getters are not thread safe against a step,
+    // steps only run in Tick on the game thread, which waits here: check that no step started or ran while the buffers were read
+    const uint32 stepSequence = getStepSequence();
+    check((stepSequence & 1) == 0);
+    ParallelFor(m_meshesToUpdate.Num(), [this, stepSequence](int32 i)
+    {
+        m_meshesToUpdate[i]->computeUpdate();
+        ensureMsgf(getStepSequence() == stepSequence, TEXT("SOFA stepped while %s was reading its output meshes"), *m_meshesToUpdate[i]->GetName());
+    });
+
+    // Game thread: upload, the component enqueues the render thread update
+    for (ASofaVisualMesh* VisualMesh : m_meshesToUpdate)
+    {
+        VisualMesh->commitUpdate();
+    }
+    m_meshesToUpdate.Reset();
+}
+
+void ASofaContext::clearVisualMeshBindings()
+{
+    m_outputMeshes.Reset();
+    m_outputMeshesByName.Reset();
+
+    m_visualMeshes.RemoveAll([](const TWeakObjectPtr<ASofaVisualMesh>& visualMesh) { return !visualMesh.IsValid(); });
+    for (const TWeakObjectPtr<ASofaVisualMesh>& visualMesh : m_visualMeshes)
+    {
+        visualMesh->clearSofaMesh();
+    }
 }
 
 void ASofaContext::catchSofaMessages()
@@ -477,30 +914,43 @@ void ASofaContext::catchSofaMessages()
 
 bool ASofaContext::HasExistingVisualMeshes()
 {
-    // Check if there are any SofaVisualMesh actors that:
-    // 1. Reference this context explicitly, OR
-    // 2. Are unassigned and would auto-connect to us (only if we're the only context)
-    TArray<AActor*> FoundActors;
-    UGameplayStatics::GetAllActorsOfClass(GetWorld(), ASofaVisualMesh::StaticClass(), FoundActors);
-    
-    // Count how many SofaContext actors exist
-    TArray<AActor*> ContextActors;
-    UGameplayStatics::GetAllActorsOfClass(GetWorld(), ASofaContext::StaticClass(), ContextActors);
-    bool isOnlyContext = (ContextActors.Num() <= 1);
-    
-    for (AActor* Actor : FoundActors)
+    // Registered meshes either reference this context or were auto-connected to it
+    for (const TWeakObjectPtr<ASofaVisualMesh>& visualMesh : m_visualMeshes)
     {
-        ASofaVisualMesh* VisualMesh = Cast<ASofaVisualMesh>(Actor);
-        if (VisualMesh)
+        if (visualMesh.IsValid())
+        {
+            UE_LOG(LogTemp, Warning, TEXT("[SOFA] Found registered visual mesh '%s' for this context"), *visualMesh->GetName());
+            return true;
+        }
+    }
+
+    // Meshes placed in an editor level are not registered (no PostInitializeComponents outside of play),
+    // so fall back to a single sweep. This only runs on scene load.
+    UWorld* World = GetWorld();
+    if (!World)
+        return false;
+
+    int32 nbrContexts = -1;
+    for (TActorIterator<ASofaVisualMesh> it(World); it; ++it)
+    {
+        ASofaVisualMesh* VisualMesh = *it;
+        if (VisualMesh->SofaContextRef == this)
         {
-            // Check if it explicitly references this context
-            if (VisualMesh->SofaContextRef == this)
+            UE_LOG(LogTemp, Warning, TEXT("[SOFA] Found existing visual mesh '%s' referencing this context"), *VisualMesh->GetName());
+            return true;
+        }
+
+        // If we're the only context and this mesh has no reference, it will auto-connect to us
+        if (VisualMesh->SofaContextRef == nullptr)
+        {
+            if (nbrContexts < 0)
             {
-                UE_LOG(LogTemp, Warning, TEXT("[SOFA] Found existing visual mesh '%s' referencing this context"), *VisualMesh->GetName());
-                return true;
+                nbrContexts = 0;
+                for (TActorIterator<ASofaContext> ctxIt(World); ctxIt; ++ctxIt)
+                    nbrContexts++;
             }
-            // If we're the only context and this mesh has no reference, it will auto-connect to us
-            if (isOnlyContext && VisualMesh->SofaContextRef == nullptr)
+
+            if (nbrContexts <= 1)
             {
                 UE_LOG(LogTemp, Warning, TEXT("[SOFA] Found existing unassigned visual mesh '%s' that will auto-connect"), *VisualMesh->GetName());
                 return true;
@@ -512,19 +962,53 @@ bool ASofaContext::HasExistingVisualMeshes()
 
 void ASofaContext::SpawnVisualMeshActors()
 {
-    if (m_sofaAPI == nullptr || m_status <= 0)
+    if ((m_sofaAPI == nullptr && m_remote == nullptr) || m_status <= 0)
     {
         UE_LOG(LogTemp, Warning, TEXT("[SOFA] Cannot spawn visual meshes - scene not loaded"));
         return;
     }
 
-    UWorld* World = GetWorld();
-    if (!World)
+    if (!GetWorld())
     {
         UE_LOG(LogTemp, Error, TEXT("[SOFA] No world available for spawning"));
         return;
     }
 
+    // Out-of-process mode: one actor per host mesh, m_singleActorRendering does not apply
+    if (m_remote)
+    {
+        for (int32 i = 0; i < m_remote->getNbMeshes(); i++)
+        {
+            const FString MeshNameStr(UTF8_TO_TCHAR(m_remote->getMesh(i)->name));
+            ASofaVisualMesh* VisualMesh = SpawnVisualMeshActor(MeshNameStr);
+            if (VisualMesh)
+            {
+                VisualMesh->MeshName = MeshNameStr;
+                VisualMesh->setRemoteMesh(m_remote, i);
+                registerVisualMesh(VisualMesh);
+            }
+        }
+        UE_LOG(LogTemp, Warning, TEXT("[SOFA] Spawned %d visual meshes for the host scene"), m_remote->getNbMeshes());
+        return;
+    }
+
+    // One actor and one component for the whole scene, each output mesh being a section with its own material slot
+    if (m_singleActorRendering)
+    {
+        const FString label = FPaths::GetBaseFilename(filePath.FilePath);
+        UE_LOG(LogTemp, Warning, TEXT("[SOFA] Auto-spawning a single visual mesh actor for %d meshes..."), m_outputMeshes.Num());
+
+        ASofaVisualMesh* VisualMesh = SpawnVisualMeshActor(label);
+        if (VisualMesh)
+        {
+            VisualMesh->m_allSceneMeshes = true;
+            VisualMesh->setSofaMeshes(m_outputMeshes);
+            registerVisualMesh(VisualMesh);
+            UE_LOG(LogTemp, Warning, TEXT("[SOFA] Successfully spawned scene visual mesh '%s' with %d sections"), *label, m_outputMeshes.Num());
+        }
+        return;
+    }
+
     unsigned int numMeshes = m_sofaAPI->getNbOutputMeshes();
     UE_LOG(LogTemp, Warning, TEXT("[SOFA] Auto-spawning %d visual mesh actors..."), numMeshes);
 
@@ -540,37 +1024,46 @@ void ASofaContext::SpawnVisualMeshActors()
         FString MeshNameStr(sofaMesh->getName());
         UE_LOG(LogTemp, Warning, TEXT("[SOFA] Spawning visual mesh for '%s'"), *MeshNameStr);
 
-        // Spawn the visual mesh actor
-        FActorSpawnParameters SpawnParams;
-        SpawnParams.Owner = this;
-        SpawnParams.SpawnCollisionHandlingOverride = ESpawnActorCollisionHandlingMethod::AlwaysSpawn;
-
-        ASofaVisualMesh* VisualMesh = World->SpawnActor<ASofaVisualMesh>(
-            ASofaVisualMesh::StaticClass(), 
-            GetActorLocation(), 
-            GetActorRotation(), 
-            SpawnParams
-        );
-        
+        ASofaVisualMesh* VisualMesh = SpawnVisualMeshActor(MeshNameStr);
         if (VisualMesh)
         {
-            // Attach to this context and set up
-            VisualMesh->AttachToActor(this, FAttachmentTransformRules::KeepWorldTransform);
-            VisualMesh->SofaContextRef = this;
             VisualMesh->MeshName = MeshNameStr;
             VisualMesh->setSofaMesh(sofaMesh);
-
-#if WITH_EDITOR
-            VisualMesh->SetActorLabel(MeshNameStr);
-#endif
+            registerVisualMesh(VisualMesh);
 
             UE_LOG(LogTemp, Warning, TEXT("[SOFA] Successfully spawned visual mesh '%s'"), *MeshNameStr);
         }
-        else
-        {
-            UE_LOG(LogTemp, Error, TEXT("[SOFA] Failed to spawn visual mesh for '%s'"), *MeshNameStr);
-        }
     }
 
     UE_LOG(LogTemp, Warning, TEXT("[SOFA] Finished auto-spawning visual meshes"));
 }
+
+ASofaVisualMesh* ASofaContext::SpawnVisualMeshActor(const FString& label)
+{
+    FActorSpawnParameters SpawnParams;
+    SpawnParams.Owner = this;
+    SpawnParams.SpawnCollisionHandlingOverride = ESpawnActorCollisionHandlingMethod::AlwaysSpawn;
+
+    ASofaVisualMesh* VisualMesh = GetWorld()->SpawnActor<ASofaVisualMesh>(
+        ASofaVisualMesh::StaticClass(),
+        GetActorLocation(),
+        GetActorRotation(),
+        SpawnParams
+    );
+
+    if (VisualMesh == nullptr)
+    {
+        UE_LOG(LogTemp, Error, TEXT("[SOFA] Failed to spawn visual mesh for '%s'"), *label);
+        return nullptr;
+    }
+
+    // Attach to this context
+    VisualMesh->AttachToActor(this, FAttachmentTransformRules::KeepWorldTransform);
+    VisualMesh->SofaContextRef = this;
+
+#if WITH_EDITOR
+    VisualMesh->SetActorLabel(label);
+#endif
+
+    return VisualMesh;
+}
@@ -0,0 +1,60 @@
+/*****************************************************************************
+ *                 - Copyright (C) - 2022 - InfinyTech3D -                   *
+ *                                                                           *
+ * This file is part of the SofaUE5-Renderer asset from InfinyTech3D         *
+ *                                                                           *
+ * GNU General Public License Usage:                                         *
+ * This file may be used under the terms of the GNU General                  *
+ * Public License version 3. The licenses are as published by the Free       *
+ * Software Foundation and appearing in the file LICENSE.GPL3 included in    *
+ * the packaging of this file. Please review the following information to    *
+ * ensure the GNU General Public License requirements will be met:           *
+ * https://www.gnu.org/licenses/gpl-3.0.html.                                *
+ *                                                                           *
+ * Commercial License Usage:                                                 *
+ * Licensees holding valid commercial license from InfinyTech3D may use this *
+ * file in accordance with the commercial license agreement provided with    *
+ * the Software or, alternatively, in accordance with the terms contained in *
+ * a written agreement between you and InfinyTech3D. For further information *
+ * on the licensing terms and conditions, contact: contact@infinytech3d.com  *
+ *                                                                           *
+ * Authors: see Authors.txt                                                  *
+ * Further information: https://infinytech3d.com                             *
+ ****************************************************************************/
+#include "SofaMeshComponent.h"
+#include "SofaVisualMesh.h"
+
+void USofaMeshComponent::setSimulationBounds(const FBox& localBox, bool bUpdate)
+{
+    m_simulationBounds = localBox;
+
+    if (bUpdate)
+    {
+        UpdateBounds();
+        MarkRenderTransformDirty();
+    }
+}
+
+void USofaMeshComponent::clearSimulationBounds()
+{
+    m_simulationBounds = FBox(ForceInit);
+    UpdateBounds();
+    MarkRenderTransformDirty();
+}
+
+FBoxSphereBounds USofaMeshComponent::CalcBounds(const FTransform& LocalToWorld) const
+{
+    if (!m_simulationBounds.IsValid)
+        return Super::CalcBounds(LocalToWorld);
+
+    return FBoxSphereBounds(m_simulationBounds).TransformBy(LocalToWorld);
+}
+
+bool USofaMeshComponent::LineTraceComponent(FHitResult& OutHit, const FVector Start, const FVector End, const FCollisionQueryParams& Params)
+{
+    ASofaVisualMesh* visualMesh = Cast<ASofaVisualMesh>(GetOwner());
+    if (visualMesh && visualMesh->m_collisionMode == ESofaCollisionMode::Deformable)
+        return visualMesh->traceDeformedSurface(Start, End, OutHit);
+
+    return Super::LineTraceComponent(OutHit, Start, End, Params);
+}
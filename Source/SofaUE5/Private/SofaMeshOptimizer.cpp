@@ -0,0 +1,235 @@
+/*****************************************************************************
+ *                 - Copyright (C) - 2022 - InfinyTech3D -                   *
+ *                                                                           *
+ * This file is part of the SofaUE5-Renderer asset from InfinyTech3D         *
+ *                                                                           *
+ * GNU General Public License Usage:                                         *
+ * This file may be used under the terms of the GNU General                  *
+ * Public License version 3. The licenses are as published by the Free       *
+ * Software Foundation and appearing in the file LICENSE.GPL3 included in    *
+ * the packaging of this file. Please review the following information to    *
+ * ensure the GNU General Public License requirements will be met:           *
+ * https://www.gnu.org/licenses/gpl-3.0.html.                                *
+ *                                                                           *
+ * Commercial License Usage:                                                 *
+ * Licensees holding valid commercial license from InfinyTech3D may use this *
+ * file in accordance with the commercial license agreement provided with    *
+ * the Software or, alternatively, in accordance with the terms contained in *
+ * a written agreement between you and InfinyTech3D. For further information *
+ * on the licensing terms and conditions, contact: contact@infinytech3d.com  *
+ *                                                                           *
+ * Authors: see Authors.txt                                                  *
+ * Further information: https://infinytech3d.com                             *
+ ****************************************************************************/
+#include "SofaMeshOptimizer.h"
+
+namespace
+{
+    constexpr int32 SofaCacheSize = FSofaMeshOptimizer::CacheSize;
+
+    /** Forsyth vertex score: recently used vertices and vertices with few remaining triangles come first */
+    float vertexCacheScore(int32 cachePos, int32 activeTris)
+    {
+        if (activeTris == 0)
+            return -1.0f;
+
+        float score = 0.0f;
+        if (cachePos >= 0)
+        {
+            // The 3 vertices of the last triangle get a fixed score, so the next triangle does not always reuse the same edge
+            if (cachePos < 3)
+                score = 0.75f;
+            else
+                score = FMath::Pow(1.0f - float(cachePos - 3) / float(SofaCacheSize - 3), 1.5f);
+        }
+
+        // Boost vertices with few triangles left, to finish them off and avoid lone triangles at the end
+        score += 2.0f * FMath::InvSqrt(float(activeTris));
+        return score;
+    }
+}
+
+float FSofaMeshOptimizer::computeACMR(const TArray<int32>& indices, int32 nbrV)
+{
+    const int32 nbrTri = indices.Num() / 3;
+    if (nbrTri == 0)
+        return 0.0f;
+
+    // FIFO cache: a miss overwrites the oldest of the SofaCacheSize entries
+    int32 fifo[SofaCacheSize];
+    for (int32& entry : fifo)
+    {
+        entry = INDEX_NONE;
+    }
+    TArray<bool> inCache;
+    inCache.Init(false, nbrV);
+    int32 oldest = 0;
+    int32 misses = 0;
+    for (int32 idx : indices)
+    {
+        if (inCache[idx])
+            continue;
+
+        if (fifo[oldest] != INDEX_NONE)
+            inCache[fifo[oldest]] = false;
+        fifo[oldest] = idx;
+        inCache[idx] = true;
+        oldest = (oldest + 1) % SofaCacheSize;
+        misses++;
+    }
+    return float(misses) / float(nbrTri);
+}
+
+void FSofaMeshOptimizer::optimizeVertexCache(TArray<int32>& indices, int32 nbrV)
+{
+    const int32 nbrTri = indices.Num() / 3;
+    if (nbrTri == 0)
+        return;
+
+    // CSR vertex -> triangles
+    TArray<int32> offsets;
+    offsets.Init(0, nbrV + 1);
+    for (int32 idx : indices)
+    {
+        offsets[idx + 1]++;
+    }
+    for (int32 v = 0; v < nbrV; v++)
+    {
+        offsets[v + 1] += offsets[v];
+    }
+
+    TArray<int32> vertexTris;
+    vertexTris.SetNumUninitialized(nbrTri * 3);
+    TArray<int32> cursor;
+    cursor.Append(offsets.GetData(), nbrV);
+    for (int32 t = 0; t < nbrTri * 3; t++)
+    {
+        vertexTris[cursor[indices[t]]++] = t / 3;
+    }
+
+    TArray<int32> activeTris;
+    TArray<int32> cachePos;
+    TArray<float> vertexScore;
+    activeTris.SetNumUninitialized(nbrV);
+    cachePos.Init(INDEX_NONE, nbrV);
+    vertexScore.SetNumUninitialized(nbrV);
+    for (int32 v = 0; v < nbrV; v++)
+    {
+        activeTris[v] = offsets[v + 1] - offsets[v];
+        vertexScore[v] = vertexCacheScore(INDEX_NONE, activeTris[v]);
+    }
+
+    TArray<float> triScore;
+    TArray<bool> triAdded;
+    triScore.SetNumUninitialized(nbrTri);
+    triAdded.Init(false, nbrTri);
+    int32 bestTri = 0;
+    for (int32 t = 0; t < nbrTri; t++)
+    {
+        triScore[t] = vertexScore[indices[t * 3]] + vertexScore[indices[t * 3 + 1]] + vertexScore[indices[t * 3 + 2]];
+        if (triScore[t] > triScore[bestTri])
+            bestTri = t;
+    }
+
+    TArray<int32> output;
+    output.Reserve(nbrTri * 3);
+
+    // LRU cache, 3 extra slots for the vertices pushed out by the last triangle
+    int32 cache[SofaCacheSize + 3];
+    int32 cacheCount = 0;
+    int32 scanCursor = 0;
+
+    for (int32 emitted = 0; emitted < nbrTri; emitted++)
+    {
+        // Nothing in the cache has triangles left: restart from the first triangle not emitted yet
+        if (bestTri == INDEX_NONE)
+        {
+            while (triAdded[scanCursor])
+            {
+                scanCursor++;
+            }
+            bestTri = scanCursor;
+        }
+
+        triAdded[bestTri] = true;
+        const int32 triVerts[3] = { indices[bestTri * 3], indices[bestTri * 3 + 1], indices[bestTri * 3 + 2] };
+        output.Append(triVerts, 3);
+
+        // Put the triangle vertices in front, then the previous cache without them
+        int32 newCache[SofaCacheSize + 3];
+        int32 newCount = 0;
+        for (int32 k = 0; k < 3; k++)
+        {
+            const int32 v = triVerts[k];
+            activeTris[v]--;
+            if (k == 0 || (v != triVerts[0] && (k == 1 || v != triVerts[1])))
+                newCache[newCount++] = v;
+        }
+        for (int32 i = 0; i < cacheCount; i++)
+        {
+            const int32 v = cache[i];
+            if (v != triVerts[0] && v != triVerts[1] && v != triVerts[2])
+                newCache[newCount++] = v;
+        }
+
+        for (int32 i = 0; i < newCount; i++)
+        {
+            const int32 v = newCache[i];
+            cachePos[v] = i < SofaCacheSize ? i : INDEX_NONE;
+            vertexScore[v] = vertexCacheScore(cachePos[v], activeTris[v]);
+        }
+
+        // Only the triangles around vertices that were in the cache can change score
+        bestTri = INDEX_NONE;
+        float bestScore = -1.0f;
+        for (int32 i = 0; i < newCount; i++)
+        {
+            const int32 v = newCache[i];
+            for (int32 k = offsets[v]; k < offsets[v + 1]; k++)
+            {
+                const int32 t = vertexTris[k];
+                if (triAdded[t])
+                    continue;
+
+                triScore[t] = vertexScore[indices[t * 3]] + vertexScore[indices[t * 3 + 1]] + vertexScore[indices[t * 3 + 2]];
+                if (triScore[t] > bestScore)
+                {
+                    bestScore = triScore[t];
+                    bestTri = t;
+                }
+            }
+        }
+
+        cacheCount = FMath::Min(newCount, SofaCacheSize);
+        FMemory::Memcpy(cache, newCache, cacheCount * sizeof(int32));
+    }
+
+    indices = MoveTemp(output);
+}
+
+void FSofaMeshOptimizer::reorderVerticesByFirstUse(TArray<int32>& indices, int32 nbrV, TArray<int32>& newToOld)
+{
+    TArray<int32> oldToNew;
+    oldToNew.Init(INDEX_NONE, nbrV);
+    newToOld.Reset(nbrV);
+
+    for (int32& idx : indices)
+    {
+        if (oldToNew[idx] == INDEX_NONE)
+        {
+            oldToNew[idx] = newToOld.Num();
+            newToOld.Add(idx);
+        }
+        idx = oldToNew[idx];
+    }
+
+    // Unreferenced vertices are kept so the vertex count still matches SOFA
+    for (int32 v = 0; v < nbrV; v++)
+    {
+        if (oldToNew[v] == INDEX_NONE)
+        {
+            oldToNew[v] = newToOld.Num();
+            newToOld.Add(v);
+        }
+    }
+}
@@ -0,0 +1,46 @@
+/*****************************************************************************
+ *                 - Copyright (C) - 2022 - InfinyTech3D -                   *
+ *                                                                           *
+ * This file is part of the SofaUE5-Renderer asset from InfinyTech3D         *
+ *                                                                           *
+ * GNU General Public License Usage:                                         *
+ * This file may be used under the terms of the GNU General                  *
+ * Public License version 3. The licenses are as published by the Free       *
+ * Software Foundation and appearing in the file LICENSE.GPL3 included in    *
+ * the packaging of this file. Please review the following information to    *
+ * ensure the GNU General Public License requirements will be met:           *
+ * https://www.gnu.org/licenses/gpl-3.0.html.                                *
+ *                                                                           *
+ * Commercial License Usage:                                                 *
+ * Licensees holding valid commercial license from InfinyTech3D may use this *
+ * file in accordance with the commercial license agreement provided with    *
+ * the Software or, alternatively, in accordance with the terms contained in *
+ * a written agreement between you and InfinyTech3D. For further information *
+ * on the licensing terms and conditions, contact: contact@infinytech3d.com  *
+ *                                                                           *
+ * Authors: see Authors.txt                                                  *
+ * Further information: https://infinytech3d.com                             *
+ ****************************************************************************/
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/** Load-time index/vertex reordering helpers for SofaMeshSection */
+struct FSofaMeshOptimizer
+{
+    /** Size of the simulated post-transform cache, used by the optimizer and to report ACMR */
+    static constexpr int32 CacheSize = 32;
+
+    /** Average cache miss ratio: transformed vertices per triangle with a FIFO cache of CacheSize entries. 0.5 is ideal, 3 is the worst */
+    static float computeACMR(const TArray<int32>& indices, int32 nbrV);
+
+    /** Reorder the triangles for post-transform cache hits, using Tom Forsyth's linear-speed vertex cache optimization */
+    static void optimizeVertexCache(TArray<int32>& indices, int32 nbrV);
+
+    /**
+     * Renumber the vertices in order of first use by the index buffer, unreferenced vertices going last.
+     * newToOld[i] is the original index of the new vertex i, so the per-frame copy stays a linear gather.
+     */
+    static void reorderVerticesByFirstUse(TArray<int32>& indices, int32 nbrV, TArray<int32>& newToOld);
+};
@@ -0,0 +1,687 @@
+/*****************************************************************************
+ *                 - Copyright (C) - 2022 - InfinyTech3D -                   *
+ *                                                                           *
+ * This file is part of the SofaUE5-Renderer asset from InfinyTech3D         *
+ *                                                                           *
+ * GNU General Public License Usage:                                         *
+ * This file may be used under the terms of the GNU General                  *
+ * Public License version 3. The licenses are as published by the Free       *
+ * Software Foundation and appearing in the file LICENSE.GPL3 included in    *
+ * the packaging of this file. Please review the following information to    *
+ * ensure the GNU General Public License requirements will be met:           *
+ * https://www.gnu.org/licenses/gpl-3.0.html.                                *
+ *                                                                           *
+ * Commercial License Usage:                                                 *
+ * Licensees holding valid commercial license from InfinyTech3D may use this *
+ * file in accordance with the commercial license agreement provided with    *
+ * the Software or, alternatively, in accordance with the terms contained in *
+ * a written agreement between you and InfinyTech3D. For further information *
+ * on the licensing terms and conditions, contact: contact@infinytech3d.com  *
+ *                                                                           *
+ * Authors: see Authors.txt                                                  *
+ * Further information: https://infinytech3d.com                             *
+ ****************************************************************************/
+#include "SofaMeshSection.h"
+#include "SofaUE5.h"
+#include "SofaMeshComponent.h"
+#include "SofaMeshOptimizer.h"
+#include "SofaUE5Library/SofaPhysicsAPI.h"
+#include "Async/ParallelFor.h"
+
+DECLARE_CYCLE_STAT(TEXT("VisualMesh Update"), STAT_SofaVisualMeshUpdate, STATGROUP_SofaUE5);
+DECLARE_CYCLE_STAT(TEXT("VisualMesh Compute Normals"), STAT_SofaVisualMeshNormals, STATGROUP_SofaUE5);
+DECLARE_CYCLE_STAT(TEXT("VisualMesh Compute Tangents"), STAT_SofaVisualMeshTangents, STATGROUP_SofaUE5);
+DECLARE_CYCLE_STAT(TEXT("VisualMesh Refit Collision"), STAT_SofaVisualMeshRefit, STATGROUP_SofaUE5);
+DECLARE_CYCLE_STAT(TEXT("VisualMesh Dirty Detection"), STAT_SofaVisualMeshDirty, STATGROUP_SofaUE5);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("VisualMesh Skipped Uploads"), STAT_SofaVisualMeshSkippedUploads, STATGROUP_SofaUE5);
+
+FSofaMeshSection::FSofaMeshSection(SofaPhysicsOutputMesh* sofaMesh, int32 sectionIndex)
+    : m_sofaMesh(sofaMesh)
+    , m_sectionIndex(sectionIndex)
+{
+
+}
+
+bool FSofaMeshSection::build(const FSofaMeshSectionSettings& settings)
+{
+    if (m_sofaMesh == nullptr)
+        return false;
+
+    const FString meshName(m_sofaMesh->getName());
+    int nbrV = m_sofaMesh->getNbVertices();
+    int nbrTri = m_sofaMesh->getNbTriangles();
+    int nbrQuad = m_sofaMesh->getNbQuads();
+    UE_LOG(SUnreal_log, Warning, TEXT("##### FSofaMeshSection::build '%s':  nbrV: %d | nbrTri: %d | nbrQuad: %d ####"), *meshName, nbrV, nbrTri, nbrQuad);
+
+    if (nbrV <= 0)
+    {
+        UE_LOG(SUnreal_log, Error, TEXT("[SOFA] FSofaMeshSection::build - No vertices in '%s'!"), *meshName);
+        return false;
+    }
+
+    // Normals are either computed by SOFA in updateVisual or here in computeNormals, never both.
+    // Without the option the scene keeps its own updateNormals, even if an earlier build turned it off
+    if (!settings.m_computeNormals)
+    {
+        m_sofaMesh->resetComputeNormals();
+    }
+    else if (m_sofaMesh->setComputeNormals(false) != API_SUCCESS)
+    {
+        UE_LOG(SUnreal_log, Warning, TEXT("[SOFA] FSofaMeshSection::build - Could not disable SOFA normals update for '%s'"), *meshName);
+    }
+
+    // Get all info from SofaPhysicsOutputMesh
+    m_uploadedRevision = m_sofaMesh->getVerticesRevision();
+    m_hasPendingUpload = false;
+    m_pendingIsClean = false;
+    m_hasPendingColors = false;
+    float* sofaVertices = new float[nbrV * 3];
+    float* sofaNormals = new float[nbrV * 3];
+    float* sofaTexCoords = new float[nbrV * 2];
+    int* sofaTriangles = new int[nbrTri * 3];
+    int* sofaQuads = new int[nbrQuad * 4];
+
+    m_sofaMesh->getVPositions(sofaVertices);
+    m_uploadedPositions.Reset();
+    if (settings.m_dirtyEpsilon > 0.0f)
+    {
+        m_uploadedPositions.Append(sofaVertices, nbrV * 3);
+    }
+    m_sofaMesh->getVNormals(sofaNormals);
+    m_sofaMesh->getVTexCoords(sofaTexCoords);
+    m_sofaMesh->getTriangles(sofaTriangles);
+    m_sofaMesh->getQuads(sofaQuads);
+
+    m_vertices.Reset(nbrV);
+    m_normals.Reset(nbrV);
+    m_UV0.Reset(nbrV);
+    m_tangents.Reset();
+    m_triangles.Reset((nbrTri + nbrQuad * 2) * 3);
+
+    // Fill Unreal Mesh info with SOFA buffers
+    const float sign = settings.m_inverseNormal ? -1.0f : 1.0f;
+    for (int i = 0; i < nbrV; i++)
+    {
+        m_vertices.Add(FVector(sofaVertices[i * 3], sofaVertices[i * 3 + 1], sofaVertices[i * 3 + 2]));
+        m_normals.Add(FVector(sign * sofaNormals[i * 3], sign * sofaNormals[i * 3 + 1], sign * sofaNormals[i * 3 + 2]));
+        m_UV0.Add(FVector2D(sofaTexCoords[i * 2], sofaTexCoords[i * 2 + 1]));
+    }
+
+    // Add triangles
+    for (int i = 0; i < nbrTri; i++)
+    {
+        m_triangles.Add(sofaTriangles[i * 3]);
+        m_triangles.Add(sofaTriangles[i * 3 + 1]);
+        m_triangles.Add(sofaTriangles[i * 3 + 2]);
+    }
+
+    // Add quads as 2 triangles
+    for (int i = 0; i < nbrQuad; i++)
+    {
+        m_triangles.Add(sofaQuads[i * 4]);
+        m_triangles.Add(sofaQuads[i * 4 + 1]);
+        m_triangles.Add(sofaQuads[i * 4 + 2]);
+
+        m_triangles.Add(sofaQuads[i * 4]);
+        m_triangles.Add(sofaQuads[i * 4 + 2]);
+        m_triangles.Add(sofaQuads[i * 4 + 3]);
+    }
+
+    m_sofaVertexIds.Reset();
+    if (settings.m_optimizeVertexCache)
+    {
+        optimizeVertexOrder();
+    }
+
+    // The seam map welds the normals as well: SOFA smooths across the duplicates of a seam through vertPosIdx
+    m_uniqueSofaIds.Reset();
+    m_renderToUnique.Reset();
+    if (settings.m_streamUniquePositions || settings.m_computeNormals)
+    {
+        buildSeamMap();
+    }
+
+    const bool welded = m_renderToUnique.Num() == nbrV;
+    m_vertexNormals.build(m_triangles.GetData(), m_triangles.Num() / 3, nbrV, welded ? m_renderToUnique.GetData() : nullptr, m_uniqueSofaIds.Num());
+    if (settings.m_computeNormals)
+    {
+        computeNormals(settings.m_inverseNormal);
+    }
+
+    // Recompute UV if not provided
+    bool needUVRecompute = true;
+    for (int i = 0; i < nbrV * 2; i++)
+    {
+        if (sofaTexCoords[i] != 0.0f)
+        {
+            needUVRecompute = false;
+            break;
+        }
+    }
+
+    computeBoundingBox();
+    if (needUVRecompute)
+    {
+        recomputeUV();
+    }
+
+    if (settings.m_computeTangents)
+    {
+        buildTangentSetup();
+        computeTangents();
+    }
+
+    resolveColorAttribute(settings);
+    computeColors(settings);
+
+    // The topology does not change, later updates only refit the boxes
+    if (settings.m_collisionMode == ESofaCollisionMode::Deformable)
+    {
+        m_bvh.build(m_vertices, m_triangles);
+    }
+    else
+    {
+        m_bvh.reset();
+    }
+
+    // Clean up SOFA buffers
+    delete[] sofaVertices;
+    delete[] sofaNormals;
+    delete[] sofaTexCoords;
+    delete[] sofaTriangles;
+    delete[] sofaQuads;
+
+    return true;
+}
+
+
+void FSofaMeshSection::createSection(USofaMeshComponent* component, const FSofaMeshSectionSettings& settings)
+{
+    // Only the AsyncCooked mode has a physics shape, the owner enables bUseAsyncCooking so cooking does not block the game thread
+    const bool bCreateCollision = settings.m_collisionMode == ESofaCollisionMode::AsyncCooked;
+    component->CreateMeshSection(m_sectionIndex, m_vertices, m_triangles, m_normals, m_UV0, m_colors, m_tangents, bCreateCollision);
+    m_hasPendingColors = false;
+
+    UE_LOG(SUnreal_log, Warning, TEXT("[SOFA] FSofaMeshSection::createSection - Created section %d with %d vertices, %d triangles"), m_sectionIndex, m_vertices.Num(), m_triangles.Num() / 3);
+}
+
+
+bool FSofaMeshSection::isOutdated() const
+{
+    if (m_sofaMesh == nullptr || m_sofaMesh->getNbVertices() <= 0)
+        return false;
+
+    if (m_colorAttributeIndex >= 0 && m_sofaMesh->getVAttributeRevision(m_colorAttributeIndex) != m_uploadedColorRevision)
+        return true;
+
+    return m_sofaMesh->getVerticesRevision() != m_uploadedRevision;
+}
+
+
+void FSofaMeshSection::markPending()
+{
+    m_pendingRevision = m_sofaMesh->getVerticesRevision();
+    if (m_colorAttributeIndex >= 0)
+    {
+        m_pendingColorRevision = m_sofaMesh->getVAttributeRevision(m_colorAttributeIndex);
+    }
+}
+
+
+bool FSofaMeshSection::refreshBoundsFromSofa()
+{
+    float boxMin[3];
+    float boxMax[3];
+    if (m_sofaMesh == nullptr || m_sofaMesh->getBoundingBox(boxMin, boxMax) != API_SUCCESS)
+        return false;
+
+    // The revision is left untouched so the next visible frame catches up
+    m_min = FVector(boxMin[0], boxMin[1], boxMin[2]);
+    m_max = FVector(boxMax[0], boxMax[1], boxMax[2]);
+    return true;
+}
+
+
+void FSofaMeshSection::compute(const FSofaMeshSectionSettings& settings)
+{
+    SCOPE_CYCLE_COUNTER(STAT_SofaVisualMeshUpdate);
+
+    // Runs on a worker thread: only touches this section buffers and the SOFA mesh, ASofaContext::updateVisualMeshes checks no step runs meanwhile
+    m_hasPendingUpload = false;
+    m_hasPendingColors = false;
+    m_pendingIsClean = false;
+
+    // Colors follow their own revision, they can change while the positions stay clean
+    if (m_colorAttributeIndex >= 0 && m_pendingColorRevision != m_uploadedColorRevision)
+    {
+        computeColors(settings);
+    }
+
+    const int nbrV = m_sofaMesh->getNbVertices();
+    const float* sofaVertices = m_sofaMesh->getVPositions();
+    if (nbrV <= 0 || sofaVertices == nullptr)
+    {
+        // Nothing will be uploaded, the colors are recomputed from their revision next time
+        m_hasPendingColors = false;
+        return;
+    }
+
+    // Pinned or resting meshes: nothing moved enough since the last upload, skip conversion, normals, tangents and upload
+    if (settings.m_dirtyEpsilon > 0.0f && !hasMovedSinceUpload(sofaVertices, nbrV, settings.m_dirtyEpsilon) && !m_hasPendingColors)
+    {
+        INC_DWORD_STAT(STAT_SofaVisualMeshSkippedUploads);
+        m_pendingIsClean = true;
+        return;
+    }
+
+    // Convert positions and reduce the bounding box in the same pass, min/max are done on SIMD registers
+    VectorRegister4Float vMin = VectorSetFloat1(UE_BIG_NUMBER);
+    VectorRegister4Float vMax = VectorSetFloat1(-UE_BIG_NUMBER);
+    // Reordered meshes read SOFA through the permutation, still one sequential write stream
+    const int32* gather = m_sofaVertexIds.Num() == nbrV ? m_sofaVertexIds.GetData() : nullptr;
+    m_vertices.SetNumUninitialized(nbrV, EAllowShrinking::No);
+    if (settings.m_streamUniquePositions && m_renderToUnique.Num() == nbrV)
+    {
+        // Seam duplicates always share their SOFA position: read and convert each position once, then expand to the render layout
+        const int32 nbrUnique = m_uniqueSofaIds.Num();
+        m_uniquePositions.SetNumUninitialized(nbrUnique, EAllowShrinking::No);
+        for (int32 u = 0; u < nbrUnique; u++)
+        {
+            const float* p = sofaVertices + m_uniqueSofaIds[u] * 3;
+            const VectorRegister4Float vPos = VectorLoadFloat3(p);
+            vMin = VectorMin(vMin, vPos);
+            vMax = VectorMax(vMax, vPos);
+            m_uniquePositions[u] = FVector(p[0], p[1], p[2]);
+        }
+
+        for (int i = 0; i < nbrV; i++)
+        {
+            m_vertices[i] = m_uniquePositions[m_renderToUnique[i]];
+        }
+    }
+    else
+    {
+        for (int i = 0; i < nbrV; i++)
+        {
+            const float* p = sofaVertices + (gather ? gather[i] : i) * 3;
+            const VectorRegister4Float vPos = VectorLoadFloat3(p);
+            vMin = VectorMin(vMin, vPos);
+            vMax = VectorMax(vMax, vPos);
+            m_vertices[i] = FVector(p[0], p[1], p[2]);
+        }
+    }
+
+    alignas(16) float boxMin[4];
+    alignas(16) float boxMax[4];
+    VectorStoreAligned(vMin, boxMin);
+    VectorStoreAligned(vMax, boxMax);
+    m_min = FVector(boxMin[0], boxMin[1], boxMin[2]);
+    m_max = FVector(boxMax[0], boxMax[1], boxMax[2]);
+
+    if (settings.m_computeNormals)
+    {
+        computeNormals(settings.m_inverseNormal);
+    }
+    else
+    {
+        const float* sofaNormals = m_sofaMesh->getVNormals();
+        const float sign = settings.m_inverseNormal ? -1.0f : 1.0f;
+        m_normals.SetNumUninitialized(nbrV, EAllowShrinking::No);
+        for (int i = 0; i < nbrV; i++)
+        {
+            const float* n = sofaNormals + (gather ? gather[i] : i) * 3;
+            m_normals[i] = FVector(sign * n[0], sign * n[1], sign * n[2]);
+        }
+    }
+
+    if (settings.m_computeTangents)
+    {
+        computeTangents();
+    }
+
+    if (settings.m_collisionMode == ESofaCollisionMode::Deformable && m_bvh.isValid())
+    {
+        SCOPE_CYCLE_COUNTER(STAT_SofaVisualMeshRefit);
+        m_bvh.refit(m_vertices);
+    }
+
+    m_hasPendingUpload = true;
+}
+
+
+void FSofaMeshSection::commit(USofaMeshComponent* component, const FSofaMeshSectionSettings& settings)
+{
+    if (m_pendingIsClean)
+    {
+        m_uploadedRevision = m_pendingRevision;
+        m_pendingIsClean = false;
+        m_hasPendingColors = false;
+        return;
+    }
+
+    if (!m_hasPendingUpload)
+    {
+        m_hasPendingColors = false;
+        return;
+    }
+
+    // Colors and tangents ride along in the same vertex buffer update, an empty array keeps the previous ones.
+    // Bound by reference so the members are not copied at each upload
+    static const TArray<FColor> noColors;
+    static const TArray<FProcMeshTangent> noTangents;
+    const TArray<FColor>& colors = m_hasPendingColors ? m_colors : noColors;
+    const TArray<FProcMeshTangent>& tangents = (settings.m_computeTangents && m_tangents.Num() == m_vertices.Num()) ? m_tangents : noTangents;
+    component->UpdateMeshSection(m_sectionIndex, m_vertices, m_normals, TArray<FVector2D>(), colors, tangents);
+
+    m_uploadedRevision = m_pendingRevision;
+    m_hasPendingUpload = false;
+    if (m_hasPendingColors)
+    {
+        m_uploadedColorRevision = m_pendingColorRevision;
+        m_hasPendingColors = false;
+    }
+}
+
+
+bool FSofaMeshSection::raycast(const FVector& origin, const FVector& direction, double maxDistance, FSofaRayHit& hit) const
+{
+    return m_bvh.raycast(m_vertices, origin, direction, maxDistance, hit);
+}
+
+
+void FSofaMeshSection::optimizeVertexOrder()
+{
+    const int32 nbrV = m_vertices.Num();
+    const float acmrBefore = FSofaMeshOptimizer::computeACMR(m_triangles, nbrV);
+
+    FSofaMeshOptimizer::optimizeVertexCache(m_triangles, nbrV);
+    FSofaMeshOptimizer::reorderVerticesByFirstUse(m_triangles, nbrV, m_sofaVertexIds);
+
+    // Apply the permutation to the attributes read at build
+    auto permute = [this](auto& values)
+    {
+        auto source = values;
+        for (int32 i = 0; i < m_sofaVertexIds.Num(); i++)
+        {
+            values[i] = source[m_sofaVertexIds[i]];
+        }
+    };
+    permute(m_vertices);
+    permute(m_normals);
+    permute(m_UV0);
+
+    const float acmrAfter = FSofaMeshOptimizer::computeACMR(m_triangles, nbrV);
+    UE_LOG(SUnreal_log, Log, TEXT("[SOFA] FSofaMeshSection::optimizeVertexOrder '%s' - ACMR (FIFO %d): %.3f -> %.3f"), *FString(m_sofaMesh->getName()), FSofaMeshOptimizer::CacheSize, acmrBefore, acmrAfter);
+}
+
+
+void FSofaMeshSection::resolveColorAttribute(const FSofaMeshSectionSettings& settings)
+{
+    m_colorAttributeIndex = -1;
+    m_colors.Reset();
+    if (settings.m_colorAttribute.IsEmpty() || settings.m_colorTable.Num() != ColorTableSize)
+        return;
+
+    const FString meshName(m_sofaMesh->getName());
+    const int32 nbrAttributes = m_sofaMesh->getNbVAttributes();
+    for (int32 i = 0; i < nbrAttributes; i++)
+    {
+        if (settings.m_colorAttribute != FString(m_sofaMesh->getVAttributeName(i)))
+            continue;
+
+        const int32 nbrValues = m_sofaMesh->getNbAttributes(i);
+        const int32 sizePerVertex = m_sofaMesh->getVAttributeSizePerVertex(i);
+        if (nbrValues != int32(m_sofaMesh->getNbVertices()) || sizePerVertex <= 0 || settings.m_colorAttributeComponent >= sizePerVertex)
+        {
+            UE_LOG(SUnreal_log, Warning, TEXT("[SOFA] FSofaMeshSection::resolveColorAttribute - Attribute '%s' of '%s' is not a per vertex attribute with component %d"), *settings.m_colorAttribute, *meshName, settings.m_colorAttributeComponent);
+            return;
+        }
+
+        // The colors computed at build go with the section creation
+        m_colorAttributeIndex = i;
+        m_uploadedColorRevision = m_sofaMesh->getVAttributeRevision(i);
+        m_pendingColorRevision = m_uploadedColorRevision;
+        return;
+    }
+
+    UE_LOG(SUnreal_log, Warning, TEXT("[SOFA] FSofaMeshSection::resolveColorAttribute - No vertex attribute '%s' in '%s'"), *settings.m_colorAttribute, *meshName);
+}
+
+
+void FSofaMeshSection::computeColors(const FSofaMeshSectionSettings& settings)
+{
+    if (m_colorAttributeIndex < 0)
+        return;
+
+    const int32 nbrV = m_vertices.Num();
+    const float* values = m_sofaMesh->getVAttributeValue(m_colorAttributeIndex);
+    const int32 sizePerVertex = m_sofaMesh->getVAttributeSizePerVertex(m_colorAttributeIndex);
+    if (values == nullptr || settings.m_colorTable.Num() != ColorTableSize)
+        return;
+
+    // Attribute -> table entry: one scale/bias, then a clamped lookup
+    const float range = settings.m_colorRangeMax - settings.m_colorRangeMin;
+    const float scale = FMath::Abs(range) > UE_SMALL_NUMBER ? (ColorTableSize - 1) / range : 0.0f;
+    const int32* gather = m_sofaVertexIds.Num() == nbrV ? m_sofaVertexIds.GetData() : nullptr;
+    const int32 component = settings.m_colorAttributeComponent;
+    m_colors.SetNumUninitialized(nbrV, EAllowShrinking::No);
+    for (int32 i = 0; i < nbrV; i++)
+    {
+        const float* value = values + (gather ? gather[i] : i) * sizePerVertex;
+        float x = 0.0f;
+        if (component >= 0)
+        {
+            x = value[component];
+        }
+        else
+        {
+            for (int32 c = 0; c < sizePerVertex; c++)
+            {
+                x += value[c] * value[c];
+            }
+            x = FMath::Sqrt(x);
+        }
+
+        const int32 entry = FMath::Clamp(FMath::RoundToInt((x - settings.m_colorRangeMin) * scale), 0, ColorTableSize - 1);
+        m_colors[i] = settings.m_colorTable[entry];
+    }
+
+    m_hasPendingColors = true;
+}
+
+
+bool FSofaMeshSection::hasMovedSinceUpload(const float* sofaVertices, int32 nbrV, float epsilon)
+{
+    SCOPE_CYCLE_COUNTER(STAT_SofaVisualMeshDirty);
+
+    // No reference yet (detection just enabled), everything moved
+    if (m_uploadedPositions.Num() != nbrV * 3)
+    {
+        m_uploadedPositions.Reset(nbrV * 3);
+        m_uploadedPositions.Append(sofaVertices, nbrV * 3);
+        return true;
+    }
+
+    // The section is always uploaded whole, so the compare stops at the first moved vertex and the reference becomes
+    // the uploaded positions. A resting mesh is fully scanned, sub epsilon drift accumulates until it is caught
+    const VectorRegister4Float vEpsilon = VectorSetFloat1(epsilon);
+    const float* reference = m_uploadedPositions.GetData();
+    for (int32 v = 0; v < nbrV; v++)
+    {
+        const VectorRegister4Float vDelta = VectorAbs(VectorSubtract(VectorLoadFloat3(sofaVertices + v * 3), VectorLoadFloat3(reference + v * 3)));
+        if (VectorAnyGreaterThan(vDelta, vEpsilon))
+        {
+            FMemory::Memcpy(m_uploadedPositions.GetData(), sofaVertices, nbrV * 3 * sizeof(float));
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void FSofaMeshSection::buildSeamMap()
+{
+    // Runs after optimizeVertexOrder so the map is expressed in the final render order
+    const int32 nbrV = m_vertices.Num();
+    const bool reordered = m_sofaVertexIds.Num() == nbrV;
+
+    TMap<FVector, int32> uniqueIds;
+    uniqueIds.Reserve(nbrV);
+    m_renderToUnique.SetNumUninitialized(nbrV);
+    for (int32 i = 0; i < nbrV; i++)
+    {
+        // Exact compare: SOFA copies the same position into every duplicate of a seam vertex.
+        // Coincident vertices that are not duplicates (a slit, two touching parts) are welded too, which is why the setting is opt-in
+        const int32* existing = uniqueIds.Find(m_vertices[i]);
+        if (existing)
+        {
+            m_renderToUnique[i] = *existing;
+        }
+        else
+        {
+            m_renderToUnique[i] = m_uniqueSofaIds.Num();
+            uniqueIds.Add(m_vertices[i], m_uniqueSofaIds.Num());
+            m_uniqueSofaIds.Add(reordered ? m_sofaVertexIds[i] : i);
+        }
+    }
+
+    const int32 nbrUnique = m_uniqueSofaIds.Num();
+    UE_LOG(SUnreal_log, Log, TEXT("[SOFA] FSofaMeshSection::buildSeamMap '%s' - %d render vertices, %d unique positions"), *FString(m_sofaMesh->getName()), nbrV, nbrUnique);
+
+    // No seam, the direct path is cheaper than going through the map
+    if (nbrUnique == nbrV)
+    {
+        m_uniqueSofaIds.Reset();
+        m_renderToUnique.Reset();
+    }
+    m_uniquePositions.Reset(nbrUnique);
+}
+
+
+void FSofaMeshSection::computeNormals(bool inverseNormal)
+{
+    SCOPE_CYCLE_COUNTER(STAT_SofaVisualMeshNormals);
+
+    const int32 nbrV = m_vertices.Num();
+    if (m_vertexNormals.getNbVertices() != nbrV)
+        return;
+
+    m_normals.SetNumUninitialized(nbrV, EAllowShrinking::No);
+    m_vertexNormals.compute(
+        [this](int32 v) -> const FVector& { return m_vertices[v]; },
+        m_triangles.GetData(),
+        [](int32 count, const auto& body) { ParallelFor(count, body); },
+        [this](int32 v, double x, double y, double z) { m_normals[v] = FVector(x, y, z); },
+        inverseNormal ? -1.0 : 1.0);
+}
+
+
+void FSofaMeshSection::buildTangentSetup()
+{
+    const int32 nbrTri = m_triangles.Num() / 3;
+    m_triTangentCoeffs.SetNumUninitialized(nbrTri);
+    m_faceTangents.SetNumUninitialized(nbrTri);
+    m_faceBitangents.SetNumUninitialized(nbrTri);
+
+    for (int32 t = 0; t < nbrTri; t++)
+    {
+        const FVector2D& uv0 = m_UV0[m_triangles[t * 3]];
+        const FVector2D& uv1 = m_UV0[m_triangles[t * 3 + 1]];
+        const FVector2D& uv2 = m_UV0[m_triangles[t * 3 + 2]];
+
+        const float du1 = uv1.X - uv0.X;
+        const float dv1 = uv1.Y - uv0.Y;
+        const float du2 = uv2.X - uv0.X;
+        const float dv2 = uv2.Y - uv0.Y;
+
+        // Degenerate UV triangles do not contribute to the vertex tangents
+        const float det = du1 * dv2 - du2 * dv1;
+        const float r = FMath::Abs(det) > UE_SMALL_NUMBER ? 1.0f / det : 0.0f;
+        m_triTangentCoeffs[t] = FVector4f(dv2 * r, -dv1 * r, -du2 * r, du1 * r);
+    }
+}
+
+
+void FSofaMeshSection::computeTangents()
+{
+    SCOPE_CYCLE_COUNTER(STAT_SofaVisualMeshTangents);
+
+    const int32 nbrV = m_vertices.Num();
+    const int32 nbrTri = m_triTangentCoeffs.Num();
+    if (m_vertexNormals.getNbVertices() != nbrV || m_normals.Num() != nbrV || nbrTri * 3 != m_triangles.Num())
+        return;
+
+    // Per triangle pass: only two edge vectors and the precomputed UV terms, no branch and no division
+    ParallelFor(nbrTri, [this](int32 t)
+    {
+        const FVector& p0 = m_vertices[m_triangles[t * 3]];
+        const FVector e1 = m_vertices[m_triangles[t * 3 + 1]] - p0;
+        const FVector e2 = m_vertices[m_triangles[t * 3 + 2]] - p0;
+        const FVector4f& k = m_triTangentCoeffs[t];
+        m_faceTangents[t] = e1 * k.X + e2 * k.Y;
+        m_faceBitangents[t] = e1 * k.Z + e2 * k.W;
+    });
+
+    // Per vertex gather through the same CSR adjacency as the normals, then Gram-Schmidt against the normal.
+    // The adjacency is welded across seams while the UVs are not: only the triangles using this render vertex count
+    m_tangents.SetNum(nbrV, EAllowShrinking::No);
+    ParallelFor(nbrV, [this](int32 v)
+    {
+        FVector tangent = FVector::ZeroVector;
+        FVector bitangent = FVector::ZeroVector;
+        const std::vector<int>& vertexTriangles = m_vertexNormals.getVertexTriangles();
+        const int32 w = m_vertexNormals.getWeldedVertex(v);
+        for (int32 k = m_vertexNormals.getFirstTriangle(w); k < m_vertexNormals.getFirstTriangle(w + 1); k++)
+        {
+            const int32 t = vertexTriangles[k];
+            if (m_triangles[t * 3] != v && m_triangles[t * 3 + 1] != v && m_triangles[t * 3 + 2] != v)
+                continue;
+            tangent += m_faceTangents[t];
+            bitangent += m_faceBitangents[t];
+        }
+
+        const FVector& n = m_normals[v];
+        tangent = (tangent - n * FVector::DotProduct(n, tangent)).GetSafeNormal();
+
+        // Same handedness convention as UKismetProceduralMeshLibrary::CalculateTangentsForMesh: (TangentZ ^ TangentX) | BitangentY < 0
+        m_tangents[v].TangentX = tangent;
+        m_tangents[v].bFlipTangentY = FVector::DotProduct(FVector::CrossProduct(n, tangent), bitangent) < 0.0;
+    });
+}
+
+
+void FSofaMeshSection::computeBoundingBox()
+{
+    m_min = FVector(UE_BIG_NUMBER);
+    m_max = FVector(-UE_BIG_NUMBER);
+    for (const FVector& v : m_vertices)
+    {
+        m_min.X = FMath::Min(m_min.X, v.X);
+        m_min.Y = FMath::Min(m_min.Y, v.Y);
+        m_min.Z = FMath::Min(m_min.Z, v.Z);
+
+        m_max.X = FMath::Max(m_max.X, v.X);
+        m_max.Y = FMath::Max(m_max.Y, v.Y);
+        m_max.Z = FMath::Max(m_max.Z, v.Z);
+    }
+}
+
+
+void FSofaMeshSection::recomputeUV()
+{
+    FVector range = m_max - m_min;
+    
+    // Avoid division by zero
+    if (range.X == 0) range.X = 1;
+    if (range.Y == 0) range.Y = 1;
+    if (range.Z == 0) range.Z = 1;
+
+    m_UV0.Reset(m_vertices.Num());
+    for (const FVector& v : m_vertices)
+    {
+        // Simple planar UV mapping based on XY coordinates
+        float u = (v.X - m_min.X) / range.X;
+        float vCoord = (v.Y - m_min.Y) / range.Y;
+        m_UV0.Add(FVector2D(u, vCoord));
+    }
+}
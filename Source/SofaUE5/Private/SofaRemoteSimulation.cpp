@@ -0,0 +1,283 @@
+/*****************************************************************************
+ *                 - Copyright (C) - 2022 - InfinyTech3D -                   *
+ *                                                                           *
+ * This file is part of the SofaUE5-Renderer asset from InfinyTech3D         *
+ *                                                                           *
+ * GNU General Public License Usage:                                         *
+ * This file may be used under the terms of the GNU General                  *
+ * Public License version 3. The licenses are as published by the Free       *
+ * Software Foundation and appearing in the file LICENSE.GPL3 included in    *
+ * the packaging of this file. Please review the following information to    *
+ * ensure the GNU General Public License requirements will be met:           *
+ * https://www.gnu.org/licenses/gpl-3.0.html.                                *
+ *                                                                           *
+ * Commercial License Usage:                                                 *
+ * Licensees holding valid commercial license from InfinyTech3D may use this *
+ * file in accordance with the commercial license agreement provided with    *
+ * the Software or, alternatively, in accordance with the terms contained in *
+ * a written agreement between you and InfinyTech3D. For further information *
+ * on the licensing terms and conditions, contact: contact@infinytech3d.com  *
+ *                                                                           *
+ * Authors: see Authors.txt                                                  *
+ * Further information: https://infinytech3d.com                             *
+ ****************************************************************************/
+#include "SofaRemoteSimulation.h"
+#include "SofaUE5.h"
+#include "HAL/PlatformTime.h"
+#include "Misc/Paths.h"
+
+FSofaRemoteSimulation::~FSofaRemoteSimulation()
+{
+    stop();
+}
+
+bool FSofaRemoteSimulation::start(const FString& hostPath, const FString& pluginDir, int32 maxVertices, int32 maxTriangles, float timeoutSeconds, float maxCommandSeconds)
+{
+    stop();
+    m_timeoutSeconds = FMath::Max(timeoutSeconds, 0.1f);
+
+    // One region per host, the pid and cycle counter keep names unique across contexts and restarts
+    const FString regionName = FString::Printf(TEXT("SofaUE5_%u_%llu"), FPlatformProcess::GetCurrentProcessId(), FPlatformTime::Cycles64());
+    const SIZE_T regionSize = sofaShmRegionSize(uint32(maxVertices), uint32(maxTriangles));
+    m_region = FPlatformMemory::MapNamedSharedMemoryRegion(regionName, true,
+        FPlatformMemory::ESharedMemoryAccess::Read | FPlatformMemory::ESharedMemoryAccess::Write, regionSize);
+    if (m_region == nullptr)
+    {
+        UE_LOG(SUnreal_log, Error, TEXT("[SOFA] FSofaRemoteSimulation: could not create a shared memory region of %llu bytes"), uint64(regionSize));
+        return false;
+    }
+    sofaShmInitRegion(m_region->GetAddress(), uint32(maxVertices), uint32(maxTriangles));
+    m_header = static_cast<SofaPhysicsShmHeader*>(m_region->GetAddress());
+
+    // The host watches this process and exits when it is gone, even if the editor crashes without calling stop
+    const FString params = FString::Printf(TEXT("%s \"%s\" %f %u"), *regionName, *pluginDir, FMath::Max(maxCommandSeconds, m_timeoutSeconds), FPlatformProcess::GetCurrentProcessId());
+    m_process = FPlatformProcess::CreateProc(*hostPath, *params, false, true, true, nullptr, 0, *FPaths::GetPath(hostPath), nullptr);
+    if (!m_process.IsValid())
+    {
+        UE_LOG(SUnreal_log, Error, TEXT("[SOFA] FSofaRemoteSimulation: could not start %s"), *hostPath);
+        stop();
+        return false;
+    }
+
+    // Plugin loading happens before the host loop starts beating, so it gets a longer grace period
+    const double deadline = FPlatformTime::Seconds() + FMath::Max(m_timeoutSeconds * 4.0, 30.0);
+    while (m_header->hostState.load(std::memory_order_acquire) == SOFA_SHM_HOST_STARTING)
+    {
+        if (!FPlatformProcess::IsProcRunning(m_process) || FPlatformTime::Seconds() > deadline)
+        {
+            UE_LOG(SUnreal_log, Error, TEXT("[SOFA] FSofaRemoteSimulation: host did not initialize SOFA"));
+            stop();
+            return false;
+        }
+        FPlatformProcess::Sleep(0.01f);
+    }
+
+    m_lastHeartbeat = m_header->heartbeat.load(std::memory_order_relaxed);
+    m_lastHeartbeatTime = FPlatformTime::Seconds();
+    UE_LOG(SUnreal_log, Log, TEXT("[SOFA] FSofaRemoteSimulation: host started on region %s (%.1f MB)"), *regionName, double(regionSize) / (1024.0 * 1024.0));
+    return true;
+}
+
+void FSofaRemoteSimulation::stop()
+{
+    if (m_process.IsValid())
+    {
+        if (m_header && FPlatformProcess::IsProcRunning(m_process))
+        {
+            sendCommand(SOFA_SHM_CMD_QUIT);
+            const double deadline = FPlatformTime::Seconds() + 1.0;
+            while (FPlatformProcess::IsProcRunning(m_process) && FPlatformTime::Seconds() < deadline)
+                FPlatformProcess::Sleep(0.01f);
+        }
+        if (FPlatformProcess::IsProcRunning(m_process))
+            FPlatformProcess::TerminateProc(m_process, true);
+        FPlatformProcess::CloseProc(m_process);
+        m_process.Reset();
+    }
+
+    if (m_region)
+    {
+        FPlatformMemory::UnmapNamedSharedMemoryRegion(m_region);
+        m_region = nullptr;
+    }
+    m_header = nullptr;
+    m_nextCommandId = 1;
+    m_pendingStepId = 0;
+    m_latencyPending = false;
+}
+
+bool FSofaRemoteSimulation::isAlive()
+{
+    if (m_header == nullptr || !m_process.IsValid() || !FPlatformProcess::IsProcRunning(m_process))
+        return false;
+
+    const uint64 heartbeat = m_header->heartbeat.load(std::memory_order_relaxed);
+    const double now = FPlatformTime::Seconds();
+    if (heartbeat != m_lastHeartbeat)
+    {
+        m_lastHeartbeat = heartbeat;
+        m_lastHeartbeatTime = now;
+    }
+    return now - m_lastHeartbeatTime < m_timeoutSeconds;
+}
+
+uint32 FSofaRemoteSimulation::sendCommand(uint32 type, const double* values, const char* text)
+{
+    if (m_header == nullptr)
+        return 0;
+
+    SofaPhysicsShmCommand command;
+    FMemory::Memzero(command);
+    command.type = type;
+    command.id = m_nextCommandId;
+    if (values)
+        FMemory::Memcpy(command.values, values, sizeof(command.values));
+    if (text)
+        FCStringAnsi::Strncpy(command.text, text, SOFA_SHM_TEXT_SIZE);
+
+    if (!sofaShmPushCommand(m_header, command))
+        return 0;
+    return m_nextCommandId++;
+}
+
+bool FSofaRemoteSimulation::waitForCommand(uint32 id)
+{
+    while (id != 0 && m_header->lastCommandId.load(std::memory_order_acquire) < id)
+    {
+        if (!isAlive())
+            return false;
+        FPlatformProcess::YieldThread();
+    }
+    return id != 0;
+}
+
+bool FSofaRemoteSimulation::load(const FString& scenePath)
+{
+    // hostState may still say LOADED for the previous scene, the command id tells when this load is done
+    const uint32 id = sendCommand(SOFA_SHM_CMD_LOAD, nullptr, TCHAR_TO_UTF8(*scenePath));
+    m_lastHeartbeatTime = FPlatformTime::Seconds();
+    if (!waitForCommand(id))
+        return false;
+
+    return m_header->hostState.load(std::memory_order_acquire) == SOFA_SHM_HOST_LOADED;
+}
+
+bool FSofaRemoteSimulation::step()
+{
+    // Queuing more would let the latency grow without bound when the host is slower than the game
+    if (m_header == nullptr || m_header->lastCommandId.load(std::memory_order_acquire) < m_pendingStepId)
+        return false;
+
+    const uint32 id = sendCommand(SOFA_SHM_CMD_STEP);
+    if (id == 0)
+        return false;
+
+    m_pendingStepId = id;
+    m_pendingStepTime = FPlatformTime::Seconds();
+    m_latencyPending = true;
+    return true;
+}
+
+void FSofaRemoteSimulation::reset()
+{
+    sendCommand(SOFA_SHM_CMD_RESET);
+}
+
+void FSofaRemoteSimulation::setTimeStep(double dt)
+{
+    const double values[3] = { dt, 0.0, 0.0 };
+    sendCommand(SOFA_SHM_CMD_SET_TIMESTEP, values);
+}
+
+void FSofaRemoteSimulation::setGravity(const FVector& gravity)
+{
+    const double values[3] = { gravity.X, gravity.Y, gravity.Z };
+    sendCommand(SOFA_SHM_CMD_SET_GRAVITY, values);
+}
+
+void FSofaRemoteSimulation::wakeUp()
+{
+    sendCommand(SOFA_SHM_CMD_WAKE_UP);
+}
+
+int32 FSofaRemoteSimulation::getNbMeshes() const
+{
+    if (m_header == nullptr || m_header->hostState.load(std::memory_order_acquire) != SOFA_SHM_HOST_LOADED)
+        return 0;
+    return int32(m_header->nbMeshes);
+}
+
+const SofaPhysicsShmMesh* FSofaRemoteSimulation::getMesh(int32 meshIndex) const
+{
+    return (meshIndex >= 0 && meshIndex < getNbMeshes()) ? &m_header->meshes[meshIndex] : nullptr;
+}
+
+int32 FSofaRemoteSimulation::findMesh(const FString& name) const
+{
+    // Same matching as ASofaContext::getOutputMeshByName: exact, then loose for names typed by hand
+    const int32 nbMeshes = getNbMeshes();
+    for (int32 i = 0; i < nbMeshes; i++)
+    {
+        if (name.Equals(UTF8_TO_TCHAR(m_header->meshes[i].name), ESearchCase::CaseSensitive))
+            return i;
+    }
+    for (int32 i = 0; i < nbMeshes; i++)
+    {
+        const FString meshName = UTF8_TO_TCHAR(m_header->meshes[i].name);
+        if (meshName.Equals(name, ESearchCase::IgnoreCase) || meshName.Contains(name))
+            return i;
+    }
+    return INDEX_NONE;
+}
+
+const uint32* FSofaRemoteSimulation::getIndices(const SofaPhysicsShmMesh& mesh) const
+{
+    return sofaShmIndices(m_header) + mesh.firstIndex;
+}
+
+const float* FSofaRemoteSimulation::getTexCoords(const SofaPhysicsShmMesh& mesh) const
+{
+    return sofaShmTexCoords(m_header) + SIZE_T(mesh.firstVertex) * 2;
+}
+
+bool FSofaRemoteSimulation::acquireLatestFrame(FFrameView& view)
+{
+    if (m_header == nullptr)
+        return false;
+
+    const uint64 frameId = m_header->latestFrame.load(std::memory_order_acquire);
+    if (frameId == 0)
+        return false;
+
+    SofaPhysicsShmFrame* frame = sofaShmFrame(m_header, frameId);
+    view.sequence = frame->sequence.load(std::memory_order_acquire);
+    // The host already moved on to this slot again, the caller retries next frame
+    if ((view.sequence & 1) != 0 || frame->frameId != frameId)
+        return false;
+
+    view.frame = frame;
+    view.positions = sofaShmFramePositions(frame);
+    view.normals = view.positions + SIZE_T(m_header->maxVertices) * 3;
+
+    m_stepDurationMs = float(frame->stepDurationMs);
+    if (m_latencyPending && frame->lastCommandId >= m_pendingStepId)
+    {
+        m_latencyMs = float((FPlatformTime::Seconds() - m_pendingStepTime) * 1000.0);
+        m_latencyPending = false;
+    }
+    return true;
+}
+
+bool FSofaRemoteSimulation::isFrameIntact(const FFrameView& view) const
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return view.frame && view.frame->sequence.load(std::memory_order_relaxed) == view.sequence;
+}
+
+FString FSofaRemoteSimulation::getError() const
+{
+    if (m_header == nullptr)
+        return FString();
+    FUTF8ToTCHAR error(m_header->error, FCStringAnsi::Strnlen(m_header->error, SOFA_SHM_TEXT_SIZE));
+    return FString(error.Length(), error.Get());
+}
@@ -0,0 +1,58 @@
+/*****************************************************************************
+ *                 - Copyright (C) - 2022 - InfinyTech3D -                   *
+ *                                                                           *
+ * This file is part of the SofaUE5-Renderer asset from InfinyTech3D         *
+ *                                                                           *
+ * GNU General Public License Usage:                                         *
+ * This file may be used under the terms of the GNU General                  *
+ * Public License version 3. The licenses are as published by the Free       *
+ * Software Foundation and appearing in the file LICENSE.GPL3 included in    *
+ * the packaging of this file. Please review the following information to    *
+ * ensure the GNU General Public License requirements will be met:           *
+ * https://www.gnu.org/licenses/gpl-3.0.html.                                *
+ *                                                                           *
+ * Commercial License Usage:                                                 *
+ * Licensees holding valid commercial license from InfinyTech3D may use this *
+ * file in accordance with the commercial license agreement provided with    *
+ * the Software or, alternatively, in accordance with the terms contained in *
+ * a written agreement between you and InfinyTech3D. For further information *
+ * on the licensing terms and conditions, contact: contact@infinytech3d.com  *
+ *                                                                           *
+ * Authors: see Authors.txt                                                  *
+ * Further information: https://infinytech3d.com                             *
+ ****************************************************************************/
+#include "SofaTriangleBVH.h"
+
+namespace
+{
+    /** Vertex functor of SofaPhysicsTriangleBVH over a UE array */
+    auto readVertices(const TArray<FVector>& vertices)
+    {
+        return [&vertices](int v) -> const FVector& { return vertices[v]; };
+    }
+}
+
+void FSofaTriangleBVH::build(const TArray<FVector>& vertices, const TArray<int32>& triangles)
+{
+    m_tree.build(readVertices(vertices), triangles.GetData(), triangles.Num() / 3);
+}
+
+void FSofaTriangleBVH::refit(const TArray<FVector>& vertices)
+{
+    m_tree.refit(readVertices(vertices));
+}
+
+bool FSofaTriangleBVH::raycast(const TArray<FVector>& vertices, const FVector& origin, const FVector& direction, double maxDistance, FSofaRayHit& hit) const
+{
+    const double rayOrigin[3] = { origin.X, origin.Y, origin.Z };
+    const double rayDirection[3] = { direction.X, direction.Y, direction.Z };
+    SofaPhysicsTriangleBVH<double>::Hit treeHit;
+    if (!m_tree.raycast(readVertices(vertices), rayOrigin, rayDirection, maxDistance, treeHit))
+        return false;
+
+    hit.distance = treeHit.distance;
+    hit.triangle = treeHit.triangle;
+    hit.u = float(treeHit.u);
+    hit.v = float(treeHit.v);
+    return true;
+}
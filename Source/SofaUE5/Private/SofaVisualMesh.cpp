@@ -24,41 +24,131 @@
 #include "SofaVisualMesh.h"
 #include "SofaUE5.h"
 #include "SofaContext.h"
+#include "SofaRemoteSimulation.h"
 #include "SofaUE5Library/SofaPhysicsAPI.h"
-#include "Kismet/GameplayStatics.h"
+#include "EngineUtils.h"
+#include "Curves/CurveLinearColor.h"
+#include "Async/ParallelFor.h"
 
 // Sets default values
 ASofaVisualMesh::ASofaVisualMesh()
     : m_isStatic(false)
-    , m_min(FVector(100000, 100000, 100000))
-    , m_max(FVector(-100000, -100000, -100000))
 {
     UE_LOG(SUnreal_log, Warning, TEXT("##### ASofaVisualMesh::ASofaVisualMesh() ####"));
-    // Set this actor to call Tick() every frame.  You can turn this off to improve performance if you don't need it.
-    PrimaryActorTick.bCanEverTick = true;
+    // No tick: ASofaContext updates all its bound meshes right after stepping, see ASofaContext::updateVisualMeshes
+    PrimaryActorTick.bCanEverTick = false;
 
-    mesh = CreateDefaultSubobject<UProceduralMeshComponent>(TEXT("GeneratedMesh"));
+    mesh = CreateDefaultSubobject<USofaMeshComponent>(TEXT("GeneratedMesh"));
     RootComponent = mesh;
 }
 
 void ASofaVisualMesh::setSofaMesh(SofaPhysicsOutputMesh* sofaMesh)
 {
-    m_sofaMesh = sofaMesh;
+    setSofaMeshes({ sofaMesh });
+}
+
+void ASofaVisualMesh::setSofaMeshes(const TArray<SofaPhysicsOutputMesh*>& sofaMeshes)
+{
+    m_sections.Reset(sofaMeshes.Num());
+    m_pendingSections.Reset();
+    m_sectionNames.Reset(sofaMeshes.Num());
+    for (SofaPhysicsOutputMesh* sofaMesh : sofaMeshes)
+    {
+        if (sofaMesh == nullptr)
+            continue;
+
+        m_sections.Emplace(sofaMesh, m_sections.Num());
+        m_sectionNames.Add(FString(sofaMesh->getName()));
+    }
     createMesh();
 }
 
+void ASofaVisualMesh::setRemoteMesh(FSofaRemoteSimulation* remote, int32 meshIndex)
+{
+    m_sections.Reset();
+    m_pendingSections.Reset();
+    m_sectionNames.Reset();
+    m_remote = remote;
+    m_remoteMeshIndex = meshIndex;
+    m_remoteFrameId = 0;
+    mesh->ClearAllMeshSections();
+
+    const SofaPhysicsShmMesh* remoteMesh = remote ? remote->getMesh(meshIndex) : nullptr;
+    if (remoteMesh == nullptr)
+        return;
+    m_sectionNames.Add(FString(UTF8_TO_TCHAR(remoteMesh->name)));
+
+    // Topology is read once from the shared memory, it only changes with the next load
+    const int32 nbrV = int32(remoteMesh->nbVertices);
+    const int32 nbrIndices = int32(remoteMesh->nbTriangles) * 3;
+    const uint32* indices = remote->getIndices(*remoteMesh);
+    const float* texCoords = remote->getTexCoords(*remoteMesh);
+    TArray<int32> triangles;
+    triangles.SetNumUninitialized(nbrIndices);
+    for (int32 i = 0; i < nbrIndices; i++)
+    {
+        triangles[i] = int32(indices[i]);
+    }
+    TArray<FVector2D> UV0;
+    UV0.SetNumUninitialized(nbrV);
+    for (int32 i = 0; i < nbrV; i++)
+    {
+        UV0[i] = FVector2D(texCoords[i * 2], texCoords[i * 2 + 1]);
+    }
+
+    m_remoteVertices.SetNumZeroed(nbrV);
+    m_remoteNormals.SetNumZeroed(nbrV);
+    readRemoteFrame();
+
+    mesh->bUseAsyncCooking = (m_collisionMode == ESofaCollisionMode::AsyncCooked);
+    mesh->setSimulationBounds(m_remoteBounds, false);
+    mesh->CreateMeshSection(0, m_remoteVertices, triangles, m_remoteNormals, UV0, TArray<FColor>(), TArray<FProcMeshTangent>(), m_collisionMode == ESofaCollisionMode::AsyncCooked);
+
+    UE_LOG(SUnreal_log, Warning, TEXT("[SOFA] ASofaVisualMesh::setRemoteMesh - Created remote section '%s' for '%s'"), *m_sectionNames[0], *GetName());
+}
+
+bool ASofaVisualMesh::readRemoteFrame()
+{
+    FSofaRemoteSimulation::FFrameView view;
+    const SofaPhysicsShmMesh* remoteMesh = m_remote ? m_remote->getMesh(m_remoteMeshIndex) : nullptr;
+    if (remoteMesh == nullptr || !m_remote->acquireLatestFrame(view) || view.frame->frameId == m_remoteFrameId)
+        return false;
+
+    // Read in place, the seqlock check below tells if the host rewrote the slot meanwhile
+    const float* positions = view.positions + SIZE_T(remoteMesh->firstVertex) * 3;
+    const float* normals = view.normals + SIZE_T(remoteMesh->firstVertex) * 3;
+    const float sign = m_inverseNormal ? -1.0f : 1.0f;
+    FBox bounds(ForceInit);
+    for (int32 i = 0; i < m_remoteVertices.Num(); i++)
+    {
+        m_remoteVertices[i] = FVector(positions[i * 3], positions[i * 3 + 1], positions[i * 3 + 2]);
+        m_remoteNormals[i] = FVector(sign * normals[i * 3], sign * normals[i * 3 + 1], sign * normals[i * 3 + 2]);
+        bounds += m_remoteVertices[i];
+    }
+    if (!m_remote->isFrameIntact(view))
+        return false;
+
+    m_remoteFrameId = view.frame->frameId;
+    m_remoteBounds = bounds;
+    return true;
+}
+
+void ASofaVisualMesh::updateFromRemote()
+{
+    if (m_remote == nullptr || m_isStatic || !readRemoteFrame())
+        return;
+
+    mesh->setSimulationBounds(m_remoteBounds, false);
+    mesh->UpdateMeshSection(0, m_remoteVertices, m_remoteNormals, TArray<FVector2D>(), TArray<FColor>(), TArray<FProcMeshTangent>());
+}
+
 void ASofaVisualMesh::BeginPlay()
 {
     Super::BeginPlay();
     UE_LOG(SUnreal_log, Warning, TEXT("[SOFA] SofaVisualMesh::BeginPlay() called for '%s'"), *GetName());
-    
-    // IMPORTANT: Clear the mesh pointer so we reconnect to the new API
-    // When Play starts, SofaContext recreates its API, invalidating our old pointer
-    if (m_sofaMesh != nullptr)
-    {
-        UE_LOG(SUnreal_log, Warning, TEXT("[SOFA] Clearing stale mesh pointer for '%s' - will reconnect to new API"), *MeshName);
-        m_sofaMesh = nullptr;
-    }
+
+    // Stale pointers are cleared by the context before it recreates its API (see ASofaContext::createSofaContext),
+    // and the new mesh is bound through OnSceneLoaded, so nothing to do here.
 }
 
 // This is called when actor is spawned (at runtime or when you drop it into the world in editor)
@@ -73,244 +163,354 @@ void ASofaVisualMesh::PostLoad()
     Super::PostLoad();
 }
 
-void ASofaVisualMesh::Tick( float DeltaTime )
+void ASofaVisualMesh::PostInitializeComponents()
 {
-    Super::Tick( DeltaTime );
+    Super::PostInitializeComponents();
 
-    // Try to connect to SOFA mesh if not connected yet
-    if (m_sofaMesh == nullptr)
+    // Register once to the context, binding is then resolved when its scene load completes
+    ASofaContext* context = resolveContext();
+    if (context)
     {
-        // Auto-detect SofaContext if not set
-        if (!SofaContextRef)
-        {
-            // First try immediate parent
-            AActor* Parent = GetAttachParentActor();
-            if (Parent)
-            {
-                SofaContextRef = Cast<ASofaContext>(Parent);
-            }
-            
-            // If not found, search for any SofaContext in the level
-            if (!SofaContextRef)
-            {
-                TArray<AActor*> FoundActors;
-                UGameplayStatics::GetAllActorsOfClass(GetWorld(), ASofaContext::StaticClass(), FoundActors);
-                if (FoundActors.Num() > 0)
-                {
-                    SofaContextRef = Cast<ASofaContext>(FoundActors[0]);
-                    UE_LOG(SUnreal_log, Warning, TEXT("[SOFA] SofaVisualMesh: Auto-detected SofaContext '%s' in level"), *SofaContextRef->GetName());
-                }
-            }
-        }
-
-        if (SofaContextRef)
-        {
-            if (SofaContextRef->isSceneLoaded())
-            {
-                // Use actor name as mesh name if MeshName is empty
-                FString searchName = MeshName.IsEmpty() ? GetActorLabel() : MeshName;
-                UE_LOG(SUnreal_log, Warning, TEXT("[SOFA] SofaVisualMesh::Tick - Looking for mesh '%s'"), *searchName);
-                
-                SofaPhysicsOutputMesh* sofaMesh = SofaContextRef->getOutputMeshByName(searchName);
-                if (sofaMesh)
-                {
-                    UE_LOG(SUnreal_log, Warning, TEXT("[SOFA] SofaVisualMesh: Found mesh '%s', creating visual"), *searchName);
-                    setSofaMesh(sofaMesh);
-                }
-                else
-                {
-                    UE_LOG(SUnreal_log, Warning, TEXT("[SOFA] SofaVisualMesh: Mesh '%s' not found in SOFA scene"), *searchName);
-                }
-            }
-        }
+        context->registerVisualMesh(this);
+        m_registeredContext = context;
+    }
+    else
+    {
+        UE_LOG(SUnreal_log, Warning, TEXT("[SOFA] SofaVisualMesh '%s': no SofaContext found to register to"), *GetName());
     }
-
-    if (!m_isStatic && m_sofaMesh != nullptr)
-        updateMesh();
 }
 
+void ASofaVisualMesh::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+    unregisterFromContext();
+    Super::EndPlay(EndPlayReason);
+}
 
-void ASofaVisualMesh::updateMesh()
-{   
-    if (m_sofaMesh == nullptr)
-        return;
-
-    int nbrV = m_sofaMesh->getNbVertices();
-    if (nbrV <= 0)
-        return;
+void ASofaVisualMesh::Destroyed()
+{
+    unregisterFromContext();
+    Super::Destroyed();
+}
 
-    float* sofaVertices = new float[nbrV * 3];
-    float* sofaNormals = new float[nbrV * 3];
-    m_sofaMesh->getVPositions(sofaVertices);
-    m_sofaMesh->getVNormals(sofaNormals);
+void ASofaVisualMesh::unregisterFromContext()
+{
+    if (ASofaContext* context = m_registeredContext.Get())
+    {
+        context->unregisterVisualMesh(this);
+    }
+    m_registeredContext = nullptr;
+}
 
-    TArray<FVector> vertices;
-    TArray<FVector> normals;
-    vertices.Reserve(nbrV);
-    normals.Reserve(nbrV);
+ASofaContext* ASofaVisualMesh::resolveContext()
+{
+    if (SofaContextRef)
+        return SofaContextRef;
 
-    if (m_inverseNormal)
+    // Spawned by a context, or attached under one
+    SofaContextRef = Cast<ASofaContext>(GetOwner());
+    if (!SofaContextRef)
     {
-        for (int i = 0; i < nbrV; i++)
-        {
-            vertices.Add(FVector(sofaVertices[i * 3], sofaVertices[i * 3 + 1], sofaVertices[i * 3 + 2]));
-            normals.Add(FVector(-sofaNormals[i * 3], -sofaNormals[i * 3 + 1], -sofaNormals[i * 3 + 2]));
-        }
+        SofaContextRef = Cast<ASofaContext>(GetAttachParentActor());
     }
-    else
+
+    // If not found, take the first SofaContext in the level. Only done once, at registration.
+    if (!SofaContextRef && GetWorld())
     {
-        for (int i = 0; i < nbrV; i++)
+        TActorIterator<ASofaContext> it(GetWorld());
+        if (it)
         {
-            vertices.Add(FVector(sofaVertices[i * 3], sofaVertices[i * 3 + 1], sofaVertices[i * 3 + 2]));
-            normals.Add(FVector(sofaNormals[i * 3], sofaNormals[i * 3 + 1], sofaNormals[i * 3 + 2]));
+            SofaContextRef = *it;
+            UE_LOG(SUnreal_log, Warning, TEXT("[SOFA] SofaVisualMesh: Auto-detected SofaContext '%s' in level"), *SofaContextRef->GetName());
         }
     }
 
-    delete[] sofaVertices;
-    delete[] sofaNormals;
+    return SofaContextRef;
+}
 
-    mesh->UpdateMeshSection(0, vertices, normals, TArray<FVector2D>(), TArray<FColor>(), TArray<FProcMeshTangent>());
+FString ASofaVisualMesh::getSofaMeshName() const
+{
+    if (!MeshName.IsEmpty())
+        return MeshName;
+
+    // Use actor name as mesh name if MeshName is empty
+#if WITH_EDITOR
+    return GetActorLabel();
+#else
+    return GetName();
+#endif
 }
 
+void ASofaVisualMesh::setMeshName(const FString& name)
+{
+    MeshName = name;
 
-void ASofaVisualMesh::createMesh()
+    // Registered before the name was known: bind now if the scene is already there, otherwise at its load
+    ASofaContext* context = m_registeredContext.Get();
+    if (context && context->isSceneLoaded() && !m_allSceneMeshes)
+        onSceneLoaded(context);
+}
+
+bool ASofaVisualMesh::isWaitingForMeshName() const
+{
+    // Placed in the level: the actor label is the name. Spawned at runtime: the spawner sets MeshName after SpawnActor registered it
+    return MeshName.IsEmpty() && !m_allSceneMeshes && !IsNetStartupActor();
+}
+
+void ASofaVisualMesh::onSceneLoaded(ASofaContext* context)
 {
-    if (m_sofaMesh == nullptr)
+    if (context == nullptr || !context->isSceneLoaded())
         return;
 
-    int nbrV = m_sofaMesh->getNbVertices();
-    int nbrTri = m_sofaMesh->getNbTriangles();
-    int nbrQuad = m_sofaMesh->getNbQuads();
-    UE_LOG(SUnreal_log, Warning, TEXT("##### ASofaVisualMesh::createMesh:  nbrV: %d | nbrTri: %d | nbrQuad: %d ####"), nbrV, nbrTri, nbrQuad);
+    if (isWaitingForMeshName())
+    {
+        UE_LOG(SUnreal_log, Verbose, TEXT("[SOFA] SofaVisualMesh '%s': no MeshName yet, the lookup waits for setMeshName"), *GetName());
+        return;
+    }
 
-    if (nbrV <= 0)
+    if (FSofaRemoteSimulation* remote = context->getRemoteSimulation())
     {
-        UE_LOG(SUnreal_log, Error, TEXT("[SOFA] ASofaVisualMesh::createMesh - No vertices!"));
+        // One mesh per actor in out-of-process mode, m_allSceneMeshes is not supported there
+        const FString searchName = getSofaMeshName();
+        const int32 meshIndex = remote->findMesh(searchName);
+        if (meshIndex != INDEX_NONE)
+            setRemoteMesh(remote, meshIndex);
+        else
+            UE_LOG(SUnreal_log, Warning, TEXT("[SOFA] SofaVisualMesh: Mesh '%s' not found in the host scene"), *searchName);
         return;
     }
 
-    // Get all info from SofaPhysicsOutputMesh
-    float* sofaVertices = new float[nbrV * 3];
-    float* sofaNormals = new float[nbrV * 3];
-    float* sofaTexCoords = new float[nbrV * 2];
-    int* sofaTriangles = new int[nbrTri * 3];
-    int* sofaQuads = new int[nbrQuad * 4];
-
-    m_sofaMesh->getVPositions(sofaVertices);
-    m_sofaMesh->getVNormals(sofaNormals);
-    m_sofaMesh->getVTexCoords(sofaTexCoords);
-    m_sofaMesh->getTriangles(sofaTriangles);
-    m_sofaMesh->getQuads(sofaQuads);
-
-    // Create Arrays to fill UE buffers
-    TArray<FVector> vertices;
-    TArray<FVector> normals;
-    TArray<FVector2D> UV0;
-    TArray<int32> Triangles;
-    TArray<FLinearColor> vertexColors;
-    TArray<FProcMeshTangent> tangents;
+    if (m_allSceneMeshes)
+    {
+        UE_LOG(SUnreal_log, Warning, TEXT("[SOFA] SofaVisualMesh: Rendering all %d scene meshes as sections of '%s'"), context->getOutputMeshes().Num(), *GetName());
+        setSofaMeshes(context->getOutputMeshes());
+        return;
+    }
 
-    // Fill Unreal Mesh info with SOFA buffers
-    if (m_inverseNormal)
+    const FString searchName = getSofaMeshName();
+    SofaPhysicsOutputMesh* sofaMesh = context->getOutputMeshByName(searchName);
+    if (sofaMesh)
     {
-        for (int i = 0; i < nbrV; i++)
-        {
-            vertices.Add(FVector(sofaVertices[i * 3], sofaVertices[i * 3 + 1], sofaVertices[i * 3 + 2]));
-            normals.Add(FVector(-sofaNormals[i * 3], -sofaNormals[i * 3 + 1], -sofaNormals[i * 3 + 2]));
-            UV0.Add(FVector2D(sofaTexCoords[i * 2], sofaTexCoords[i * 2 + 1]));
-        }
+        UE_LOG(SUnreal_log, Warning, TEXT("[SOFA] SofaVisualMesh: Found mesh '%s', creating visual"), *searchName);
+        setSofaMesh(sofaMesh);
     }
     else
     {
-        for (int i = 0; i < nbrV; i++)
-        {
-            vertices.Add(FVector(sofaVertices[i * 3], sofaVertices[i * 3 + 1], sofaVertices[i * 3 + 2]));
-            normals.Add(FVector(sofaNormals[i * 3], sofaNormals[i * 3 + 1], sofaNormals[i * 3 + 2]));
-            UV0.Add(FVector2D(sofaTexCoords[i * 2], sofaTexCoords[i * 2 + 1]));
-        }
+        UE_LOG(SUnreal_log, Warning, TEXT("[SOFA] SofaVisualMesh: Mesh '%s' not found in SOFA scene"), *searchName);
+    }
+}
+
+void ASofaVisualMesh::clearSofaMesh()
+{
+    // The component keeps its last geometry until the next scene load creates new sections
+    m_sections.Reset();
+    m_pendingSections.Reset();
+    m_remote = nullptr;
+    m_remoteMeshIndex = INDEX_NONE;
+}
+
+void ASofaVisualMesh::refreshColorTable()
+{
+    m_colorTable.Reset();
+}
+
+#if WITH_EDITOR
+void ASofaVisualMesh::PostEditChangeProperty(FPropertyChangedEvent& PropertyChangedEvent)
+{
+    Super::PostEditChangeProperty(PropertyChangedEvent);
+    refreshColorTable();
+}
+#endif
+
+void ASofaVisualMesh::updateColorTable()
+{
+    if (m_colorTable.Num() == FSofaMeshSection::ColorTableSize && m_colorTableCurve == m_colorTransferFunction)
+        return;
+
+    // Bake the transfer function here, curves are not read from the worker threads
+    m_colorTableCurve = m_colorTransferFunction;
+    m_colorTable.SetNumUninitialized(FSofaMeshSection::ColorTableSize);
+    for (int32 i = 0; i < FSofaMeshSection::ColorTableSize; i++)
+    {
+        const float t = float(i) / (FSofaMeshSection::ColorTableSize - 1);
+        const FLinearColor color = m_colorTransferFunction ? m_colorTransferFunction->GetLinearColorValue(t) : FLinearColor::LerpUsingHSV(FLinearColor::Blue, FLinearColor::Red, t);
+        m_colorTable[i] = color.ToFColor(true);
     }
+}
 
-    // Add triangles
-    for (int i = 0; i < nbrTri; i++)
+FSofaMeshSectionSettings ASofaVisualMesh::getSectionSettings()
+{
+    FSofaMeshSectionSettings settings;
+    settings.m_inverseNormal = m_inverseNormal;
+    settings.m_computeNormals = m_computeNormals;
+    settings.m_computeTangents = m_computeTangents;
+    settings.m_optimizeVertexCache = m_optimizeVertexCache;
+    settings.m_streamUniquePositions = m_streamUniquePositions;
+    settings.m_dirtyEpsilon = m_dirtyEpsilon;
+    settings.m_colorAttribute = m_colorAttribute;
+    if (!m_colorAttribute.IsEmpty())
     {
-        Triangles.Add(sofaTriangles[i * 3]);
-        Triangles.Add(sofaTriangles[i * 3 + 1]);
-        Triangles.Add(sofaTriangles[i * 3 + 2]);
+        updateColorTable();
+        settings.m_colorAttributeComponent = m_colorAttributeComponent;
+        settings.m_colorRangeMin = m_colorRangeMin;
+        settings.m_colorRangeMax = m_colorRangeMax;
+        settings.m_colorTable = m_colorTable;
     }
+    settings.m_collisionMode = m_collisionMode;
+    return settings;
+}
 
-    // Add quads as 2 triangles
-    for (int i = 0; i < nbrQuad; i++)
+FBox ASofaVisualMesh::getBounds() const
+{
+    FBox bounds(ForceInit);
+    for (const FSofaMeshSection& section : m_sections)
     {
-        Triangles.Add(sofaQuads[i * 4]);
-        Triangles.Add(sofaQuads[i * 4 + 1]);
-        Triangles.Add(sofaQuads[i * 4 + 2]);
+        const FBox sectionBounds = section.getBounds();
+        if (sectionBounds.Min.X <= sectionBounds.Max.X)
+            bounds += sectionBounds;
+    }
+    return bounds;
+}
 
-        Triangles.Add(sofaQuads[i * 4]);
-        Triangles.Add(sofaQuads[i * 4 + 2]);
-        Triangles.Add(sofaQuads[i * 4 + 3]);
+bool ASofaVisualMesh::prepareUpdate()
+{
+    m_pendingSections.Reset();
+    if (m_isStatic)
+        return false;
+
+    // Nothing moved since the last upload
+    for (int32 i = 0; i < m_sections.Num(); i++)
+    {
+        if (m_sections[i].isOutdated())
+            m_pendingSections.Add(i);
     }
+    if (m_pendingSections.Num() == 0)
+        return false;
 
-    // Recompute UV if not provided
-    bool needUVRecompute = true;
-    for (int i = 0; i < nbrV * 2; i++)
+    // Not on screen: only keep the bounds in sync, without touching the vertices, so the mesh can become visible again.
+    // Deformable collision needs the positions even when hidden, traces do not depend on visibility.
+    if (m_skipUpdateWhenHidden && m_collisionMode != ESofaCollisionMode::Deformable && !mesh->WasRecentlyRendered(m_hiddenDelay))
     {
-        if (sofaTexCoords[i] != 0.0f)
+        bool boundsChanged = false;
+        for (int32 i : m_pendingSections)
         {
-            needUVRecompute = false;
-            break;
+            boundsChanged |= m_sections[i].refreshBoundsFromSofa();
         }
+        if (boundsChanged)
+            mesh->setSimulationBounds(getBounds());
+
+        m_pendingSections.Reset();
+        return false;
     }
 
-    if (needUVRecompute)
+    m_pendingSettings = getSectionSettings();
+    for (int32 i : m_pendingSections)
     {
-        computeBoundingBox(vertices);
-        recomputeUV(vertices, UV0);
+        m_sections[i].markPending();
     }
+    return true;
+}
+
+
+void ASofaVisualMesh::computeUpdate()
+{
+    // Runs on a worker thread, sections do not share any buffer
+    ParallelFor(m_pendingSections.Num(), [this](int32 i)
+    {
+        m_sections[m_pendingSections[i]].compute(m_pendingSettings);
+    });
+}
 
-    // Clean up SOFA buffers
-    delete[] sofaVertices;
-    delete[] sofaNormals;
-    delete[] sofaTexCoords;
-    delete[] sofaTriangles;
-    delete[] sofaQuads;
 
-    // Create the mesh section
-    mesh->CreateMeshSection_LinearColor(0, vertices, Triangles, normals, UV0, vertexColors, tangents, true);
+void ASofaVisualMesh::commitUpdate()
+{
+    if (m_pendingSections.Num() == 0)
+        return;
 
-    UE_LOG(SUnreal_log, Warning, TEXT("[SOFA] ASofaVisualMesh::createMesh - Created mesh with %d vertices, %d triangles"), vertices.Num(), Triangles.Num() / 3);
+    mesh->setSimulationBounds(getBounds(), false);
+    for (int32 i : m_pendingSections)
+    {
+        m_sections[i].commit(mesh, m_pendingSettings);
+    }
+    m_pendingSections.Reset();
 }
 
 
-void ASofaVisualMesh::computeBoundingBox(const TArray<FVector>& vertices)
+void ASofaVisualMesh::createMesh()
 {
-    for (const FVector& v : vertices)
+    mesh->ClearAllMeshSections();
+
+    // Cook the physics shape on a background thread, the mesh has no collision until it is done
+    const FSofaMeshSectionSettings settings = getSectionSettings();
+    mesh->bUseAsyncCooking = (settings.m_collisionMode == ESofaCollisionMode::AsyncCooked);
+    for (FSofaMeshSection& section : m_sections)
     {
-        m_min.X = FMath::Min(m_min.X, v.X);
-        m_min.Y = FMath::Min(m_min.Y, v.Y);
-        m_min.Z = FMath::Min(m_min.Z, v.Z);
+        section.build(settings);
+    }
 
-        m_max.X = FMath::Max(m_max.X, v.X);
-        m_max.Y = FMath::Max(m_max.Y, v.Y);
-        m_max.Z = FMath::Max(m_max.Z, v.Z);
+    // Bounds of all sections are known before the first one is created, so the component bounds are right from the start
+    mesh->setSimulationBounds(getBounds(), false);
+    for (FSofaMeshSection& section : m_sections)
+    {
+        section.createSection(mesh, settings);
     }
+
+    UE_LOG(SUnreal_log, Warning, TEXT("[SOFA] ASofaVisualMesh::createMesh - Created %d section(s) for '%s'"), m_sections.Num(), *GetName());
 }
 
 
-void ASofaVisualMesh::recomputeUV(const TArray<FVector>& vertices, TArray<FVector2D>& UV0)
+bool ASofaVisualMesh::traceDeformedSurface(const FVector& start, const FVector& end, FHitResult& outHit)
 {
-    FVector range = m_max - m_min;
-    
-    // Avoid division by zero
-    if (range.X == 0) range.X = 1;
-    if (range.Y == 0) range.Y = 1;
-    if (range.Z == 0) range.Z = 1;
-
-    UV0.Empty();
-    for (const FVector& v : vertices)
+    outHit = FHitResult(start, end);
+    if (m_collisionMode != ESofaCollisionMode::Deformable)
+        return false;
+
+    // Trace in component space, where the section positions and trees are. Positions only change in ASofaContext::Tick,
+    // on the game thread, so a trace from the game thread always sees a consistent surface.
+    const FTransform& toWorld = mesh->GetComponentTransform();
+    const FVector localStart = toWorld.InverseTransformPosition(start);
+    FVector localDir = toWorld.InverseTransformPosition(end) - localStart;
+    const double localLength = localDir.Size();
+    if (localLength < UE_SMALL_NUMBER)
+        return false;
+    localDir /= localLength;
+
+    FSofaRayHit closestHit;
+    int32 closestSection = INDEX_NONE;
+    double maxDistance = localLength;
+    for (int32 i = 0; i < m_sections.Num(); i++)
     {
-        // Simple planar UV mapping based on XY coordinates
-        float u = (v.X - m_min.X) / range.X;
-        float vCoord = (v.Y - m_min.Y) / range.Y;
-        UV0.Add(FVector2D(u, vCoord));
+        FSofaRayHit hit;
+        if (m_sections[i].raycast(localStart, localDir, maxDistance, hit))
+        {
+            closestHit = hit;
+            closestSection = i;
+            maxDistance = hit.distance;
+        }
     }
+
+    if (closestSection == INDEX_NONE)
+        return false;
+
+    // Hit point and normal from the world space triangle, the context transform has a negative scale
+    const FSofaMeshSection& section = m_sections[closestSection];
+    const FVector a = toWorld.TransformPosition(section.getTriangleVertex(closestHit.triangle, 0));
+    const FVector b = toWorld.TransformPosition(section.getTriangleVertex(closestHit.triangle, 1));
+    const FVector c = toWorld.TransformPosition(section.getTriangleVertex(closestHit.triangle, 2));
+    const FVector location = a * (1.0 - closestHit.u - closestHit.v) + b * closestHit.u + c * closestHit.v;
+    FVector normal = FVector::CrossProduct(b - a, c - a).GetSafeNormal();
+    if (FVector::DotProduct(normal, end - start) > 0.0)
+        normal = -normal;
+
+    outHit.bBlockingHit = true;
+    outHit.Time = closestHit.distance / localLength;
+    outHit.Distance = FVector::Dist(start, location);
+    outHit.Location = location;
+    outHit.ImpactPoint = location;
+    outHit.Normal = normal;
+    outHit.ImpactNormal = normal;
+    outHit.FaceIndex = closestHit.triangle;
+    outHit.Item = section.getSectionIndex();
+    outHit.Component = mesh;
+    outHit.HitObjectHandle = FActorInstanceHandle(this);
+    return true;
 }
@@ -24,10 +24,38 @@
 #pragma once
 
 #include "GameFramework/Actor.h"
+#include "Containers/TripleBuffer.h"
+#include <atomic>
 #include "SofaContext.generated.h"
 
 class SofaPhysicsAPI;
 class SofaPhysicsOutputMesh;
+class ASofaVisualMesh;
+class ASofaContext;
+class FSofaRemoteSimulation;
+
+/** Broadcast each time a SOFA scene load completes, with the context that loaded it */
+DECLARE_MULTICAST_DELEGATE_OneParam(FOnSofaSceneLoaded, ASofaContext*);
+
+/** DOF renumbering applied by SOFA to volumetric meshes at load, values match the API_RENUMBER_* codes */
+UENUM(BlueprintType)
+enum class ESofaDofRenumbering : uint8
+{
+    None = 0,
+    /** Reverse Cuthill-McKee, minimizes the bandwidth of the system matrix */
+    ReverseCuthillMcKee = 1,
+    /** Z-order curve on the rest positions */
+    Morton = 2
+};
+
+/** Priority of the SOFA worker threads, values match the API_THREAD_PRIORITY_* codes + 1 */
+UENUM(BlueprintType)
+enum class ESofaThreadPriority : uint8
+{
+    Low = 0,
+    Normal = 1,
+    High = 2
+};
 
 UCLASS()
 class SOFAUE5_API ASofaContext : public AActor
@@ -57,16 +85,80 @@ public:
     virtual void Tick( float DeltaSeconds ) override;
 
 
+    /** Queued without waiting on SOFA, applied at the beginning of its next step, or at once if the context is not stepping */
     void setDT(float value);
 
+    /** Queued without waiting on SOFA, applied at the beginning of its next step, or at once if the context is not stepping */
     void setGravity(FVector value);
 
+    /** True if Tick steps the in-process simulation, so queued commands are applied by the next step */
+    bool isStepping() const;
+
+    /** Incremented before and after each in-process step, odd while SOFA steps. Any thread */
+    uint32 getStepSequence() const { return m_stepSequence.load(std::memory_order_acquire); }
+
     SofaPhysicsAPI* getSofaAPI() { return m_sofaAPI; }
 
+    /** Host process running the scene in out-of-process mode, null in process */
+    FSofaRemoteSimulation* getRemoteSimulation() const { return m_remote; }
+
     class SofaPhysicsOutputMesh* getOutputMeshByName(const FString& name);
 
+    /** Output meshes of the current scene, in SOFA order */
+    const TArray<SofaPhysicsOutputMesh*>& getOutputMeshes() const { return m_outputMeshes; }
+
     bool isSceneLoaded() const { return m_status > 0; }
 
+    /** Add a visual mesh to the registry. It is bound now if a scene is loaded, else on the next OnSceneLoaded */
+    void registerVisualMesh(ASofaVisualMesh* visualMesh);
+
+    void unregisterVisualMesh(ASofaVisualMesh* visualMesh);
+
+    /** Resume a sleeping simulation, to be called by gameplay code applying external input. Gravity, Dt and reset wake it automatically */
+    UFUNCTION(BlueprintCallable, Category = "Sofa")
+        void wakeSimulation();
+
+    /** True if the simulation fell asleep, see m_sleepVelocityThreshold */
+    UFUNCTION(BlueprintCallable, Category = "Sofa")
+        bool isSimulationSleeping() const;
+
+    /** Ratio between the current solver iteration limits and the scene ones, below 1 when the step budget degraded the quality */
+    UFUNCTION(BlueprintCallable, Category = "Sofa")
+        float getStepQuality() const;
+
+    /** Time step used by the last SOFA step, differs from Dt in adaptive mode */
+    UFUNCTION(BlueprintCallable, Category = "Sofa")
+        float getLastStepDt() const;
+
+    /** Start the haptic thread computing the contact force of a sphere of radius m_hapticToolRadius against the output mesh m_hapticMeshName, at m_hapticRateHz. Returns false if the mesh is not found */
+    UFUNCTION(BlueprintCallable, Category = "Sofa Haptics")
+        bool startHapticLoop();
+
+    UFUNCTION(BlueprintCallable, Category = "Sofa Haptics")
+        void stopHapticLoop();
+
+    /** Game thread: move the haptic tool center, in world space. Device callbacks use setHapticToolLocationFromDevice */
+    UFUNCTION(BlueprintCallable, Category = "Sofa Haptics")
+        void setHapticToolLocation(FVector worldLocation);
+
+    /** Game thread: last force computed by the haptic thread, in world space directions and SOFA force units. Zero when the loop is stopped */
+    UFUNCTION(BlueprintCallable, Category = "Sofa Haptics")
+        FVector getHapticForce();
+
+    /** Any thread while the loop runs: move the haptic tool center, given in the context local space (SOFA space) */
+    void setHapticToolLocalPosition(const FVector& localPosition);
+
+    /** Device thread while the loop runs: move the haptic tool center, in world space, through the context transform published at the last Tick.
+     *  Reads the transform from a triple buffer, so call it and getHapticForceFromDevice from one thread only */
+    void setHapticToolLocationFromDevice(const FVector& worldLocation);
+
+    /** Device thread while the loop runs: same as getHapticForce through the context transform published at the last Tick, from the thread calling setHapticToolLocationFromDevice.
+     *  The force has a single reader, do not call getHapticForce meanwhile */
+    FVector getHapticForceFromDevice();
+
+    /** Broadcast once per successful scene load, registered visual meshes resolve their binding there */
+    FOnSofaSceneLoaded OnSceneLoaded;
+
 public:
     UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters")
         FFilePath filePath;
@@ -83,6 +175,114 @@ public:
     UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters")
         bool m_log = false;
 
+    /** If true, auto-spawn creates a single SofaVisualMesh rendering all output meshes as sections of one component, instead of one actor per mesh */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters")
+        bool m_singleActorRendering = false;
+
+    /** Renumbering of the volumetric DOFs before SOFA initializes the scene, for solver cache locality. Applied on the next scene load */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters")
+        ESofaDofRenumbering m_dofRenumbering = ESofaDofRenumbering::None;
+
+    /** If true, the scene BruteForceBroadPhase is replaced by a sweep and prune broad phase on the collision model bounding boxes. Applied on the next scene load */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters")
+        bool m_upgradeBroadPhase = false;
+
+    /** Velocity (SOFA units/s) under which every DOF must stay for the simulation to fall asleep, and stop costing CPU until woken. 0 disables */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters", meta = (ClampMin = "0.0"))
+        float m_sleepVelocityThreshold = 0.0f;
+
+    /** Number of consecutive quiet steps before the simulation falls asleep */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters", meta = (ClampMin = "1"))
+        int32 m_sleepQuietSteps = 30;
+
+    /** Step time budget in milliseconds. Solver iteration limits are lowered (never above the scene values) to hold it. 0 disables */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters", meta = (ClampMin = "0.0"))
+        float m_stepBudgetMs = 0.0f;
+
+    /** Lowest linear solver iteration limit the step budget may set */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters", meta = (ClampMin = "1", EditCondition = "m_stepBudgetMs > 0"))
+        int32 m_minSolverIterations = 5;
+
+    /** Lowest constraint solver iteration limit the step budget may set */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters", meta = (ClampMin = "1", EditCondition = "m_stepBudgetMs > 0"))
+        int32 m_minConstraintIterations = 50;
+
+    /** If true, Dt is only the initial time step: SOFA grows it while the solvers converge easily and halves it, restarting the step, when they do not */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters")
+        bool m_adaptiveDt = false;
+
+    /** Smallest time step of the adaptive mode */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters", meta = (ClampMin = "0.00001", EditCondition = "m_adaptiveDt"))
+        float m_minDt = 0.001f;
+
+    /** Largest time step of the adaptive mode */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters", meta = (ClampMin = "0.00001", EditCondition = "m_adaptiveDt"))
+        float m_maxDt = 0.04f;
+
+    /** Number of SOFA worker threads including the game thread, 0 for one per core, -1 to keep SOFA's default. Applied when the SOFA API is created */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Threading", meta = (ClampMin = "-1", EditCondition = "!m_useUETaskGraph"))
+        int32 m_sofaWorkerThreads = -1;
+
+    /** Cores the SOFA workers may run on, bit i for core i, 0 for any */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Threading", meta = (EditCondition = "!m_useUETaskGraph"))
+        int64 m_sofaThreadAffinity = 0;
+
+    /** Priority of the SOFA workers, Low leaves the cores to the UE threads first */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Threading", meta = (EditCondition = "!m_useUETaskGraph"))
+        ESofaThreadPriority m_sofaThreadPriority = ESofaThreadPriority::Normal;
+
+    /** If true, SOFA starts no thread of its own and runs its parallel tasks on the UE task graph workers */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Threading")
+        bool m_useUETaskGraph = false;
+
+    /** If true, SOFA runs in a separate SofaPhysicsHost process: a crash or hang of the simulation restarts the host instead of taking the editor down. Applied on the next scene load */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Out Of Process")
+        bool m_outOfProcess = false;
+
+    /** Host executable, SofaPhysicsHost next to the SOFA libraries if empty */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Out Of Process", meta = (EditCondition = "m_outOfProcess"))
+        FFilePath m_hostPath;
+
+    /** Capacity of the shared memory frames, in vertices summed over all output meshes */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Out Of Process", meta = (ClampMin = "1", EditCondition = "m_outOfProcess"))
+        int32 m_hostMaxVertices = 262144;
+
+    /** Capacity of the shared topology, in triangles (a quad counts 2) summed over all output meshes */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Out Of Process", meta = (ClampMin = "1", EditCondition = "m_outOfProcess"))
+        int32 m_hostMaxTriangles = 524288;
+
+    /** Seconds without host heartbeat after which it is considered hung and restarted */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Out Of Process", meta = (ClampMin = "0.1", EditCondition = "m_outOfProcess"))
+        float m_hostTimeoutSeconds = 5.0f;
+
+    /** Longest a single scene load or step may run in the host before it stops beating and is considered hung */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Out Of Process", meta = (ClampMin = "1.0", EditCondition = "m_outOfProcess"))
+        float m_hostMaxCommandSeconds = 120.0f;
+
+    /** Restarts of a failed host before the context gives up, until the next scene load */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Out Of Process", meta = (ClampMin = "0", EditCondition = "m_outOfProcess"))
+        int32 m_hostMaxRestarts = 3;
+
+    /** Delay before the first restart of a failed host, doubled after each restart */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Out Of Process", meta = (ClampMin = "0.0", EditCondition = "m_outOfProcess"))
+        float m_hostRestartDelaySeconds = 1.0f;
+
+    /** Output mesh the haptic tool touches */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Haptics")
+        FString m_hapticMeshName;
+
+    /** Forces computed per second by the haptic thread, independent of the step rate */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Haptics", meta = (ClampMin = "1.0"))
+        float m_hapticRateHz = 1000.0f;
+
+    /** Penalty stiffness of the contact: force per SOFA length unit of penetration */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Haptics", meta = (ClampMin = "0.0"))
+        float m_hapticStiffness = 100.0f;
+
+    /** Radius of the spherical tool, in SOFA length units */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Haptics", meta = (ClampMin = "0.0001"))
+        float m_hapticToolRadius = 1.0f;
+
 protected:
     void catchSofaMessages();
 
@@ -90,12 +290,39 @@ protected:
 
     void loadDefaultPlugin();
 
+    /** Folder of the SOFA libraries, sofa.ini and plugin_list.conf in the plugin binaries */
+    FString getSofaBinariesDir() const;
+
+    /** Out-of-process mode: start a host and load the scene in it */
+    void createRemoteContext();
+
+    /** Out-of-process mode: tear down a failed host and restart it after the backoff, disable the context after m_hostMaxRestarts */
+    void tickHostWatchdog();
+
+    /** Schedule the next host restart, or give up if m_hostMaxRestarts is reached */
+    void scheduleHostRestart();
+
     /** Auto-spawn SofaVisualMesh actors for all SOFA output meshes */
     void SpawnVisualMeshActors();
 
+    /** Spawn one SofaVisualMesh attached to this context, labelled with the given name */
+    ASofaVisualMesh* SpawnVisualMeshActor(const FString& label);
+
     /** Check if there are existing SofaVisualMesh actors referencing this context */
     bool HasExistingVisualMeshes();
 
+    /** Index the output meshes by name and notify registered visual meshes */
+    void onSceneLoadCompleted();
+
+    /** Unbind registered visual meshes before the SOFA API holding their meshes is deleted */
+    void clearVisualMeshBindings();
+
+    /** Update all bound visual meshes after a step: checks on game thread, conversion in parallel, then upload */
+    void updateVisualMeshes();
+
+    /** Apply the queued commands now if no step will, otherwise they would fill the queue until the next play */
+    void applyCommandsIfNotStepping();
+
 private:
     int32 m_dllLoadStatus;
     FString m_apiName;
@@ -105,6 +332,32 @@ private:
     //UPROPERTY(SaveGame)
     SofaPhysicsAPI* m_sofaAPI = nullptr;
     //TSharedPtr<SofaAdvancePhysicsAPI> m_sofaAPI;
+
+    /// Out-of-process mode host, exclusive with m_sofaAPI
+    FSofaRemoteSimulation* m_remote = nullptr;
+
+    /// Host restarts since the last scene load, and the pending one if any
+    int32 m_hostRestarts = 0;
+    bool m_hostRestartPending = false;
+    double m_nextHostRestartTime = 0.0;
     UPROPERTY(SaveGame)
         int m_status;
+
+    /// Visual meshes registered to this context
+    TArray<TWeakObjectPtr<ASofaVisualMesh>> m_visualMeshes;
+
+    /// Output meshes of the current scene in SOFA order, rebuilt at each load
+    TArray<SofaPhysicsOutputMesh*> m_outputMeshes;
+
+    /// Output meshes of the current scene by exact name, rebuilt at each load
+    TMap<FString, SofaPhysicsOutputMesh*> m_outputMeshesByName;
+
+    /// Meshes converted during the current updateVisualMeshes call
+    TArray<ASofaVisualMesh*> m_meshesToUpdate;
+
+    /// See getStepSequence, written by Tick around m_sofaAPI->step()
+    std::atomic<uint32> m_stepSequence{ 0 };
+
+    /// Actor transform written by the game thread at each Tick while the haptic loop runs, read by the device thread
+    TTripleBuffer<FTransform> m_hapticTransform;
 };
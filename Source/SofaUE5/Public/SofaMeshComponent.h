@@ -0,0 +1,54 @@
+/*****************************************************************************
+ *                 - Copyright (C) - 2022 - InfinyTech3D -                   *
+ *                                                                           *
+ * This file is part of the SofaUE5-Renderer asset from InfinyTech3D         *
+ *                                                                           *
+ * GNU General Public License Usage:                                         *
+ * This file may be used under the terms of the GNU General                  *
+ * Public License version 3. The licenses are as published by the Free       *
+ * Software Foundation and appearing in the file LICENSE.GPL3 included in    *
+ * the packaging of this file. Please review the following information to    *
+ * ensure the GNU General Public License requirements will be met:           *
+ * https://www.gnu.org/licenses/gpl-3.0.html.                                *
+ *                                                                           *
+ * Commercial License Usage:                                                 *
+ * Licensees holding valid commercial license from InfinyTech3D may use this *
+ * file in accordance with the commercial license agreement provided with    *
+ * the Software or, alternatively, in accordance with the terms contained in *
+ * a written agreement between you and InfinyTech3D. For further information *
+ * on the licensing terms and conditions, contact: contact@infinytech3d.com  *
+ *                                                                           *
+ * Authors: see Authors.txt                                                  *
+ * Further information: https://infinytech3d.com                             *
+ ****************************************************************************/
+
+#pragma once
+
+#include "ProceduralMeshComponent.h"
+#include "SofaMeshComponent.generated.h"
+
+/**
+ * ProceduralMeshComponent whose bounds follow the SOFA simulation.
+ * The bounding box is computed while converting the SOFA positions, so it can be
+ * refreshed even on frames where the vertices are not uploaded.
+ */
+UCLASS(ClassGroup = Rendering)
+class SOFAUE5_API USofaMeshComponent : public UProceduralMeshComponent
+{
+    GENERATED_BODY()
+
+public:
+    /** Set the local space bounding box of the simulated mesh. If bUpdate is true, bounds are sent to the render thread now */
+    void setSimulationBounds(const FBox& localBox, bool bUpdate = true);
+
+    /** Go back to the section boxes computed by UProceduralMeshComponent */
+    void clearSimulationBounds();
+
+    virtual FBoxSphereBounds CalcBounds(const FTransform& LocalToWorld) const override;
+
+    /** In Deformable collision mode, component traces go to the deformed surface of the owning SofaVisualMesh. World traces do not call this, see ESofaCollisionMode::Deformable */
+    virtual bool LineTraceComponent(FHitResult& OutHit, const FVector Start, const FVector End, const FCollisionQueryParams& Params) override;
+
+private:
+    FBox m_simulationBounds = FBox(ForceInit);
+};
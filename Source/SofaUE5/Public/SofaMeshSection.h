@@ -0,0 +1,203 @@
+/*****************************************************************************
+ *                 - Copyright (C) - 2022 - InfinyTech3D -                   *
+ *                                                                           *
+ * This file is part of the SofaUE5-Renderer asset from InfinyTech3D         *
+ *                                                                           *
+ * GNU General Public License Usage:                                         *
+ * This file may be used under the terms of the GNU General                  *
+ * Public License version 3. The licenses are as published by the Free       *
+ * Software Foundation and appearing in the file LICENSE.GPL3 included in    *
+ * the packaging of this file. Please review the following information to    *
+ * ensure the GNU General Public License requirements will be met:           *
+ * https://www.gnu.org/licenses/gpl-3.0.html.                                *
+ *                                                                           *
+ * Commercial License Usage:                                                 *
+ * Licensees holding valid commercial license from InfinyTech3D may use this *
+ * file in accordance with the commercial license agreement provided with    *
+ * the Software or, alternatively, in accordance with the terms contained in *
+ * a written agreement between you and InfinyTech3D. For further information *
+ * on the licensing terms and conditions, contact: contact@infinytech3d.com  *
+ *                                                                           *
+ * Authors: see Authors.txt                                                  *
+ * Further information: https://infinytech3d.com                             *
+ ****************************************************************************/
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ProceduralMeshComponent.h"
+#include "SofaTriangleBVH.h"
+#include "SofaUE5Library/SofaPhysicsVertexNormals.h"
+#include "SofaMeshSection.generated.h"
+
+class SofaPhysicsOutputMesh;
+class USofaMeshComponent;
+
+/** How a SofaVisualMesh answers collision queries */
+UENUM(BlueprintType)
+enum class ESofaCollisionMode : uint8
+{
+    /** No collision, cheapest */
+    None,
+    /** Physics collision cooked off the game thread from the rest shape. Does not follow the deformation */
+    AsyncCooked,
+    /** No physics body, traces against the deformed surface through a BVH refit at each update.
+     *  World queries (LineTraceSingleByChannel, cursor picking, overlaps) go through the physics scene and never see these meshes:
+     *  only component traces (UPrimitiveComponent::LineTraceComponent) and ASofaVisualMesh::traceDeformedSurface reach the BVH */
+    Deformable
+};
+
+/** Options shared by all sections of a SofaVisualMesh, copied from its properties */
+struct FSofaMeshSectionSettings
+{
+    bool m_inverseNormal = false;
+    bool m_computeNormals = false;
+    bool m_computeTangents = false;
+    bool m_optimizeVertexCache = false;
+    /// Opt-in: welds every render vertex sharing a rest position, see buildSeamMap
+    bool m_streamUniquePositions = false;
+    /// Per vertex change below which the mesh is considered unchanged, in SOFA units. 0 disables the detection
+    float m_dirtyEpsilon = 0.0f;
+    /// SOFA vertex attribute streamed as vertex colors, none if empty
+    FString m_colorAttribute;
+    /// Component of the attribute mapped to colors, -1 for the magnitude
+    int32 m_colorAttributeComponent = -1;
+    /// Attribute values mapped to the first and last entry of the color table
+    float m_colorRangeMin = 0.0f;
+    float m_colorRangeMax = 1.0f;
+    /// Transfer function baked on the game thread, ColorTableSize entries
+    TArray<FColor> m_colorTable;
+    ESofaCollisionMode m_collisionMode = ESofaCollisionMode::AsyncCooked;
+};
+
+/**
+ * One SOFA output mesh rendered as one section of a USofaMeshComponent.
+ * Holds the buffers reused from one update to the next, the adjacency used for normals/tangents,
+ * the uploaded revision and the local bounds. Owned by ASofaVisualMesh.
+ */
+class SOFAUE5_API FSofaMeshSection
+{
+public:
+    /** Number of entries of the baked color transfer function */
+    static constexpr int32 ColorTableSize = 256;
+
+    FSofaMeshSection(SofaPhysicsOutputMesh* sofaMesh, int32 sectionIndex);
+
+    /** Read topology, UVs and first positions from SOFA into the buffers. Return false if the mesh is empty */
+    bool build(const FSofaMeshSectionSettings& settings);
+
+    /** Create the section on the component from the buffers filled by build */
+    void createSection(USofaMeshComponent* component, const FSofaMeshSectionSettings& settings);
+
+    /** True if SOFA has positions, or streamed attribute values, newer than the uploaded ones */
+    bool isOutdated() const;
+
+    /** Game thread: take the current SOFA revisions as the ones to convert */
+    void markPending();
+
+    /** Set the bounds from the SOFA cached bounding box, without converting the vertices */
+    bool refreshBoundsFromSofa();
+
+    /** Worker thread: convert positions/normals/tangents from SOFA into the upload buffers */
+    void compute(const FSofaMeshSectionSettings& settings);
+
+    /** Game thread: upload the buffers filled by compute to the section */
+    void commit(USofaMeshComponent* component, const FSofaMeshSectionSettings& settings);
+
+    SofaPhysicsOutputMesh* getSofaMesh() const { return m_sofaMesh; }
+    int32 getSectionIndex() const { return m_sectionIndex; }
+
+    /** Local space bounding box of the last converted positions */
+    FBox getBounds() const { return FBox(m_min, m_max); }
+
+    /** Closest hit of a local space ray against the last converted positions, only in Deformable collision mode */
+    bool raycast(const FVector& origin, const FVector& direction, double maxDistance, FSofaRayHit& hit) const;
+
+    /** Local space position of a vertex of a triangle, 0 <= corner < 3 */
+    const FVector& getTriangleVertex(int32 triangle, int32 corner) const { return m_vertices[m_triangles[triangle * 3 + corner]]; }
+
+protected:
+    /** Reorder m_triangles for the vertex cache and the vertices by first use, filling m_sofaVertexIds. Logs ACMR before/after */
+    void optimizeVertexOrder();
+
+    /** Group render vertices sharing a position (UV/normal seams) into m_uniqueSofaIds/m_renderToUnique. Logs the duplication ratio.
+     *  The output mesh API does not expose which render vertices SOFA duplicated, so vertices are grouped by equal creation position:
+     *  distinct vertices that only happen to coincide at rest are welded as well, hence position streaming is off by default.
+     *  computeNormals also accumulates over these groups, where such a weld only smooths the normals across the coincident vertices */
+    void buildSeamMap();
+
+    /** Find m_colorAttribute among the SOFA vertex attributes, -1 if missing or not per vertex */
+    void resolveColorAttribute(const FSofaMeshSectionSettings& settings);
+
+    /** Map the SOFA attribute of each render vertex through the color table into m_colors */
+    void computeColors(const FSofaMeshSectionSettings& settings);
+
+    /**
+     * Compare the SOFA positions against the last uploaded ones with a SIMD epsilon test, stopping at the first moved vertex.
+     * If one moved, the positions become the reference. Return true if one moved
+     */
+    bool hasMovedSinceUpload(const float* sofaVertices, int32 nbrV, float epsilon);
+
+    /** Compute area weighted smooth normals of m_vertices into m_normals */
+    void computeNormals(bool inverseNormal);
+
+    /** Precompute the per triangle UV terms used by computeTangents, only depends on m_UV0 and m_triangles */
+    void buildTangentSetup();
+
+    /** Compute per vertex tangents of m_vertices into m_tangents, orthogonalized against m_normals */
+    void computeTangents();
+
+    void computeBoundingBox();
+    void recomputeUV();
+
+private:
+    SofaPhysicsOutputMesh* m_sofaMesh = nullptr;
+    int32 m_sectionIndex = 0;
+
+    /// SOFA vertices revision of the last uploaded positions, -1 if nothing was uploaded yet
+    int m_uploadedRevision = -1;
+    /// Revision being converted between markPending and commit
+    int m_pendingRevision = -1;
+    bool m_hasPendingUpload = false;
+    /// The pending revision did not move any vertex past the epsilon, commit only acknowledges it
+    bool m_pendingIsClean = false;
+
+    /// Vertex attribute streamed as colors, updated only when its SOFA revision changes
+    int32 m_colorAttributeIndex = -1;
+    int m_uploadedColorRevision = -1;
+    int m_pendingColorRevision = -1;
+    bool m_hasPendingColors = false;
+    TArray<FColor> m_colors;
+
+    /// SOFA positions as last uploaded, in SOFA order, reference of the dirty detection
+    TArray<float> m_uploadedPositions;
+
+    /// Buffers reused from one update to the next
+    TArray<FVector> m_vertices;
+    TArray<FVector> m_normals;
+    TArray<FVector2D> m_UV0;
+    TArray<FProcMeshTangent> m_tangents;
+    TArray<int32> m_triangles;
+
+    /// SOFA vertex index of each render vertex when the vertices were reordered at build, empty otherwise
+    TArray<int32> m_sofaVertexIds;
+
+    /// Seam map: SOFA vertex index of each unique position, and unique position index of each render vertex. Empty if there is no duplicate
+    TArray<int32> m_uniqueSofaIds;
+    TArray<int32> m_renderToUnique;
+    TArray<FVector> m_uniquePositions;
+
+    /// CSR vertex -> triangle adjacency of m_triangles over the seam map groups when there is one, shared with SofaPhysicsBenchmark. Also walked by computeTangents
+    SofaPhysicsVertexNormals<double> m_vertexNormals;
+
+    /// Per triangle (a, b, c, d) so that tangent = a*e1 + b*e2 and bitangent = c*e1 + d*e2, e1/e2 being the triangle edges
+    TArray<FVector4f> m_triTangentCoeffs;
+    TArray<FVector> m_faceTangents;
+    TArray<FVector> m_faceBitangents;
+
+    /// Deformable collision mode: tree built at build, refit at each compute
+    FSofaTriangleBVH m_bvh;
+
+    FVector m_min = FVector(UE_BIG_NUMBER);
+    FVector m_max = FVector(-UE_BIG_NUMBER);
+};
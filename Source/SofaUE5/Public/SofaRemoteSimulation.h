@@ -0,0 +1,119 @@
+/*****************************************************************************
+ *                 - Copyright (C) - 2022 - InfinyTech3D -                   *
+ *                                                                           *
+ * This file is part of the SofaUE5-Renderer asset from InfinyTech3D         *
+ *                                                                           *
+ * GNU General Public License Usage:                                         *
+ * This file may be used under the terms of the GNU General                  *
+ * Public License version 3. The licenses are as published by the Free       *
+ * Software Foundation and appearing in the file LICENSE.GPL3 included in    *
+ * the packaging of this file. Please review the following information to    *
+ * ensure the GNU General Public License requirements will be met:           *
+ * https://www.gnu.org/licenses/gpl-3.0.html.                                *
+ *                                                                           *
+ * Commercial License Usage:                                                 *
+ * Licensees holding valid commercial license from InfinyTech3D may use this *
+ * file in accordance with the commercial license agreement provided with    *
+ * the Software or, alternatively, in accordance with the terms contained in *
+ * a written agreement between you and InfinyTech3D. For further information *
+ * on the licensing terms and conditions, contact: contact@infinytech3d.com  *
+ *                                                                           *
+ * Authors: see Authors.txt                                                  *
+ * Further information: https://infinytech3d.com                             *
+ ****************************************************************************/
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/PlatformProcess.h"
+#include "SofaUE5Library/SofaPhysicsSharedMemory.h"
+
+/**
+ * Client side of the out-of-process mode. Starts the SofaPhysicsHost process, owns the shared memory region
+ * (SofaPhysicsSharedMemory.h) and talks to the host without locks: commands go through the queue, frames
+ * come back in the ring and are read in place. A crash or hang of SOFA only stops the host, seen by isAlive.
+ * Owned by ASofaContext, used from the game thread only.
+ */
+class SOFAUE5_API FSofaRemoteSimulation
+{
+public:
+    /** Positions/normals of one frame, read in place in the shared memory. Check isFrameIntact after reading them */
+    struct FFrameView
+    {
+        const SofaPhysicsShmFrame* frame = nullptr;
+        const float* positions = nullptr;
+        const float* normals = nullptr;
+        uint64 sequence = 0;
+    };
+
+    ~FSofaRemoteSimulation();
+
+    /** Create the region for the given capacities (sum over the meshes of the scene) and start the host. Blocks until SOFA is initialized.
+     *  @param maxCommandSeconds is the longest a single load or step may run before the host stops beating and counts as hung */
+    bool start(const FString& hostPath, const FString& pluginDir, int32 maxVertices, int32 maxTriangles, float timeoutSeconds, float maxCommandSeconds);
+
+    /** Ask the host to quit, kill it if it does not, and release the region */
+    void stop();
+
+    /** True if the host process runs and its heartbeat moved within the timeout. The host beats from a thread of its own, also during long commands */
+    bool isAlive();
+
+    /** Load a scene in the host. Blocks until it is loaded or the timeout expires. Return false on failure, see getError */
+    bool load(const FString& scenePath);
+
+    /** Queue one step. Only one step is in flight: return false without queuing while the host has not processed the previous one */
+    bool step();
+
+    void reset();
+    void setTimeStep(double dt);
+    void setGravity(const FVector& gravity);
+    void wakeUp();
+
+    /** Meshes of the loaded scene, in SOFA order */
+    int32 getNbMeshes() const;
+    const SofaPhysicsShmMesh* getMesh(int32 meshIndex) const;
+    int32 findMesh(const FString& name) const;
+
+    /** Topology of a mesh: nbTriangles * 3 indices, local to the mesh, and nbVertices * 2 texture coordinates */
+    const uint32* getIndices(const SofaPhysicsShmMesh& mesh) const;
+    const float* getTexCoords(const SofaPhysicsShmMesh& mesh) const;
+
+    /** Fill @param view with the newest complete frame. Return false if there is none */
+    bool acquireLatestFrame(FFrameView& view);
+
+    /** True if the host did not write the frame of @param view since it was acquired */
+    bool isFrameIntact(const FFrameView& view) const;
+
+    /** Last host error message, empty if none */
+    FString getError() const;
+
+    /** Time between sending a step and seeing its frame, for the last completed step */
+    float getLastLatencyMs() const { return m_latencyMs; }
+
+    /** Duration of the last SOFA step, measured in the host */
+    float getLastStepDurationMs() const { return m_stepDurationMs; }
+
+protected:
+    /** Push a command, filling its id. Return the id, 0 if the queue is full */
+    uint32 sendCommand(uint32 type, const double* values = nullptr, const char* text = nullptr);
+
+    /** Wait until the host processed command @param id. Return false on timeout or if the host died */
+    bool waitForCommand(uint32 id);
+
+    FPlatformMemory::FSharedMemoryRegion* m_region = nullptr;
+    SofaPhysicsShmHeader* m_header = nullptr;
+    FProcHandle m_process;
+    uint32 m_nextCommandId = 1;
+    float m_timeoutSeconds = 5.0f;
+
+    /// Heartbeat watchdog
+    uint64 m_lastHeartbeat = 0;
+    double m_lastHeartbeatTime = 0.0;
+
+    /// Last step sent, and when. Its latency is measured when a frame reports it processed
+    uint32 m_pendingStepId = 0;
+    double m_pendingStepTime = 0.0;
+    bool m_latencyPending = false;
+    float m_latencyMs = 0.0f;
+    float m_stepDurationMs = 0.0f;
+};
@@ -0,0 +1,64 @@
+/*****************************************************************************
+ *                 - Copyright (C) - 2022 - InfinyTech3D -                   *
+ *                                                                           *
+ * This file is part of the SofaUE5-Renderer asset from InfinyTech3D         *
+ *                                                                           *
+ * GNU General Public License Usage:                                         *
+ * This file may be used under the terms of the GNU General                  *
+ * Public License version 3. The licenses are as published by the Free       *
+ * Software Foundation and appearing in the file LICENSE.GPL3 included in    *
+ * the packaging of this file. Please review the following information to    *
+ * ensure the GNU General Public License requirements will be met:           *
+ * https://www.gnu.org/licenses/gpl-3.0.html.                                *
+ *                                                                           *
+ * Commercial License Usage:                                                 *
+ * Licensees holding valid commercial license from InfinyTech3D may use this *
+ * file in accordance with the commercial license agreement provided with    *
+ * the Software or, alternatively, in accordance with the terms contained in *
+ * a written agreement between you and InfinyTech3D. For further information *
+ * on the licensing terms and conditions, contact: contact@infinytech3d.com  *
+ *                                                                           *
+ * Authors: see Authors.txt                                                  *
+ * Further information: https://infinytech3d.com                             *
+ ****************************************************************************/
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "SofaUE5Library/SofaPhysicsTriangleBVH.h"
+
+/** Closest hit returned by FSofaTriangleBVH::raycast, in the space of the vertices */
+struct FSofaRayHit
+{
+    double distance = 0.0;
+    /// Triangle index in the index buffer given to build
+    int32 triangle = INDEX_NONE;
+    /// Barycentric weights of the 2nd and 3rd triangle vertices, the 1st one being 1 - u - v
+    float u = 0.0f;
+    float v = 0.0f;
+};
+
+/**
+ * Bounding volume hierarchy over a deforming triangle mesh, on UE arrays.
+ * Wraps SofaPhysicsTriangleBVH, the implementation SofaPhysicsOutputMesh::raycast uses in the SOFA library:
+ * built once from the rest topology, then only the node boxes are refit from the new positions.
+ */
+class SOFAUE5_API FSofaTriangleBVH
+{
+public:
+    /** Build the tree over the triangles, 3 indices per triangle */
+    void build(const TArray<FVector>& vertices, const TArray<int32>& triangles);
+
+    /** Recompute the node boxes from the new positions, same vertex count as in build */
+    void refit(const TArray<FVector>& vertices);
+
+    /** Closest triangle hit by the ray origin + t * direction, t in [0, maxDistance]. direction must be normalized */
+    bool raycast(const TArray<FVector>& vertices, const FVector& origin, const FVector& direction, double maxDistance, FSofaRayHit& hit) const;
+
+    bool isValid() const { return m_tree.isValid(); }
+
+    void reset() { m_tree.reset(); }
+
+private:
+    SofaPhysicsTriangleBVH<double> m_tree;
+};
@@ -24,12 +24,14 @@
 #pragma once
 
 #include "Modules/ModuleManager.h"
+#include "Stats/Stats.h"
 #include <iomanip>
 #include <string>
 #include <sstream>
 
 DECLARE_LOG_CATEGORY_EXTERN(SUnreal_log, Log, All);
 DECLARE_LOG_CATEGORY_EXTERN(SofaLog, Log, All);
+DECLARE_STATS_GROUP(TEXT("SofaUE5"), STATGROUP_SofaUE5, STATCAT_Advanced);
 
 static FString intToHexa(int value)
 {
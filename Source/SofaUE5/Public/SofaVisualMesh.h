@@ -26,10 +26,14 @@
 
 #include "GameFramework/Actor.h"
 #include "ProceduralMeshComponent.h"
+#include "SofaMeshComponent.h"
+#include "SofaMeshSection.h"
 #include "SofaVisualMesh.generated.h"
 
 class SofaPhysicsOutputMesh;
 class ASofaContext;
+class UCurveLinearColor;
+class FSofaRemoteSimulation;
 
 UCLASS()
 class SOFAUE5_API ASofaVisualMesh : public AActor
@@ -39,38 +43,179 @@ class SOFAUE5_API ASofaVisualMesh : public AActor
 public:
     ASofaVisualMesh();
 
+    /** Render a single SOFA output mesh as section 0 */
     void setSofaMesh(SofaPhysicsOutputMesh* sofaMesh);
 
+    /** Render each SOFA output mesh as one section of the component, section i using material slot i */
+    void setSofaMeshes(const TArray<SofaPhysicsOutputMesh*>& sofaMeshes);
+
+    /** Out-of-process mode: render mesh @param meshIndex of the host scene as section 0. Of the conversion options, only m_inverseNormal applies */
+    void setRemoteMesh(FSofaRemoteSimulation* remote, int32 meshIndex);
+
+    /** Out-of-process mode, game thread: upload the newest host frame if it was not uploaded yet */
+    void updateFromRemote();
+
     virtual void BeginPlay() override;
     void PostActorCreated() override;
     void PostLoad() override;
-    
-    virtual void Tick( float DeltaSeconds ) override;
+    virtual void PostInitializeComponents() override;
+    virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+    virtual void Destroyed() override;
+#if WITH_EDITOR
+    virtual void PostEditChangeProperty(FPropertyChangedEvent& PropertyChangedEvent) override;
+#endif
+
+    /** Game thread: return true if a section needs new positions this frame. Hidden meshes only refresh their bounds here */
+    bool prepareUpdate();
+
+    /** Worker thread: convert positions/normals/tangents from SOFA into the upload buffers of the outdated sections */
+    void computeUpdate();
+
+    /** Game thread: upload the buffers filled by computeUpdate to the mesh component */
+    void commitUpdate();
+
+    /** Bound to ASofaContext::OnSceneLoaded: look up the SOFA mesh(es) once and create the visual */
+    void onSceneLoaded(ASofaContext* context);
+
+    /** Drop the SOFA mesh pointers, called by the context before it deletes its SOFA API */
+    void clearSofaMesh();
+
+    /** Name used to find the SOFA output mesh: MeshName, or the actor label if empty */
+    FString getSofaMeshName() const;
+
+    /** Set MeshName and bind the SOFA mesh of that name. Needed by actors spawned at runtime, whose lookup waits for a name */
+    UFUNCTION(BlueprintCallable, Category = "Sofa")
+        void setMeshName(const FString& name);
+
+    /** Local space bounding box of the last converted positions, over all sections */
+    FBox getBounds() const;
+
+    /** Bake m_colorTransferFunction again at the next update, for curve keys edited since. Replacing the curve is detected on its own */
+    UFUNCTION(BlueprintCallable, Category = "Sofa")
+        void refreshColorTable();
 
-    void recomputeUV(const TArray<FVector>& vertices, TArray<FVector2D>& UV0);
-    void computeBoundingBox(const TArray<FVector>& vertices);
+    /** Trace a world space segment against the deformed surface of all sections. Only in Deformable collision mode */
+    UFUNCTION(BlueprintCallable, Category = "Sofa")
+        bool traceDeformedSurface(const FVector& start, const FVector& end, FHitResult& outHit);
 
     bool m_isStatic;
 
     UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters")
         ASofaContext* SofaContextRef;
 
-    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters")
+    /** SOFA output mesh rendered by this actor. Set it on spawn, or through setMeshName, for actors spawned at runtime */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters", meta = (ExposeOnSpawn = "true"))
         FString MeshName;
 
+    /** If true, this actor renders all the output meshes of its context, one section and material slot per mesh. MeshName is ignored */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters")
+        bool m_allSceneMeshes = false;
+
     UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters")
         bool m_inverseNormal;
 
+    /** If true, SOFA stops updating the normals of this mesh and smooth normals are computed here in parallel, smoothed across UV seams like SOFA does */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters")
+        bool m_computeNormals = false;
+
+    /** If true, tangents are recomputed at each update from the static UV layout, needed by normal mapped materials */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters")
+        bool m_computeTangents = false;
+
+    /** If true, triangles are reordered at creation for the GPU vertex cache and vertices by first use. The ACMR gain is logged */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters")
+        bool m_optimizeVertexCache = false;
+
+    /** If true, vertices duplicated along UV/normal seams are detected at creation and each shared position is read and converted once per update.
+     *  Only the SOFA read and conversion shrink: the section still uploads every render vertex, the upload size is unchanged.
+     *  Detection is by equal rest position: distinct SOFA vertices that coincide at creation (cut or slit surfaces, touching parts) are welded and then move together. Only enable it on meshes without such vertices */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters")
+        bool m_streamUniquePositions = false;
+
+    /** Vertices moving less than this since the last upload (SOFA units) are considered unchanged, an update where nothing changed is skipped.
+     *  Any moved vertex uploads the whole section, there is no partial upload. 0, the default, disables the detection */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters", meta = (ClampMin = "0.0"))
+        float m_dirtyEpsilon = 0.0f;
+
+    /** Name of a SOFA vertex attribute (e.g. von Mises stress exported by the scene) rendered as vertex colors, none if empty. The material must use the vertex color */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters")
+        FString m_colorAttribute;
+
+    /** Component of the attribute mapped to colors, -1 for the magnitude of the per vertex vector */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters", meta = (ClampMin = "-1"))
+        int32 m_colorAttributeComponent = -1;
+
+    /** Attribute value mapped to the start of the transfer function */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters")
+        float m_colorRangeMin = 0.0f;
+
+    /** Attribute value mapped to the end of the transfer function */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters")
+        float m_colorRangeMax = 1.0f;
+
+    /** Transfer function sampled over [0, 1], a blue to red ramp if not set. Baked once, call refreshColorTable after editing the curve keys at runtime */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters")
+        UCurveLinearColor* m_colorTransferFunction = nullptr;
+
+    /** If true, positions/normals are not converted nor uploaded while the mesh is not rendered. Catch-up is done when it becomes visible again */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters")
+        bool m_skipUpdateWhenHidden = true;
+
+    /** Time in seconds since the last render after which the mesh is considered hidden */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters", meta = (EditCondition = "m_skipUpdateWhenHidden", ClampMin = "0.0"))
+        float m_hiddenDelay = 0.2f;
+
+    /** Collision of the sections: none, physics shape cooked asynchronously from the rest shape, or traces against the deformed surface */
+    UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Sofa Parameters")
+        ESofaCollisionMode m_collisionMode = ESofaCollisionMode::AsyncCooked;
+
+    /** SOFA mesh rendered by each section, the index is the material slot */
+    UPROPERTY(VisibleAnywhere, Category = "Sofa Parameters")
+        TArray<FString> m_sectionNames;
+
 protected:
     void createMesh();
 
-    void updateMesh();
+    /** Find the context to register to: SofaContextRef, owner, attach parent or first context of the level */
+    ASofaContext* resolveContext();
+
+    void unregisterFromContext();
+
+    /** True for an actor spawned at runtime whose MeshName is not set yet: the label is not a mesh name, the lookup is deferred to setMeshName */
+    bool isWaitingForMeshName() const;
+
+    /** Current options for the sections, with the baked color table */
+    FSofaMeshSectionSettings getSectionSettings();
+
+    /** Bake the transfer function into m_colorTable if it was never baked, was refreshed or the curve was replaced */
+    void updateColorTable();
+
+    /** Copy the positions/normals of the newest host frame into the remote buffers. Return false if there is no new, complete frame */
+    bool readRemoteFrame();
 
 private:
     UPROPERTY(VisibleAnywhere)
-        UProceduralMeshComponent * mesh;
-
-    SofaPhysicsOutputMesh* m_sofaMesh = nullptr;
-    FVector m_min;
-    FVector m_max;
+        USofaMeshComponent * mesh;
+
+    TWeakObjectPtr<ASofaContext> m_registeredContext;
+
+    /// One section per SOFA output mesh, in material slot order
+    TArray<FSofaMeshSection> m_sections;
+    /// Sections converted between prepareUpdate and commitUpdate
+    TArray<int32> m_pendingSections;
+    /// Settings taken in prepareUpdate, read by the worker threads
+    FSofaMeshSectionSettings m_pendingSettings;
+
+    /// m_colorTransferFunction baked by updateColorTable, and the curve it was baked from
+    TArray<FColor> m_colorTable;
+    TWeakObjectPtr<UCurveLinearColor> m_colorTableCurve;
+
+    /// Out-of-process mode: host simulation, null in process, and the mesh of its scene rendered as section 0
+    FSofaRemoteSimulation* m_remote = nullptr;
+    int32 m_remoteMeshIndex = INDEX_NONE;
+    /// Host frame of the uploaded positions
+    uint64 m_remoteFrameId = 0;
+    TArray<FVector> m_remoteVertices;
+    TArray<FVector> m_remoteNormals;
+    FBox m_remoteBounds = FBox(ForceInit);
 };
@@ -57,6 +57,65 @@ typedef void* ID;           ///< Type used for IDs
 #define API_PLUGIN_MISSING_SYMBOL -21   ///< Error while loading SOFA plugin. Plugin library has missing symbol such as: initExternalModule
 #define API_PLUGIN_FILE_NOT_FOUND -22   ///< Error while loading SOFA plugin. Plugin library file not found
 #define API_PLUGIN_LOADING_FAILED -23   ///< Error while loading SOFA plugin. Plugin library loading fail for another unknown reason.
+#define API_COMMAND_QUEUE_FULL -30      ///< The deferred command queue is full, the command was not recorded. Retry after the next step.
+
+/// DOF renumbering methods applied by load() to the volumetric mesh loaders, see SofaPhysicsAPI::setDofRenumbering
+#define API_RENUMBER_NONE 0             ///< keep the file order
+#define API_RENUMBER_RCM 1              ///< reverse Cuthill-McKee on the element graph, minimizes the matrix bandwidth
+#define API_RENUMBER_MORTON 2           ///< Morton (Z-order) space filling curve on the rest positions
+
+/// Priority of the SOFA task scheduler workers, see SofaPhysicsTaskSchedulerConfig
+#define API_THREAD_PRIORITY_LOW -1      ///< below normal, leaves room to the application threads
+#define API_THREAD_PRIORITY_NORMAL 0    ///< OS default
+#define API_THREAD_PRIORITY_HIGH 1      ///< above normal
+
+/// Configuration of the task scheduler used by the parallel SOFA components, given to the SofaPhysicsAPI constructor.
+/// The scheduler is shared by the whole process: the last configuration wins.
+struct SofaPhysicsTaskSchedulerConfig
+{
+    int nbThreads;                      ///< number of SOFA threads including the caller, 0 for the hardware count, -1 to leave the scheduler unconfigured
+    unsigned long long affinityMask;    ///< cores the SOFA workers may run on, bit i for core i. 0 for any
+    int priority;                       ///< API_THREAD_PRIORITY_* of the SOFA workers
+    /// When set, SOFA runs no worker of its own: each task is handed to this function, which must call run(task) once on any thread of the application pool.
+    /// A SOFA thread waiting for tasks runs them itself, run may then have nothing left to do. Dispatching stops when the SofaPhysicsAPI is destroyed,
+    /// SOFA tasks then run on the calling thread until another SofaPhysicsAPI gives a dispatch
+    void (*dispatch)(void* userData, void (*run)(void* task), void* task);
+    void* userData;                     ///< passed back to dispatch
+    int externalThreadCount;            ///< number of threads of the application pool, reported to the SOFA components to size their work
+};
+
+/// Description of a caller's interleaved vertex, used by SofaPhysicsOutputMesh::fillVertices. Offsets are in bytes from the start of a vertex, -1 to skip the attribute.
+struct SofaPhysicsVertexLayout
+{
+    int positionOffset;     ///< Real[3] position
+    int normalOffset;       ///< Real[3] normal
+    int texCoordOffset;     ///< Real[2] texture coordinates
+    const Real* transform;  ///< optional row major 3x4 affine matrix applied to positions, the inverse transpose of its 3x3 part to normals (renormalized). nullptr for identity
+    bool flipNormals;       ///< negate the normals
+};
+
+/// Timing of the haptic loop since it was started, see SofaPhysicsAPI::getHapticStats. Jitter is the distance between the scheduled and the actual start of an iteration.
+struct SofaPhysicsHapticStats
+{
+    unsigned long long nbIterations;        ///< number of forces published
+    unsigned long long nbMissedDeadlines;   ///< iterations whose force was published after the start of the next period
+    double meanJitterMs;                    ///< average jitter in milliseconds
+    double maxJitterMs;                     ///< worst jitter in milliseconds
+    double maxComputeMs;                    ///< worst time spent computing one force, in milliseconds
+    double surfaceAgeMs;                    ///< time since the surface used by the loop was taken from a step, in milliseconds
+};
+
+/// Contacts of the last step as structure of arrays, see SofaPhysicsAPI::getContacts. The arrays belong to the API, are reused from step to step and stay valid until the next step or load.
+struct SofaPhysicsContacts
+{
+    unsigned long long revision;    ///< incremented by each step exporting contacts, a reader seeing the same revision has nothing new to read
+    unsigned int nbContacts;        ///< number of contacts, each array below holds nbContacts elements of the given size
+    const Real* points;             ///< Real[3] contact point on the first collision model
+    const Real* normals;            ///< Real[3] contact normal as given by the intersection method
+    const Real* depths;             ///< Real[1] penetration past the contact distance, negative while the models are only within the alarm distance
+    const Real* forces;             ///< Real[1] normal force of the contact constraint, 0 when no constraint solver reports it
+    const int* models;              ///< int[2] indices of the two collision models, see getCollisionModelName
+};
 
 /// Internal implementation sub-class
 class SofaPhysicsSimulation;
@@ -66,7 +125,8 @@ class SofaPhysicsSimulation;
 class SOFA_SOFAPHYSICSAPI_API SofaPhysicsAPI
 {
 public:
-    SofaPhysicsAPI(bool useGUI = false, int GUIFramerate = 0);
+    /// @param schedulerConfig optional task scheduler configuration, applied once here, before any scene is loaded
+    SofaPhysicsAPI(bool useGUI = false, int GUIFramerate = 0, const SofaPhysicsTaskSchedulerConfig* schedulerConfig = nullptr);
     virtual ~SofaPhysicsAPI();
 
     /// Load an XML file containing the main scene description. Will return API_SUCCESS or API_SCENE_FAILED if loading failed
@@ -77,6 +137,13 @@ public:
     const char* loadSofaIni(const char* pathIniFile);
     /// Method to load a specific SOFA plugin using it's full path @param pluginPath. Return error code.
     int loadPlugin(const char* pluginPath);
+    /// Method to set the DOF renumbering, @param method one of API_RENUMBER_*, applied by the next load() to the volumetric mesh loaders
+    /// before the scene is initialized. Vertex index Data of the components using these DOFs anywhere in the graph ("indices", "points", "indices1", "indices2", "external_points")
+    /// are remapped. A loader whose DOFs are also referenced by another integer list is kept in file order, with a warning naming that Data. Return error code.
+    int setDofRenumbering(int method);
+    /// Method to let the next load() replace the scene BruteForceBroadPhase by a sweep and prune on the collision model bounding boxes,
+    /// producing the same pairs without testing every couple of models. A broad phase with a box is kept. Narrow phase and contact response are kept. Return error code.
+    int setBroadPhaseUpgrade(bool enable);
 
     /// Get the current api Name behind this interface.
     virtual const char* APIName();
@@ -157,6 +224,74 @@ public:
     /// Set the current scene gravity using the input @param gravity which is a double[3]
     void setGravity(double* gravity);
 
+    /// Deferred commands: recorded without allocation nor lock and applied together, in order, at the beginning of the next step(). Meant for a producer thread other than
+    /// the one stepping, which then never waits on the solver. Only one thread may queue commands. Return API_SUCCESS, API_COMMAND_QUEUE_FULL, or API_NULL for a text over 127 characters.
+    int queueTimeStep(double dt);
+    /// Queue a gravity change, @param gravity is a double[3] copied at once
+    int queueGravity(const double* gravity);
+    /// Queue a sendValue(@param name, @param value)
+    int queueValue(const char* name, double value);
+    /// Queue a write of @param value to the data controller of index @param controllerId in getDataControllers()
+    int queueDataControllerValue(unsigned int controllerId, const char* value);
+    /// Return the number of commands waiting for the next step
+    unsigned int getNbQueuedCommands() const;
+    /// Apply the queued commands now, in order, for a simulation that is not being stepped. Must not run concurrently with step(). Return error code.
+    int applyQueuedCommands();
+
+    /// Method to let the simulation sleep once every velocity component stayed under @param maxVelocity for @param quietSteps steps. While asleep step() returns at once and the time stops.
+    /// setGravity, setTimeStep, sendValue, reset, a data controller write, a write to a force field Data or to a state externalForce, or wakeUp() resume it.
+    /// Scenes with a controller or a key time component (LinearMovementConstraint...) never sleep, they depend on the time. @param maxVelocity <= 0 disables the detection. Return error code.
+    int setSleepThreshold(double maxVelocity, int quietSteps);
+    /// Return true if the simulation is asleep, see setSleepThreshold
+    bool isSleeping() const;
+    /// Resume a sleeping simulation, to be called when applying external input (forces, tools) not covered by the automatic wake up
+    void wakeUp();
+
+    /// Method to keep the step time within @param budgetMs milliseconds by lowering the iteration limits of the linear solvers ("iterations") and constraint solvers ("maxIt", "maxIterations").
+    /// Limits never exceed the scene values nor go under @param minSolverIterations / @param minConstraintIterations. @param budgetMs <= 0 restores the scene values. Return error code.
+    int setStepBudget(double budgetMs, int minSolverIterations, int minConstraintIterations);
+    /// Return the ratio between the current iteration limits and the scene ones, 1 when the quality is not degraded
+    double getStepQuality() const;
+    /// Return the number of steps done with degraded iteration limits since the budget was set
+    unsigned int getNbDegradedSteps() const;
+    /// Return the duration of the last step in milliseconds
+    double getLastStepDuration() const;
+
+    /// Method to let step() choose the time step in [@param minDt, @param maxDt] from the solvers convergence: dt grows while the linear solvers use less than half of their iterations
+    /// and is halved, with the step restarted from a snapshot of the mechanical states, when a solver reaches its iteration limit.
+    /// The snapshot only holds positions, velocities and time. Scenes with a controller, a constraint solver (warm start lambdas) or a contact manager (contact responses)
+    /// are never restarted: the failed step is kept and the next one uses half the dt. Other component state (plasticity...) is not restored by a rollback either. Return error code.
+    int setAdaptiveTimeStep(bool enabled, double minDt, double maxDt);
+    /// Return the time step used by the last step
+    double getLastStepDt() const;
+    /// Return the number of steps restarted with a smaller time step since the adaptive mode was set
+    unsigned int getNbRollbacks() const;
+
+    /// Method to export, at the end of each step, the contacts involving one of the collision models named in the comma separated @param modelNames, all of them if empty.
+    /// Turns on the constraint force output of the first constraint solver exposing it ("computeConstraintForces"), logged when it overrides the scene. @param enabled false stops the export and restores the scene value. Return error code.
+    int setContactExport(bool enabled, const char* modelNames);
+    /// Get the contacts of the last step into output @param contacts, pointing to the export buffers. Return error code.
+    int getContacts(SofaPhysicsContacts* contacts) const;
+    /// Return the number of collision models of the scene, indexed by SofaPhysicsContacts::models
+    unsigned int getNbCollisionModels() const;
+    /// Return the name of the collision model of index @param modelId, or nullptr
+    const char* getCollisionModelName(unsigned int modelId) const;
+
+    /// Method to start a thread computing, @param rateHz times per second, the contact force between a spherical tool of radius @param toolRadius and the output mesh
+    /// named @param meshName. The force is a penalty, @param stiffness times the penetration of the sphere past the closest point of the surface, found in a BVH over a copy of the mesh
+    /// triangles taken at the end of each step, so the loop keeps its rate whatever the step time. The force is not applied to the simulation. Return error code.
+    int startHapticLoop(const char* meshName, double rateHz, double stiffness, double toolRadius);
+    /// Stop and join the haptic thread. Return error code.
+    int stopHapticLoop();
+    /// Return true while the haptic thread runs
+    bool isHapticLoopRunning() const;
+    /// Set the tool center, in scene coordinates, read by the next haptic iteration. Lock-free, @param position is a double[3]. Only one thread may set the pose.
+    int setHapticToolPosition(const double* position);
+    /// Get the last force published by the haptic loop into output @param force, a double[3]. Lock-free, only one thread may read the force. Return error code.
+    int getHapticForce(double* force);
+    /// Get the timing of the haptic loop into output @param stats. Return error code.
+    int getHapticStats(SofaPhysicsHapticStats* stats);
+
     /// message API
     /// Method to activate/deactivate SOFA MessageHandler according to @param value. Return Error code.
     int activateMessageHandler(bool value);
@@ -200,10 +335,17 @@ public:
     int getVPositions(Real* values); ///< get the positions/vertices of this mesh inside ouput @param values, of type Real[ 3*nbVertices ]. Return error code.
     const Real* getVNormals();    ///< vertices normals   (Vec3)
     int getVNormals(Real* values); ///< get the normals per vertex of this mesh inside ouput @param values, of type Real[ 3*nbVertices ]. Return error code.
+    int setComputeNormals(bool value); ///< enable/disable the normals recomputation done by SOFA at each visual update, using input @param value. Return error code.
+    int resetComputeNormals();         ///< give back the normals recomputation setting of the scene, undoing setComputeNormals. Return error code.
     const Real* getVTexCoords();  ///< vertices UVs       (Vec2)
     int getVTexCoords(Real* values); ///< get the texture coordinates (UV) per vertex of this mesh inside ouput @param values, of type Real[ 2*nbVertices ]. Return error code.
     int getTexCoordRevision();    ///< changes each time texture coord data are updated
     int getVerticesRevision();    ///< changes each time vertices data are updated
+    int getBoundingBox(Real* min, Real* max); ///< get the axis aligned bounding box of the current positions inside output @param min and @param max, of type Real[3]. Cached per vertices revision. Return error code.
+
+    /// Method to write the attributes requested by @param layout for all vertices in one pass into the interleaved output @param dst, @param stride bytes apart.
+    /// Meant to target a GPU staging buffer directly. Return API_NULL, writing nothing, if an attribute does not fit in the stride. Return error code.
+    int fillVertices(const SofaPhysicsVertexLayout& layout, void* dst, unsigned int stride);
 
     unsigned int getNbVAttributes();                    ///< number of vertices attributes
     unsigned int getNbAttributes(int index);            ///< number of the attributes in specified vertex attribute 
@@ -226,10 +368,29 @@ public:
     int getQuads(int* values); ///< get the quad topology inside ouput @param values, of type int[ 4*nbQuads ]. Return error code.
     int getQuadsRevision();    ///< changes each time quads data is updated
 
+    /// Method to build (@param value true) or release a BVH over the triangles and quads of this mesh, refit after each step. Raycasts running while it is released finish on the old tree. Return error code.
+    int setRaycastEnabled(bool value);
+    /// Method to cast @param nbRays rays against the mesh as it was at the end of the last step. Ray i starts at origins[3*i], goes along the normalized directions[3*i] up to maxDistances[i].
+    /// For each ray, output @param hitTriangles gets the hit triangle (-1 if none), @param hitBarycentrics the Real[2] weights of its 2nd and 3rd vertices and @param hitDistances the distance.
+    /// Triangles are numbered as getTriangles() then each quad q as the 2 triangles nbTriangles+2q (0,1,2) and nbTriangles+2q+1 (0,2,3).
+    /// Thread-safe, can be called from any thread while the simulation steps. Return the number of hits or error code.
+    int raycast(unsigned int nbRays, const Real* origins, const Real* directions, const Real* maxDistances, int* hitTriangles, Real* hitBarycentrics, Real* hitDistances);
+
     /// Internal implementation sub-class
     class Impl;
     /// Internal implementation sub-class
     Impl* impl;
+
+protected:
+    friend class SofaPhysicsSimulation;
+
+    /// Refit the raycast BVH to the current positions, called by the simulation at the end of each step
+    void refitRaycast();
+
+    /// State of the plugin extensions (bounding box cache, raycast BVH), created and deleted by the simulation with the mesh.
+    /// Kept behind one pointer so extending it does not change the layout of this exported class again
+    struct Extension;
+    Extension* m_extension = nullptr;
 };
 
 /// Class for data monitoring
@@ -87,6 +87,7 @@ EXPORT_API int sofaVisualModel_getNbVertices(void* api_api_ptr, const char* name
 EXPORT_API int sofaVisualModel_getVertices(void* api_api_ptr, const char* name, float* buffer); ///< Get the positions/vertices using ouput @param values (type float[ 3*nbVertices ]) of the SofaPhysicsOutputMesh with name: @param name. Return error code.
 EXPORT_API int sofaVisualModel_getNormals(void* api_ptr, const char* name, float* buffer); ///< Get the normals using ouput @param values (type float[ 3*nbVertices ]) of the SofaPhysicsOutputMesh with name: @param name. Return error code.
 EXPORT_API int sofaVisualModel_getTexCoords(void* api_ptr, const char* name, float* buffer); ///< Get the texture coordinates using ouput @param values (type float[ 2*nbVertices ]) of the SofaPhysicsOutputMesh with name: @param name. Return error code.
+EXPORT_API int sofaVisualModel_fillVertices(void* api_ptr, const char* name, int positionOffset, int normalOffset, int texCoordOffset, const float* transform, bool flipNormals, void* buffer, int stride); ///< Fill the interleaved output @param buffer (nbVertices vertices of @param stride bytes) of the SofaPhysicsOutputMesh with name: @param name, in one pass. Attribute offsets are in bytes, -1 to skip. @param transform is an optional row major float[12]. Return error code.
 
 EXPORT_API int sofaVisualModel_getNbEdges(void* api_ptr, const char* name); ///< Return the number of edges of the SofaPhysicsOutputMesh with name: @param name
 EXPORT_API int sofaVisualModel_getEdges(void* api_ptr, const char* name, int* buffer); ///< Get the edges using ouput @param values (type int[ 2*nbEdges ]) of the SofaPhysicsOutputMesh with name: @param name. Return error code.
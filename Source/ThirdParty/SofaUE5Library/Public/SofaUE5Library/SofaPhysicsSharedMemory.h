@@ -0,0 +1,200 @@
+/******************************************************************************
+*                 SOFA, Simulation Open-Framework Architecture                *
+*                    (c) 2006 INRIA, USTL, UJF, CNRS, MGH                     *
+*                                                                             *
+* This program is free software; you can redistribute it and/or modify it     *
+* under the terms of the GNU General Public License as published by the Free  *
+* Software Foundation; either version 2 of the License, or (at your option)   *
+* any later version.                                                          *
+*                                                                             *
+* This program is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or       *
+* FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for    *
+* more details.                                                               *
+*                                                                             *
+* You should have received a copy of the GNU General Public License along     *
+* with this program. If not, see <http://www.gnu.org/licenses/>.              *
+*******************************************************************************
+* Authors: The SOFA Team and external contributors (see Authors.txt)          *
+*                                                                             *
+* Contact information: contact@sofa-framework.org                             *
+******************************************************************************/
+#pragma once
+
+/// Shared memory protocol between an application (the UE plugin) and the SofaPhysicsHost process running the simulation.
+/// The application creates the region, the host maps it by name. Layout, from the start of the region:
+///  - SofaPhysicsShmHeader: state, heartbeat, command queue and mesh table
+///  - topology block: triangle indices (uint32, 3 per triangle, quads split in 2) then texture coordinates (float, 2 per vertex)
+///  - SOFA_SHM_FRAME_SLOTS frames: SofaPhysicsShmFrame then positions and normals (float, 3 per vertex)
+/// Capacities are fixed at creation, summed over all meshes of the scene.
+/// Only lock free atomics are placed in the region, they work across processes.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+#define SOFA_SHM_MAGIC 0x534F4641u      ///< 'SOFA'
+#define SOFA_SHM_VERSION 1u
+#define SOFA_SHM_COMMAND_SLOTS 64u      ///< capacity of the command queue, power of 2
+#define SOFA_SHM_FRAME_SLOTS 3u         ///< frames in the ring: one read, one written, one spare
+#define SOFA_SHM_MAX_MESHES 32u
+#define SOFA_SHM_NAME_SIZE 64u
+#define SOFA_SHM_TEXT_SIZE 512u
+
+/// Host state, SofaPhysicsShmHeader::hostState
+#define SOFA_SHM_HOST_STARTING 0u       ///< process started, SOFA not initialized yet
+#define SOFA_SHM_HOST_READY 1u          ///< SOFA initialized, no scene
+#define SOFA_SHM_HOST_LOADED 2u         ///< scene loaded, topology block and mesh table valid
+#define SOFA_SHM_HOST_ERROR 3u          ///< last load failed, see SofaPhysicsShmHeader::error
+#define SOFA_SHM_HOST_EXITED 4u         ///< host left its loop
+
+/// Command types, SofaPhysicsShmCommand::type
+#define SOFA_SHM_CMD_LOAD 1u            ///< text: scene file path
+#define SOFA_SHM_CMD_UNLOAD 2u
+#define SOFA_SHM_CMD_STEP 3u            ///< consecutive steps queued before the host wakes up are done one after the other
+#define SOFA_SHM_CMD_RESET 4u
+#define SOFA_SHM_CMD_SET_TIMESTEP 5u    ///< values[0]
+#define SOFA_SHM_CMD_SET_GRAVITY 6u     ///< values[0..2]
+#define SOFA_SHM_CMD_WAKE_UP 7u
+#define SOFA_SHM_CMD_SEND_VALUE 8u      ///< text: controller name, values[0]
+#define SOFA_SHM_CMD_QUIT 9u
+
+struct SofaPhysicsShmCommand
+{
+    uint32_t type;
+    uint32_t id;                        ///< increasing, echoed in SofaPhysicsShmHeader::lastCommandId once processed
+    double values[3];
+    char text[SOFA_SHM_TEXT_SIZE];
+};
+
+/// One output mesh of the loaded scene, offsets in elements of the topology block and of the frame data
+struct SofaPhysicsShmMesh
+{
+    char name[SOFA_SHM_NAME_SIZE];
+    uint32_t nbVertices;
+    uint32_t nbTriangles;               ///< triangles + 2 per quad
+    uint32_t firstVertex;               ///< into positions/normals of a frame and texture coordinates
+    uint32_t firstIndex;                ///< into the indices of the topology block
+};
+
+/// Header of a frame slot, followed by maxVertices positions then maxVertices normals
+struct alignas(64) SofaPhysicsShmFrame
+{
+    std::atomic<uint64_t> sequence;     ///< odd while the host writes the slot, a reader discards what it read if it changed meanwhile
+    uint64_t frameId;
+    uint32_t lastCommandId;             ///< last command processed before this frame
+    uint32_t topologyRevision;
+    double simulationTime;
+    double stepDurationMs;
+};
+
+struct alignas(64) SofaPhysicsShmHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t totalSize;
+    uint32_t maxVertices;
+    uint32_t maxTriangles;
+
+    std::atomic<uint32_t> hostState;
+    std::atomic<uint64_t> heartbeat;    ///< incremented by the host at each loop, a client seeing it stall considers the host hung
+    std::atomic<uint32_t> lastCommandId;
+    char error[SOFA_SHM_TEXT_SIZE];
+
+    /// Single producer (application) / single consumer (host) ring
+    alignas(64) std::atomic<uint32_t> commandHead;
+    alignas(64) std::atomic<uint32_t> commandTail;
+    SofaPhysicsShmCommand commands[SOFA_SHM_COMMAND_SLOTS];
+
+    /// Written by the host before it sets SOFA_SHM_HOST_LOADED, then read only until the next load
+    std::atomic<uint32_t> topologyRevision;
+    uint32_t nbMeshes;
+    SofaPhysicsShmMesh meshes[SOFA_SHM_MAX_MESHES];
+
+    /// frameId of the newest complete frame, in slot frameId % SOFA_SHM_FRAME_SLOTS. 0 before the first frame
+    alignas(64) std::atomic<uint64_t> latestFrame;
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<uint64_t>::is_always_lock_free, "shared memory atomics must be lock free");
+
+inline std::size_t sofaShmTopologyOffset() { return sizeof(SofaPhysicsShmHeader); }
+
+inline std::size_t sofaShmFrameSize(uint32_t maxVertices)
+{
+    const std::size_t size = sizeof(SofaPhysicsShmFrame) + std::size_t(maxVertices) * 6 * sizeof(float);
+    return (size + 63) & ~std::size_t(63);
+}
+
+inline std::size_t sofaShmFrameOffset(uint32_t maxVertices, uint32_t maxTriangles, uint32_t slot)
+{
+    const std::size_t topologySize = std::size_t(maxTriangles) * 3 * sizeof(uint32_t) + std::size_t(maxVertices) * 2 * sizeof(float);
+    return ((sofaShmTopologyOffset() + topologySize + 63) & ~std::size_t(63)) + slot * sofaShmFrameSize(maxVertices);
+}
+
+/// Size of a region for the given capacities
+inline std::size_t sofaShmRegionSize(uint32_t maxVertices, uint32_t maxTriangles)
+{
+    return sofaShmFrameOffset(maxVertices, maxTriangles, SOFA_SHM_FRAME_SLOTS);
+}
+
+inline uint32_t* sofaShmIndices(SofaPhysicsShmHeader* header)
+{
+    return reinterpret_cast<uint32_t*>(reinterpret_cast<char*>(header) + sofaShmTopologyOffset());
+}
+
+inline float* sofaShmTexCoords(SofaPhysicsShmHeader* header)
+{
+    return reinterpret_cast<float*>(sofaShmIndices(header) + std::size_t(header->maxTriangles) * 3);
+}
+
+inline SofaPhysicsShmFrame* sofaShmFrame(SofaPhysicsShmHeader* header, uint64_t frameId)
+{
+    const uint32_t slot = static_cast<uint32_t>(frameId % SOFA_SHM_FRAME_SLOTS);
+    return reinterpret_cast<SofaPhysicsShmFrame*>(reinterpret_cast<char*>(header) + sofaShmFrameOffset(header->maxVertices, header->maxTriangles, slot));
+}
+
+/// Positions of a frame, normals follow at + 3 * maxVertices
+inline float* sofaShmFramePositions(SofaPhysicsShmFrame* frame)
+{
+    return reinterpret_cast<float*>(frame + 1);
+}
+
+/// Initialize a freshly created region. Not thread safe, done before the host is started
+inline void sofaShmInitRegion(void* region, uint32_t maxVertices, uint32_t maxTriangles)
+{
+    std::memset(region, 0, sofaShmRegionSize(maxVertices, maxTriangles));
+    SofaPhysicsShmHeader* header = new (region) SofaPhysicsShmHeader();
+    header->magic = SOFA_SHM_MAGIC;
+    header->version = SOFA_SHM_VERSION;
+    header->totalSize = sofaShmRegionSize(maxVertices, maxTriangles);
+    header->maxVertices = maxVertices;
+    header->maxTriangles = maxTriangles;
+    for (uint32_t slot = 0; slot < SOFA_SHM_FRAME_SLOTS; ++slot)
+        new (sofaShmFrame(header, slot)) SofaPhysicsShmFrame();
+}
+
+/// Producer side: copy @param command into the queue. Return false if the queue is full
+inline bool sofaShmPushCommand(SofaPhysicsShmHeader* header, const SofaPhysicsShmCommand& command)
+{
+    const uint32_t head = header->commandHead.load(std::memory_order_relaxed);
+    if (head - header->commandTail.load(std::memory_order_acquire) >= SOFA_SHM_COMMAND_SLOTS)
+        return false;
+
+    header->commands[head % SOFA_SHM_COMMAND_SLOTS] = command;
+    header->commandHead.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+/// Consumer side: move the oldest command into @param command. Return false if the queue is empty
+inline bool sofaShmPopCommand(SofaPhysicsShmHeader* header, SofaPhysicsShmCommand& command)
+{
+    const uint32_t tail = header->commandTail.load(std::memory_order_relaxed);
+    if (tail == header->commandHead.load(std::memory_order_acquire))
+        return false;
+
+    command = header->commands[tail % SOFA_SHM_COMMAND_SLOTS];
+    header->commandTail.store(tail + 1, std::memory_order_release);
+    return true;
+}
@@ -0,0 +1,443 @@
+/******************************************************************************
+*                 SOFA, Simulation Open-Framework Architecture                *
+*                    (c) 2006 INRIA, USTL, UJF, CNRS, MGH                     *
+*                                                                             *
+* This program is free software; you can redistribute it and/or modify it     *
+* under the terms of the GNU General Public License as published by the Free  *
+* Software Foundation; either version 2 of the License, or (at your option)   *
+* any later version.                                                          *
+*                                                                             *
+* This program is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or       *
+* FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for    *
+* more details.                                                               *
+*                                                                             *
+* You should have received a copy of the GNU General Public License along     *
+* with this program. If not, see <http://www.gnu.org/licenses/>.              *
+*******************************************************************************
+* Authors: The SOFA Team and external contributors (see Authors.txt)          *
+*                                                                             *
+* Contact information: contact@sofa-framework.org                             *
+******************************************************************************/
+#pragma once
+
+/// Bounding volume hierarchy over a deforming triangle mesh, header only so the SofaPhysicsAPI library
+/// (SofaPhysicsOutputMesh::raycast) and the UE plugin (FSofaTriangleBVH) share one implementation.
+/// The tree is built once from the topology, then only the node boxes are refit from the new positions,
+/// which is linear in the number of triangles and keeps the tree valid as long as the topology does not change.
+/// Positions are never stored: build, refit and raycast read them through a functor vertex(i) returning
+/// something indexable by [0..2], so each side keeps its own vertex storage.
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+template <class Real>
+class SofaPhysicsTriangleBVH
+{
+public:
+    /// Closest hit of raycast or closest point of closestPoint, in the space of the vertices
+    struct Hit
+    {
+        Real distance = 0;
+        int triangle = -1;  ///< triangle index in the index buffer given to build
+        Real u = 0;         ///< barycentric weight of the 2nd triangle vertex
+        Real v = 0;         ///< barycentric weight of the 3rd triangle vertex, the 1st one being 1 - u - v
+    };
+
+    static constexpr int LeafSize = 4;
+    static constexpr int MaxDepth = 32;
+
+    /// Build the tree over @param nbTriangles triangles of @param indices, 3 per triangle
+    template <class Vertex, class IndexT>
+    void build(const Vertex& vertex, const IndexT* indices, int nbTriangles)
+    {
+        reset();
+        if (nbTriangles <= 0)
+            return;
+
+        std::vector<Real> centroids(std::size_t(nbTriangles) * 3);
+        m_triIds.resize(nbTriangles);
+        for (int t = 0; t < nbTriangles; ++t)
+        {
+            for (int c = 0; c < 3; ++c)
+                centroids[t * 3 + c] = (Real(vertex(int(indices[t * 3]))[c]) + Real(vertex(int(indices[t * 3 + 1]))[c]) + Real(vertex(int(indices[t * 3 + 2]))[c])) / Real(3);
+            m_triIds[t] = t;
+        }
+
+        m_nodes.reserve(2 * std::size_t(nbTriangles));
+        m_nodes.emplace_back();
+        buildNode(centroids, 0, 0, nbTriangles, 0);
+
+        // Copy the indices in leaf order so refit and raycast walk them linearly
+        m_indices.resize(std::size_t(nbTriangles) * 3);
+        for (int i = 0; i < nbTriangles; ++i)
+        {
+            for (int k = 0; k < 3; ++k)
+                m_indices[i * 3 + k] = int(indices[m_triIds[i] * 3 + k]);
+        }
+
+        m_moved.assign(m_nodes.size(), 1);
+        refitMoved(vertex);
+    }
+
+    /// Recompute all node boxes from the new positions, same vertex count as in build
+    template <class Vertex>
+    void refit(const Vertex& vertex)
+    {
+        refitIf(vertex, [](int, int) { return true; });
+    }
+
+    /// Recompute the boxes of the leaves for which @param leafMoved(first, last) is true, and of their ancestors only.
+    /// first and last delimit the leaf vertex indices in getLeafIndices(), last excluded.
+    template <class Vertex, class LeafMoved>
+    void refitIf(const Vertex& vertex, const LeafMoved& leafMoved)
+    {
+        for (std::size_t n = 0; n < m_nodes.size(); ++n)
+        {
+            const Node& node = m_nodes[n];
+            m_moved[n] = node.count > 0 && leafMoved(node.first * 3, (node.first + node.count) * 3);
+        }
+        refitMoved(vertex);
+    }
+
+    /// Closest triangle hit by the ray @param origin + t * @param direction, t in [0, @param maxDistance]. direction must be normalized. Both faces are hit
+    template <class Vertex>
+    bool raycast(const Vertex& vertex, const Real* origin, const Real* direction, Real maxDistance, Hit& hit) const
+    {
+        if (m_nodes.empty())
+            return false;
+
+        Real invDir[3];
+        for (int c = 0; c < 3; ++c)
+            invDir[c] = direction[c] != 0 ? Real(1) / direction[c] : std::numeric_limits<Real>::max();
+
+        // Slab test, returns the entry distance or a negative value if the box is missed
+        auto intersectBox = [&](const Node& node, Real tMax) -> Real
+        {
+            Real tEnter = 0;
+            Real tExit = tMax;
+            for (int c = 0; c < 3; ++c)
+            {
+                const Real t0 = (node.min[c] - origin[c]) * invDir[c];
+                const Real t1 = (node.max[c] - origin[c]) * invDir[c];
+                tEnter = std::max(tEnter, std::min(t0, t1));
+                tExit = std::min(tExit, std::max(t0, t1));
+            }
+            return tEnter <= tExit ? tEnter : Real(-1);
+        };
+
+        bool found = false;
+        Real closest = maxDistance;
+
+        int stack[MaxDepth * 2 + 2];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0)
+        {
+            const Node& node = m_nodes[stack[--stackSize]];
+            if (intersectBox(node, closest) < 0)
+                continue;
+
+            if (node.count == 0)
+            {
+                // Nearest child on top of the stack, so the farthest one is more likely culled
+                const Real dLeft = intersectBox(m_nodes[node.first], closest);
+                const Real dRight = intersectBox(m_nodes[node.first + 1], closest);
+                const bool leftFirst = dLeft >= 0 && (dRight < 0 || dLeft <= dRight);
+                if (leftFirst)
+                {
+                    if (dRight >= 0) stack[stackSize++] = node.first + 1;
+                    stack[stackSize++] = node.first;
+                }
+                else
+                {
+                    if (dLeft >= 0) stack[stackSize++] = node.first;
+                    if (dRight >= 0) stack[stackSize++] = node.first + 1;
+                }
+                continue;
+            }
+
+            // Moller-Trumbore
+            for (int i = node.first; i < node.first + node.count; ++i)
+            {
+                Real a[3], e1[3], e2[3];
+                for (int c = 0; c < 3; ++c)
+                {
+                    a[c] = Real(vertex(m_indices[i * 3])[c]);
+                    e1[c] = Real(vertex(m_indices[i * 3 + 1])[c]) - a[c];
+                    e2[c] = Real(vertex(m_indices[i * 3 + 2])[c]) - a[c];
+                }
+                Real p[3];
+                cross(direction, e2, p);
+                const Real det = dot(e1, p);
+                if (std::abs(det) < std::numeric_limits<Real>::epsilon())
+                    continue;
+
+                const Real invDet = Real(1) / det;
+                const Real s[3] = { origin[0] - a[0], origin[1] - a[1], origin[2] - a[2] };
+                const Real u = dot(s, p) * invDet;
+                if (u < 0 || u > 1)
+                    continue;
+
+                Real q[3];
+                cross(s, e1, q);
+                const Real v = dot(direction, q) * invDet;
+                if (v < 0 || u + v > 1)
+                    continue;
+
+                const Real t = dot(e2, q) * invDet;
+                if (t < 0 || t > closest)
+                    continue;
+
+                closest = t;
+                found = true;
+                hit.distance = t;
+                hit.triangle = m_triIds[i];
+                hit.u = u;
+                hit.v = v;
+            }
+        }
+        return found;
+    }
+
+    /// Closest point of the surface to @param point within @param maxDistance. hit.distance is the distance to it, u and v its barycentric weights
+    template <class Vertex>
+    bool closestPoint(const Vertex& vertex, const Real* point, Real maxDistance, Hit& hit) const
+    {
+        if (m_nodes.empty())
+            return false;
+
+        // Squared distance from the point to a node box, 0 inside
+        auto boxDistance2 = [&](const Node& node)
+        {
+            Real d2 = 0;
+            for (int c = 0; c < 3; ++c)
+            {
+                const Real d = std::max(std::max(node.min[c] - point[c], point[c] - node.max[c]), Real(0));
+                d2 += d * d;
+            }
+            return d2;
+        };
+
+        bool found = false;
+        Real closest2 = maxDistance * maxDistance;
+
+        int stack[MaxDepth * 2 + 2];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0)
+        {
+            const Node& node = m_nodes[stack[--stackSize]];
+            if (boxDistance2(node) > closest2)
+                continue;
+
+            if (node.count == 0)
+            {
+                // Nearest child on top of the stack, it usually shrinks closest2 before the other one is tested
+                const bool leftFirst = boxDistance2(m_nodes[node.first]) <= boxDistance2(m_nodes[node.first + 1]);
+                stack[stackSize++] = leftFirst ? node.first + 1 : node.first;
+                stack[stackSize++] = leftFirst ? node.first : node.first + 1;
+                continue;
+            }
+
+            for (int i = node.first; i < node.first + node.count; ++i)
+            {
+                Real a[3], b[3], c[3];
+                for (int k = 0; k < 3; ++k)
+                {
+                    a[k] = Real(vertex(m_indices[i * 3])[k]);
+                    b[k] = Real(vertex(m_indices[i * 3 + 1])[k]);
+                    c[k] = Real(vertex(m_indices[i * 3 + 2])[k]);
+                }
+
+                Real u, v;
+                closestOnTriangle(point, a, b, c, u, v);
+                Real d2 = 0;
+                for (int k = 0; k < 3; ++k)
+                {
+                    const Real d = point[k] - (a[k] + u * (b[k] - a[k]) + v * (c[k] - a[k]));
+                    d2 += d * d;
+                }
+                if (d2 > closest2)
+                    continue;
+
+                closest2 = d2;
+                found = true;
+                hit.distance = std::sqrt(d2);
+                hit.triangle = m_triIds[i];
+                hit.u = u;
+                hit.v = v;
+            }
+        }
+        return found;
+    }
+
+    bool isValid() const { return !m_nodes.empty(); }
+
+    void reset()
+    {
+        m_nodes.clear();
+        m_triIds.clear();
+        m_indices.clear();
+        m_moved.clear();
+    }
+
+    /// Vertex indices in leaf order, 3 per triangle
+    const std::vector<int>& getLeafIndices() const { return m_indices; }
+
+protected:
+    struct Node
+    {
+        Real min[3] = { 0, 0, 0 };
+        Real max[3] = { 0, 0, 0 };
+        int first = 0; ///< leaf: first entry in m_triIds, inner node: left child, the right one follows it
+        int count = 0; ///< number of triangles of a leaf, 0 for an inner node
+    };
+
+    static Real dot(const Real* a, const Real* b) { return a[0] * b[0] + a[1] * b[1] + a[2] * b[2]; }
+    static void cross(const Real* a, const Real* b, Real* out)
+    {
+        out[0] = a[1] * b[2] - a[2] * b[1];
+        out[1] = a[2] * b[0] - a[0] * b[2];
+        out[2] = a[0] * b[1] - a[1] * b[0];
+    }
+
+    /// Barycentric weights @param u of @param b and @param v of @param c of the point of the triangle closest to @param p, by Voronoi region (Ericson, Real-Time Collision Detection 5.1.5)
+    static void closestOnTriangle(const Real* p, const Real* a, const Real* b, const Real* c, Real& u, Real& v)
+    {
+        const Real ab[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+        const Real ac[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+        const Real ap[3] = { p[0] - a[0], p[1] - a[1], p[2] - a[2] };
+        const Real d1 = dot(ab, ap);
+        const Real d2 = dot(ac, ap);
+        if (d1 <= 0 && d2 <= 0) { u = 0; v = 0; return; }
+
+        const Real bp[3] = { p[0] - b[0], p[1] - b[1], p[2] - b[2] };
+        const Real d3 = dot(ab, bp);
+        const Real d4 = dot(ac, bp);
+        if (d3 >= 0 && d4 <= d3) { u = 1; v = 0; return; }
+
+        const Real vc = d1 * d4 - d3 * d2;
+        if (vc <= 0 && d1 >= 0 && d3 <= 0) { u = d1 / (d1 - d3); v = 0; return; }
+
+        const Real cp[3] = { p[0] - c[0], p[1] - c[1], p[2] - c[2] };
+        const Real d5 = dot(ab, cp);
+        const Real d6 = dot(ac, cp);
+        if (d6 >= 0 && d5 <= d6) { u = 0; v = 1; return; }
+
+        const Real vb = d5 * d2 - d1 * d6;
+        if (vb <= 0 && d2 >= 0 && d6 <= 0) { u = 0; v = d2 / (d2 - d6); return; }
+
+        const Real va = d3 * d6 - d5 * d4;
+        if (va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0)
+        {
+            const Real w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+            u = 1 - w;
+            v = w;
+            return;
+        }
+
+        // Inside the face. Degenerate triangles end here with a zero denominator, fall back to the first vertex
+        const Real sum = va + vb + vc;
+        if (sum == 0) { u = 0; v = 0; return; }
+        u = vb / sum;
+        v = vc / sum;
+    }
+
+    /// Split the triangles [first, first + count[ of m_triIds under the node nodeId
+    void buildNode(const std::vector<Real>& centroids, int nodeId, int first, int count, int depth)
+    {
+        // Loop on the right child, recurse on the left one. Depth is capped so raycast can use a fixed size stack
+        for (; ; ++depth)
+        {
+            if (count <= LeafSize || depth >= MaxDepth)
+            {
+                m_nodes[nodeId].first = first;
+                m_nodes[nodeId].count = count;
+                return;
+            }
+
+            // Split at the middle of the centroid box, along its largest axis
+            Real cMin[3] = { std::numeric_limits<Real>::max(), std::numeric_limits<Real>::max(), std::numeric_limits<Real>::max() };
+            Real cMax[3] = { -cMin[0], -cMin[1], -cMin[2] };
+            for (int i = first; i < first + count; ++i)
+            {
+                const Real* c = &centroids[m_triIds[i] * 3];
+                for (int k = 0; k < 3; ++k)
+                {
+                    cMin[k] = std::min(cMin[k], c[k]);
+                    cMax[k] = std::max(cMax[k], c[k]);
+                }
+            }
+            const Real extent[3] = { cMax[0] - cMin[0], cMax[1] - cMin[1], cMax[2] - cMin[2] };
+            const int axis = (extent[0] >= extent[1] && extent[0] >= extent[2]) ? 0 : (extent[1] >= extent[2] ? 1 : 2);
+            const Real split = (cMin[axis] + cMax[axis]) * Real(0.5);
+
+            int* begin = m_triIds.data() + first;
+            int mid = first + int(std::partition(begin, begin + count, [&](int t) { return centroids[t * 3 + axis] < split; }) - begin);
+
+            // All centroids on one side (coincident triangles): split by count
+            if (mid == first || mid == first + count)
+                mid = first + count / 2;
+
+            const int leftId = int(m_nodes.size());
+            m_nodes.resize(m_nodes.size() + 2);
+            m_nodes[nodeId].first = leftId;
+            m_nodes[nodeId].count = 0;
+
+            buildNode(centroids, leftId, first, mid - first, depth + 1);
+
+            nodeId = leftId + 1;
+            count = first + count - mid;
+            first = mid;
+        }
+    }
+
+    /// Children are stored after their parent, so a reverse sweep is bottom-up. Only nodes flagged in m_moved, or with a flagged child, are recomputed
+    template <class Vertex>
+    void refitMoved(const Vertex& vertex)
+    {
+        for (int n = int(m_nodes.size()) - 1; n >= 0; --n)
+        {
+            Node& node = m_nodes[n];
+            if (node.count > 0)
+            {
+                if (!m_moved[n])
+                    continue;
+
+                for (int c = 0; c < 3; ++c)
+                    node.min[c] = node.max[c] = Real(vertex(m_indices[node.first * 3])[c]);
+                for (int k = node.first * 3 + 1; k < (node.first + node.count) * 3; ++k)
+                {
+                    const auto& p = vertex(m_indices[k]);
+                    for (int c = 0; c < 3; ++c)
+                    {
+                        node.min[c] = std::min(node.min[c], Real(p[c]));
+                        node.max[c] = std::max(node.max[c], Real(p[c]));
+                    }
+                }
+            }
+            else
+            {
+                m_moved[n] = m_moved[node.first] || m_moved[node.first + 1];
+                if (!m_moved[n])
+                    continue;
+
+                const Node& left = m_nodes[node.first];
+                const Node& right = m_nodes[node.first + 1];
+                for (int c = 0; c < 3; ++c)
+                {
+                    node.min[c] = std::min(left.min[c], right.min[c]);
+                    node.max[c] = std::max(left.max[c], right.max[c]);
+                }
+            }
+        }
+    }
+
+    std::vector<Node> m_nodes;
+    std::vector<int> m_triIds;      ///< triangle ids in leaf order
+    std::vector<int> m_indices;     ///< vertex indices in leaf order, 3 per entry of m_triIds
+    std::vector<char> m_moved;      ///< per node, set when its box has to be recomputed
+};
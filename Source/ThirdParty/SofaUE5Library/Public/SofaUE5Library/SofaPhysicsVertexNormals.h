@@ -0,0 +1,164 @@
+/******************************************************************************
+*                 SOFA, Simulation Open-Framework Architecture                *
+*                    (c) 2006 INRIA, USTL, UJF, CNRS, MGH                     *
+*                                                                             *
+* This program is free software; you can redistribute it and/or modify it     *
+* under the terms of the GNU General Public License as published by the Free  *
+* Software Foundation; either version 2 of the License, or (at your option)   *
+* any later version.                                                          *
+*                                                                             *
+* This program is distributed in the hope that it will be useful, but WITHOUT *
+* ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or       *
+* FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for    *
+* more details.                                                               *
+*                                                                             *
+* You should have received a copy of the GNU General Public License along     *
+* with this program. If not, see <http://www.gnu.org/licenses/>.              *
+*******************************************************************************
+* Authors: The SOFA Team and external contributors (see Authors.txt)          *
+*                                                                             *
+* Contact information: contact@sofa-framework.org                             *
+******************************************************************************/
+#pragma once
+
+/// Smooth vertex normals over a triangle mesh, header only so the UE plugin (FSofaMeshSection) and SofaPhysicsBenchmark share one implementation.
+/// The vertex -> triangle adjacency is built once from the topology in CSR form. Each update then writes one area weighted face normal per
+/// triangle and gathers them per vertex: every task only writes its own slot, so both passes run in parallel without atomics.
+/// Positions are read through a functor vertex(i) returning something indexable by [0..2], the loops through a functor
+/// parallelFor(count, body) calling body(i) for i in [0, count), so each side keeps its own storage and task system.
+/// Render vertices duplicated along UV seams can be welded: the adjacency is then built over the welded ids, each welded vertex
+/// gathers the faces of all its duplicates and the result is scattered back, so both sides of a seam get the same normal.
+
+#include <cmath>
+#include <vector>
+
+template <class Real>
+class SofaPhysicsVertexNormals
+{
+public:
+    /// Build the adjacency of @param nbTriangles triangles of @param indices, 3 per triangle, over @param nbVertices vertices.
+    /// Optional @param weld gives the welded id, in [0, @param nbWelded), of each of the nbVertices vertices
+    template <class IndexT>
+    void build(const IndexT* indices, int nbTriangles, int nbVertices, const int* weld = nullptr, int nbWelded = 0)
+    {
+        reset();
+        if (nbVertices <= 0)
+            return;
+
+        m_nbVertices = nbVertices;
+        if (weld != nullptr && nbWelded > 0)
+        {
+            m_weld.assign(weld, weld + nbVertices);
+            m_weldedNormals.resize(std::size_t(nbWelded) * 3);
+        }
+        const int nbAdjacent = m_weld.empty() ? nbVertices : nbWelded;
+
+        // Count triangles around each vertex, then prefix sum into offsets
+        m_offsets.assign(std::size_t(nbAdjacent) + 1, 0);
+        for (int i = 0; i < nbTriangles * 3; ++i)
+            ++m_offsets[std::size_t(getWeldedVertex(int(indices[i]))) + 1];
+        for (int v = 0; v < nbAdjacent; ++v)
+            m_offsets[v + 1] += m_offsets[v];
+
+        // Fill triangle ids, a quad split in two triangles has both halves referenced
+        std::vector<int> cursor(m_offsets.begin(), m_offsets.end() - 1);
+        m_vertexTriangles.resize(std::size_t(nbTriangles) * 3);
+        for (int t = 0; t < nbTriangles; ++t)
+        {
+            for (int c = 0; c < 3; ++c)
+                m_vertexTriangles[cursor[getWeldedVertex(int(indices[t * 3 + c]))]++] = t;
+        }
+
+        m_faceNormals.resize(std::size_t(nbTriangles) * 3);
+    }
+
+    void reset()
+    {
+        m_nbVertices = 0;
+        m_weld.clear();
+        m_offsets.clear();
+        m_vertexTriangles.clear();
+        m_faceNormals.clear();
+        m_weldedNormals.clear();
+    }
+
+    /// Number of vertices given to build, the ones compute outputs
+    int getNbVertices() const { return m_nbVertices; }
+    int getNbTriangles() const { return int(m_faceNormals.size() / 3); }
+
+    /// Welded id of vertex @param v, v itself when build had no weld
+    int getWeldedVertex(int v) const { return m_weld.empty() ? v : m_weld[v]; }
+
+    /// Triangles around welded vertex @param w are getVertexTriangles()[getFirstTriangle(w) .. getFirstTriangle(w + 1) - 1].
+    /// With a weld they include the triangles of every duplicate of w
+    int getFirstTriangle(int w) const { return m_offsets[w]; }
+    const std::vector<int>& getVertexTriangles() const { return m_vertexTriangles; }
+
+    /// Compute the normals of the positions given by @param vertex over the triangles of @param indices, the index buffer given to build.
+    /// Each normal is written by output(v, x, y, z), normalized, multiplied by @param sign, zero for an isolated vertex
+    template <class Vertex, class IndexT, class ParallelFor, class Output>
+    void compute(const Vertex& vertex, const IndexT* indices, const ParallelFor& parallelFor, const Output& output, Real sign = Real(1))
+    {
+        // Area weighted face normals, same orientation as SOFA: (b - a) x (c - a)
+        Real* faceNormals = m_faceNormals.data();
+        parallelFor(getNbTriangles(), [&](int t)
+        {
+            const auto& a = vertex(indices[t * 3]);
+            const auto& b = vertex(indices[t * 3 + 1]);
+            const auto& c = vertex(indices[t * 3 + 2]);
+            const Real ab[3] = { Real(b[0] - a[0]), Real(b[1] - a[1]), Real(b[2] - a[2]) };
+            const Real ac[3] = { Real(c[0] - a[0]), Real(c[1] - a[1]), Real(c[2] - a[2]) };
+            faceNormals[t * 3] = ab[1] * ac[2] - ab[2] * ac[1];
+            faceNormals[t * 3 + 1] = ab[2] * ac[0] - ab[0] * ac[2];
+            faceNormals[t * 3 + 2] = ab[0] * ac[1] - ab[1] * ac[0];
+        });
+
+        // Gather per vertex, or per welded vertex then scatter to the duplicates
+        auto gather = [&](int w, Real* n)
+        {
+            n[0] = n[1] = n[2] = Real(0);
+            for (int k = m_offsets[w]; k < m_offsets[w + 1]; ++k)
+            {
+                const Real* face = faceNormals + std::size_t(m_vertexTriangles[k]) * 3;
+                n[0] += face[0];
+                n[1] += face[1];
+                n[2] += face[2];
+            }
+            const Real length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+            const Real scale = length > Real(0) ? sign / length : Real(0);
+            n[0] *= scale;
+            n[1] *= scale;
+            n[2] *= scale;
+        };
+
+        if (m_weld.empty())
+        {
+            parallelFor(m_nbVertices, [&](int v)
+            {
+                Real n[3];
+                gather(v, n);
+                output(v, n[0], n[1], n[2]);
+            });
+            return;
+        }
+
+        Real* weldedNormals = m_weldedNormals.data();
+        parallelFor(int(m_offsets.size()) - 1, [&](int w) { gather(w, weldedNormals + std::size_t(w) * 3); });
+        parallelFor(m_nbVertices, [&](int v)
+        {
+            const Real* n = weldedNormals + std::size_t(m_weld[v]) * 3;
+            output(v, n[0], n[1], n[2]);
+        });
+    }
+
+private:
+    int m_nbVertices = 0;
+    /// Welded id of each vertex, empty without weld
+    std::vector<int> m_weld;
+    std::vector<int> m_offsets;
+    std::vector<int> m_vertexTriangles;
+    /// Scratch of compute, 3 per triangle
+    std::vector<Real> m_faceNormals;
+    /// Scratch of compute with a weld, 3 per welded vertex
+    std::vector<Real> m_weldedNormals;
+};
@@ -21,6 +21,12 @@ public class SofaUE5Library : ModuleRules
 
 			// Ensure that the DLL is staged along with the executable
 			RuntimeDependencies.Add("$(PluginDir)/Binaries/ThirdParty/SofaUE5Library/Win64/SofaPhysicsAPI.dll");
+
+			// Out-of-process mode host, optional
+			if (File.Exists(Path.Combine(PluginDirectory, "Binaries", "ThirdParty", "SofaUE5Library", "Win64", "SofaPhysicsHost.exe")))
+			{
+				RuntimeDependencies.Add("$(PluginDir)/Binaries/ThirdParty/SofaUE5Library/Win64/SofaPhysicsHost.exe");
+			}
 		}
         else if (Target.Platform == UnrealTargetPlatform.Mac)
         {